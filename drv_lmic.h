@@ -11,6 +11,123 @@
 // TODO: Do not use HAL but api struct filled by board!
 #include "github.com/Lobaro/hal-stm32l151CB-A/hal.h"
 #include "lmic/hal.h"
+#include "lmic/oslmic.h"
+
+// Use the AUX band without duty cycle limit for all channels, testing only!
+// Otherwise the presets use AUX for 865 - 868 MHz.
+#ifndef LORA_RF_DUTY_TESTMODE
+#define LORA_RF_DUTY_TESTMODE 0
+#endif
+
+#define LMIC_PLAN_MAX_CHANNELS 16 // MAX_CHANNELS
+#define LMIC_PLAN_MAX_BANDS 4 // MAX_BANDS
+
+typedef struct {
+	uint32_t freq; // Hz
+	uint8_t drMin; // e.g. DR_SF12
+	uint8_t drMax; // e.g. DR_SF7
+	uint8_t band; // BAND_MILLI, BAND_CENTI, BAND_DECI or BAND_AUX
+} lmicChannelDef_t;
+
+typedef struct {
+	int8_t txPow; // dBm
+	uint16_t txCap; // 1/duty cycle: 1000 = 0.1%, 100 = 1%, 10 = 10%, 0 = keep LMIC default
+} lmicBandDef_t;
+
+typedef struct {
+	uint8_t numChannels;
+	lmicChannelDef_t channels[LMIC_PLAN_MAX_CHANNELS];
+	lmicBandDef_t bands[LMIC_PLAN_MAX_BANDS];
+	uint16_t enabledMask; // bit n enables channel n
+} lmicChannelPlan_t;
+
+typedef enum {
+	LMIC_PLAN_OK = 0,
+	LMIC_PLAN_ERR_CHANNEL_COUNT,
+	LMIC_PLAN_ERR_NO_CHANNEL, // no channel enabled
+	LMIC_PLAN_ERR_FREQUENCY, // outside of the region
+	LMIC_PLAN_ERR_DATARATE,
+	LMIC_PLAN_ERR_BAND,
+	LMIC_PLAN_ERR_DUTY_CYCLE, // band duty cycle above the regional limit
+	LMIC_PLAN_ERR_TXPOWER, // band power above the regional limit
+	LMIC_PLAN_ERR_SUB_BAND, // channels of one ETSI sub band in different bands
+} lmicPlanError_t;
+
+extern const lmicChannelPlan_t LMIC_PLAN_EU868_3CH;
+extern const lmicChannelPlan_t LMIC_PLAN_EU868_8CH;
+extern const lmicChannelPlan_t LMIC_PLAN_EU868_16CH;
+
+// Listen before talk, all zero = off
+typedef struct {
+	uint8_t mode; // LBT_OFF, LBT_RSSI or LBT_CAD
+	int8_t thresholdDbm; // LBT_RSSI: channel is busy above this level, e.g. -85
+	uint16_t backoffMs; // minimum backoff after a busy channel, up to 1s random is added
+	uint8_t maxDeferrals; // a frame deferred this often is sent regardless
+} lmicLbtCfg_t;
+
+typedef struct {
+	uint32_t checks; // channel assessments
+	uint32_t deferred; // TX deferred due to a busy channel
+	uint32_t forced; // TX sent on a busy channel after maxDeferrals
+} lmicLbtStats_t;
+
+// Energy ledger states. The baseline is always counted, the others add their current on top of it.
+typedef enum {
+	LMIC_ENERGY_BASE, // MCU in low power, radio asleep
+	LMIC_ENERGY_MCU, // LMIC task running
+	LMIC_ENERGY_STANDBY, // radio standby or synthesizer on
+	LMIC_ENERGY_RX, // radio receiving or in CAD
+	LMIC_ENERGY_TX,
+	LMIC_ENERGY_STATES
+} lmicEnergyState_t;
+
+#define LMIC_ENERGY_TX_MIN_DBM 2
+#define LMIC_ENERGY_TX_LEVELS 16 // 2 - 17 dBm, the SX1272 PA_BOOST range
+
+// Current per state in uA, measure them on the actual board
+typedef struct {
+	uint32_t baseUa;
+	uint32_t mcuUa;
+	uint32_t standbyUa;
+	uint32_t rxUa;
+	uint32_t txUa[LMIC_ENERGY_TX_LEVELS]; // index 0 = LMIC_ENERGY_TX_MIN_DBM
+} lmicEnergyProfile_t;
+
+extern const lmicEnergyProfile_t LMIC_ENERGY_PROFILE_SX1272;
+
+typedef struct {
+	uint32_t seconds; // accounted time
+	uint32_t mcuMs;
+	uint32_t standbyMs;
+	uint32_t rxMs;
+	uint32_t txMs;
+	uint32_t txMsPerLevel[LMIC_ENERGY_TX_LEVELS];
+	uint32_t uAh[LMIC_ENERGY_STATES]; // cumulative charge per state
+	uint32_t totalUAh;
+	uint32_t uplinks;
+	uint32_t lastUplinkNAh; // charge above the baseline since the previous uplink completed
+	uint32_t avgUplinkNAh;
+} lmicEnergyStats_t;
+
+// Time slotted uplinks, all zero = off. An uplink starts in the first half of the device's slot,
+// make slotMs at least twice the longest airtime. Slots are aligned to network time once
+// it is known (drv_lmic_requestNetworkTime()), before only to the local clock. Slots separate devices
+// with consecutive DevAddrs and a grid error well below slotMs, random DevAddrs collide as often as
+// without slots (test/slot_test.c).
+#define LMIC_SLOT_MAX_PERIOD_SEC (12 * 3600)
+typedef struct {
+	uint32_t periodSec; // e.g. 900 for a 15 minute report interval
+	uint16_t slotMs;
+	bool fixedSlot; // use slot instead of deriving it from the DevAddr, e.g. assigned by the network
+	uint16_t slot;
+} lmicSlotCfg_t;
+
+typedef struct {
+	uint16_t slot; // slot in use
+	uint16_t slots; // slots per period
+	bool synced; // aligned to network time
+	uint32_t nextMs; // until the slot opens, 0 = open now
+} lmicSlotInfo_t;
 
 typedef struct {
 	bool otaa;
@@ -24,8 +141,309 @@ typedef struct {
 	uint8_t netSessionKey[16]; // ABP
 	uint8_t appSessionKey[16]; // ABP
 	bool useLowPowerAntennaOutput;
+	const lmicChannelPlan_t* channelPlan; // NULL = LMIC_PLAN_EU868_3CH
+	lmicLbtCfg_t lbt;
+	uint16_t clockPpm; // clock error budget of the RX windows, 0 = default (RX_CLOCK_PPM)
+	const lmicEnergyProfile_t* energyProfile; // NULL = LMIC_ENERGY_PROFILE_SX1272
+	bool classC; // receive on RX2 between uplinks, for mains powered devices
+	lmicSlotCfg_t slots;
+	// Device side ADR, picks the fastest DR / lowest power keeping this margin (dB) over the
+	// demodulation floor, 0 = off. Use it with adr = false, a network LinkADRReq still applies.
+	// After 8 uplinks without any downlink it backs off to full power, then one DR slower.
+	uint8_t adrMarginDb;
+	uint8_t adrHysteresisDb; // extra margin before stepping to a faster DR / lower power
 } lmicCfg_t;
 
+// Counters of the LMIC task, wakeups / uplinks is the average scheduling cost per uplink
+typedef struct {
+	uint32_t wakeups; // task wakeups
+	uint32_t jobs; // LMIC jobs executed
+	uint32_t uplinks; // completed uplinks (EV_TXCOMPLETE)
+} lmicTaskStats_t;
+
+// Start of the last uplink. Without LBT the frame is built and the radio loaded TX_PREP ahead
+// of the planned TX time, so only the TX start is left when it is reached.
+typedef struct {
+	uint32_t prepUs; // frame build and radio setup
+	int32_t latencyUs; // planned TX time to RF start (wake-to-RF)
+	int32_t latencyMaxUs;
+	uint32_t preloaded; // uplinks started from a preloaded radio
+} lmicTxTiming_t;
+
+// Radio power policy and register shadow counters
+typedef struct {
+	uint32_t sleeps; // radio put to sleep after TX/RX
+	uint32_t standbys; // radio kept in standby, next TX/RX was too close
+	uint32_t regWrites; // configuration register writes
+	uint32_t regSkips; // writes skipped, the register already held the value
+} lmicRadioStats_t;
+
+// DIO0 interrupt latency, measured against the timer capture (LMIC_HAL_DIO0_CAPTURE)
+typedef struct {
+	uint32_t captures; // TX/RX done timestamps taken from the capture
+	uint32_t lastUs;
+	uint32_t maxUs;
+	uint32_t avgUs;
+} lmicIrqLatency_t;
+
+// Class A RX windows, averages per uplink. legacyUs is the timeout the fixed
+// MINRX_SYMS window would have used, modelUs the one from the clock error model.
+typedef struct {
+	uint32_t uplinks;
+	uint32_t onUs; // measured radio RX-on time
+	uint32_t modelUs;
+	uint32_t legacyUs;
+	int32_t biasUs; // calibrated downlink arrival offset
+	uint32_t devUs; // calibrated timestamp uncertainty (mean deviation)
+	uint8_t calibrations; // downlinks the calibration is based on, saturates at 255
+} lmicRxWindowStats_t;
+
+// Class C receiver. A downlink sent while the receiver is off (TX, RX1, restarts) is missed,
+// offMaxMs bounds the gap a network server retry has to cover.
+typedef struct {
+	uint32_t frames; // downlinks received outside of a transaction
+	uint32_t offMs; // time the receiver was off while class C was enabled
+	uint32_t offMaxMs;
+} lmicClassCStats_t;
+
+// Multicast group session, keys in the same byte order as netSessionKey / appSessionKey
+typedef struct {
+	uint32_t addr; // McAddr, 0 = unused
+	uint8_t nwkSKey[16]; // McNwkSKey
+	uint8_t appSKey[16]; // McAppSKey
+	uint32_t fcntDown; // next expected FCntDown
+} lmicMcastGroupDef_t;
+
+typedef struct {
+	uint32_t frames; // frames accepted
+	uint32_t micErrors; // address matched, MIC did not
+	uint32_t rejected; // old counter, confirmed, MAC commands or received outside ping slots / class C
+	uint32_t fcntDown; // next expected FCntDown
+} lmicMcastStats_t;
+
+// Fragmented data block transport (LoRaWAN TS004), see frag_lmic.c
+#define LMIC_FRAG_PORT 201
+#define LMIC_FRAG_MAX_FRAG_SIZE 61 // LMIC_DOWNLINK_MAX_LEN - CID - IndexAndN
+#define LMIC_FRAG_BITS(n) (((n) + 7) / 8)
+// Work memory for sessions of up to maxFrags fragments of which maxMissing may be lost
+#define LMIC_FRAG_WORKMEM_SIZE(maxFrags, maxMissing) \
+	(2 * (maxMissing) + 2 * LMIC_FRAG_BITS(maxFrags) + (2 + (maxMissing)) * LMIC_FRAG_BITS(maxMissing))
+
+typedef struct {
+	// Fragment storage of nbFrag * fragSize bytes, e.g. a flash area, fragments are written once
+	// before the first coded fragment and may be rewritten by the FEC decoder after it
+	bool (*write)(uint32_t offset, const uint8_t* data, uint8_t len, void* ctx);
+	bool (*read)(uint32_t offset, uint8_t* data, uint8_t len, void* ctx);
+	// Optional, new session of size bytes, e.g. erase the storage. false rejects the descriptor.
+	bool (*start)(uint32_t size, uint32_t descriptor, void* ctx);
+	// The image is complete in the storage, size excludes the padding
+	void (*complete)(uint32_t size, uint32_t descriptor, void* ctx);
+	void* ctx;
+	void* workMem; // LMIC_FRAG_WORKMEM_SIZE(maxFrags, maxMissing) bytes, 2 byte aligned
+	uint16_t maxFrags;
+	uint16_t maxMissing;
+	uint32_t maxSize; // storage capacity in bytes
+} lmicFragCfg_t;
+
+typedef enum {
+	LMIC_FRAG_IDLE,
+	LMIC_FRAG_RECEIVING,
+	LMIC_FRAG_COMPLETE,
+	LMIC_FRAG_FAILED, // storage error
+} lmicFragState_t;
+
+typedef struct {
+	lmicFragState_t state;
+	uint8_t index; // FragIndex
+	uint16_t nbFrag;
+	uint8_t fragSize;
+	uint16_t fragments; // data fragments received, including duplicates and redundant ones
+	uint16_t used; // fragments that added information
+	uint16_t missing; // fragments still needed
+	bool memoryShort; // more fragments lost than maxMissing, coded fragments are ignored
+} lmicFragStats_t;
+
+// GPS time (seconds since 1980-01-06, without leap seconds)
+typedef struct {
+	uint32_t seconds;
+	uint16_t ms;
+} lmicNetworkTime_t;
+
+typedef struct {
+	uint32_t syncs; // DeviceTimeAns received
+	uint32_t trims; // ostick rate corrections
+	int32_t ppm; // measured rate error of the ostick clock, positive = fast
+	int32_t lastErrorMs; // extrapolated minus network time at the last sync
+	uint32_t ageSec; // since the last sync
+	uint32_t errorMs; // added by sleep phases since the last sync (3 sigma of the 1 s RTC)
+} lmicTimeStats_t;
+
+typedef struct {
+	uint8_t samples; // link budget samples in the window
+	int8_t snrAt0dBm; // average uplink SNR (dB) estimated for 0 dBm TX power
+	uint32_t ups; // changes to a faster DR / lower power
+	uint32_t downs; // changes to a slower DR / higher power
+} lmicDeviceAdrStats_t;
+
+typedef enum {
+	LMIC_POWER_RUNNING, // systick and scheduler running
+	LMIC_POWER_DRAINING, // sleep requested, waiting for the LMIC task to acknowledge
+	LMIC_POWER_SLEEPING, // systick stopped, task blocked until drv_lmic_wakeup()
+} lmicPowerState_t;
+
+// Sleep / wakeup transition counters, durations in RTOS ticks
+typedef struct {
+	uint32_t sleeps;
+	uint32_t wakeups;
+	TickType_t lastSleepTicks;
+	TickType_t maxSleepTicks;
+	TickType_t lastWakeTicks;
+	TickType_t maxWakeTicks;
+} lmicPowerStats_t;
+
+typedef enum {
+	LMIC_TX_SENT, // unconfirmed uplink transmitted
+	LMIC_TX_ACKED, // confirmed uplink acknowledged by the network
+	LMIC_TX_NACKED, // confirmed uplink not acknowledged after all attempts
+	LMIC_TX_DROPPED, // overridden by a newer send before it completed
+	LMIC_TX_JOIN_FAILED, // OTAA join failed, the uplink was discarded
+} lmicTxStatus_t;
+
+typedef enum {
+	LMIC_ATTEMPT_NO_ANSWER, // nothing received in the RX windows
+	LMIC_ATTEMPT_DOWNLINK, // downlink received, but no ACK of a confirmed uplink
+	LMIC_ATTEMPT_ACKED,
+} lmicTxOutcome_t;
+
+#define LMIC_RETRY_MAX_ATTEMPTS 8 // TXCONF_MAX_ATTEMPTS
+
+typedef struct {
+	uint32_t offsetMs; // TX start after the first attempt
+	uint8_t dr;
+	uint8_t channel;
+	int8_t txPower; // dBm
+	lmicTxOutcome_t outcome;
+} lmicTxAttempt_t;
+
+typedef struct {
+	lmicTxStatus_t status;
+	uint32_t seqno; // FCntUp of the uplink
+	uint32_t airtimeMs; // airtime of all attempts
+	uint8_t dr; // datarate of the last attempt
+	uint8_t channel; // channel of the last attempt
+	uint8_t retries; // retransmissions of a confirmed uplink
+	int8_t txPower; // dBm of the last attempt
+	uint32_t expectedAirtimeMs; // one attempt at the DR chosen when the uplink was handed to LMIC
+	uint8_t attempts; // entries in attempt
+	lmicTxAttempt_t attempt[LMIC_RETRY_MAX_ATTEMPTS];
+} lmicTxResult_t;
+
+typedef enum {
+	LMIC_BACKOFF_FIXED,
+	LMIC_BACKOFF_EXPONENTIAL, // backoffMs doubled per retry
+} lmicBackoff_t;
+
+// Retransmissions of a confirmed uplink. The duty cycle of the bands still applies on top.
+typedef struct {
+	uint8_t attempts; // including the first, 1..LMIC_RETRY_MAX_ATTEMPTS, 0 = LMIC_RETRY_DEFAULT
+	uint8_t drStepMask; // bit n set: attempt n+1 goes one DR lower than attempt n
+	bool newChannel; // retry on another channel than the previous attempt
+	lmicBackoff_t backoff;
+	uint32_t backoffMs; // from the end of the RX windows of a failed attempt
+	uint32_t backoffMaxMs; // LMIC_BACKOFF_EXPONENTIAL, 0 = no limit
+	uint32_t jitterMs; // random 0..jitterMs added to the backoff
+	uint32_t deadlineMs; // no retry starts later than this after the first attempt, 0 = none
+} lmicRetryPolicy_t;
+
+// LMIC 1.5 behavior: 5 attempts, one DR lower for the 3rd and 5th, up to 3 s apart
+extern const lmicRetryPolicy_t LMIC_RETRY_DEFAULT;
+// Quick retries on changing channels at the same DR, given up after a minute
+extern const lmicRetryPolicy_t LMIC_RETRY_ALARM;
+
+// Per uplink choice of DR and TX power. Constraints of the network are kept: with ADR the DR
+// set by the network is the fastest, its power the highest, and only DRs of enabled channels
+// are used. The link margin comes from the device ADR window (LMIC_linkBudget()), as long as
+// it has too few samples the current DR is not left towards faster ones.
+// The setting before the uplink is restored afterwards, unless the network or the device ADR changed it meanwhile.
+typedef enum {
+	LMIC_DR_DEFAULT, // current DR and power (cfg.spreadingFactor, ADR)
+	LMIC_DR_MIN_AIRTIME, // fastest DR that keeps the margin at full power
+	LMIC_DR_MIN_ENERGY, // DR and power with the least TX charge of the energy profile that keep the margin
+	LMIC_DR_MAX_RELIABILITY, // slowest DR, full power
+} lmicDrPolicy_t;
+
+#define LMIC_RATE_DEFAULT_MARGIN_DB 10 // margin without cfg.adrMarginDb
+
+#define LMIC_TX_INVALID_HANDLE 0
+typedef uint32_t lmicTxHandle_t;
+
+// Called from the LMIC task, keep it short
+typedef void (*lmicTxCallback_t)(lmicTxHandle_t handle, const lmicTxResult_t* result, void* ctx);
+
+typedef struct {
+	uint8_t port;
+	const uint8_t* data;
+	size_t len;
+	bool confirmed;
+	lmicTxCallback_t callback; // optional
+	void* ctx; // passed to callback
+	TaskHandle_t notifyTask; // optional, gets notifyBits set on completion
+	uint32_t notifyBits;
+	lmicDrPolicy_t policy;
+	uint32_t maxAirtimeMs; // per attempt, limits the DRs the policy may pick, 0 = no limit
+	lmicRetryPolicy_t retry; // confirmed uplinks only
+} lmicTxRequest_t;
+
+// Read-only view of a received downlink, data points into LMIC.frame and is only valid during the handler call
+typedef struct {
+	const uint8_t* data;
+	uint8_t len;
+	uint8_t port;
+	int16_t rssi; // dBm
+	int8_t snr; // dB * 4
+	uint8_t window; // TXRX_DNW1, TXRX_DNW2, TXRX_PING or TXRX_CLASSC
+	bool fpending; // network has more data pending
+	uint8_t group; // multicast group index, MCAST_NONE for unicast
+} lmicDownlink_t;
+
+// Copy of a downlink for handlers registered in queue mode
+#define LMIC_DOWNLINK_MAX_LEN 64 // MAX_LEN_FRAME
+typedef struct {
+	uint8_t data[LMIC_DOWNLINK_MAX_LEN];
+	uint8_t len;
+	uint8_t port;
+	int16_t rssi;
+	int8_t snr;
+	uint8_t window;
+	bool fpending;
+	uint8_t group;
+} lmicDownlinkCopy_t;
+
+// Called from the LMIC task, must return within the registered budget
+typedef void (*lmicDownlinkHandler_t)(const lmicDownlink_t* downlink, void* ctx);
+
+typedef struct {
+	uint32_t calls;
+	uint32_t overruns; // handler took longer than its budget
+	uint32_t dropped; // queue mode: queue was full
+	uint32_t maxMs; // longest handler run
+} lmicDownlinkStats_t;
+
+// LMIC event snapshot, taken when the event is reported
+typedef struct {
+	uint8_t ev; // ev_t
+	uint32_t time; // osticks
+	uint8_t txrxFlags;
+	uint32_t seqnoUp; // next FCntUp
+	uint32_t seqnoDn; // next expected FCntDown
+	uint8_t dr; // current datarate
+	int16_t rssi; // dBm of the last received frame
+	int8_t snr; // dB * 4 of the last received frame
+} lmicEvent_t;
+
+// Called from the LMIC task after the MAC jobs of a wakeup have run, never from LMIC job context
+typedef void (*lmicEventSubscriber_t)(const lmicEvent_t* event, void* ctx);
+
 void drv_lmic_init(lmicApi_t lmicApi, lmicCfg_t lmicCfg);
 void drv_lmic_sx_irq_handler(uint8_t dio);
 void drv_lmic_systick_irq_handler();
@@ -43,18 +461,101 @@ void drv_lmic_setDevEUI(uint8_t* devEUI);
 void drv_lmic_setAppKey(uint8_t* appKey);
 void drv_lmic_setNetSessionKey(uint8_t* netSessionKey);
 void drv_lmic_setAppSessionKey(uint8_t* appSessionKey);
+// Takes effect right away once started, a running uplink completes first
+void drv_lmic_setClassC(bool classC);
+// Set or with NULL remove group idx (< LMIC_MCAST_GROUPS), applied by the LMIC task.
+// Groups are frames received in ping slots (class B) or class C windows.
+bool drv_lmic_setMulticastGroup(uint8_t idx, const lmicMcastGroupDef_t* group);
+bool drv_lmic_getMulticastStats(uint8_t idx, lmicMcastStats_t* stats);
+// Queued uplinks are deferred to the device's next slot, retransmissions are not
+void drv_lmic_setTxSlots(const lmicSlotCfg_t* slots);
+void drv_lmic_getTxSlot(lmicSlotInfo_t* info);
+
+lmicPlanError_t drv_lmic_validateChannelPlan(const lmicChannelPlan_t* plan);
+// Validates and copies the plan. Once started it is applied by the LMIC task between two jobs,
+// duty cycle state is kept.
+lmicPlanError_t drv_lmic_setChannelPlan(const lmicChannelPlan_t* plan);
+void lmic_applyChannelPlan(const lmicChannelPlan_t* plan, bool keepDuty);
+
+void drv_lmic_fragInit(const lmicFragCfg_t* cfg);
+// Downlink handler for LMIC_FRAG_PORT, register it with drv_lmic_registerDownlinkHandler().
+// With a slow storage register a queue instead and pass the copies to drv_lmic_fragProcess().
+// Answers wait until no application uplink is running or queued.
+void drv_lmic_fragHandler(const lmicDownlink_t* downlink, void* ctx);
+void drv_lmic_fragProcess(const uint8_t* data, uint8_t len, uint8_t group);
+void drv_lmic_fragGetStats(lmicFragStats_t* stats);
+void lmic_fragFlush();
+
+// Attach a DeviceTimeReq to the next uplink, it does not trigger one.
+// Once answered the network time is extrapolated with the ostick clock, its rate is
+// trimmed from sync points at least a few hours of awake time apart. Over drv_lmic_sleep() the
+// time continues by the RTC, once its error exceeds LMIC_TIME_MAX_ERROR_MS a request is attached
+// automatically.
+void drv_lmic_requestNetworkTime();
+// false until the network answered a request
+bool drv_lmic_networkTime(lmicNetworkTime_t* time);
+void drv_lmic_getTimeStats(lmicTimeStats_t* stats);
+void lmic_timeUpdate();
+uint32_t lmic_timeIdleMaxSec();
+void lmic_timeSleep(ostime_t before, uint32_t sleptSec);
+bool lmic_timeEpoch(ostime_t period, ostime_t* epoch);
+uint16_t lmic_slotIndex(uint32_t devaddr, uint32_t slots);
+
+// Energy ledger, fed by the LMIC task and the radio driver
+void lmic_energyInit(const lmicEnergyProfile_t* profile);
+void lmic_energyRadioState(uint8_t state, int8_t txpow);
+void lmic_energyMcu(bool busy);
+void lmic_energyUplink();
+uint32_t lmic_energyTxUa(int8_t txpow);
+
+// Per uplink DR selection, false if no DR fits len and maxAirtimeMs
+bool lmic_ratePick(lmicDrPolicy_t policy, uint8_t len, uint32_t maxAirtimeMs, uint8_t* dr, int8_t* txpow);
+uint32_t lmic_rateAirtimeMs(uint8_t dr, uint8_t len);
 
 
 bool drv_lmic_IsSending();
 bool drv_lmic_IsBusy();
+bool lmic_txIdle(); // no uplink running or queued
 int drv_lmic_TimeToNextJobMs();
+void drv_lmic_getTaskStats(lmicTaskStats_t* stats);
+void drv_lmic_resetTaskStats();
+void drv_lmic_getLbtStats(lmicLbtStats_t* stats);
+void drv_lmic_getTxTiming(lmicTxTiming_t* timing);
+void drv_lmic_getRadioStats(lmicRadioStats_t* stats);
+void drv_lmic_getIrqLatency(lmicIrqLatency_t* latency);
+void drv_lmic_getRxWindowStats(lmicRxWindowStats_t* stats);
+void drv_lmic_getClassCStats(lmicClassCStats_t* stats);
+void drv_lmic_getDeviceAdrStats(lmicDeviceAdrStats_t* stats);
+void drv_lmic_getEnergyStats(lmicEnergyStats_t* stats);
+void drv_lmic_resetEnergyStats();
 
 BaseType_t drv_lmic_send(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait);
 BaseType_t drv_lmic_sendConfirmed(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait);
+// Returns LMIC_TX_INVALID_HANDLE if the request could not be queued within ticksToWait
+lmicTxHandle_t drv_lmic_sendAsync(const lmicTxRequest_t* req, TickType_t ticksToWait);
+// Result of one of the last completed sends, false if unknown or still pending
+bool drv_lmic_txResult(lmicTxHandle_t handle, lmicTxResult_t* result);
+// Register a handler for FPorts portFrom..portTo, returns a handler id or -1 if the table is full
+int drv_lmic_registerDownlinkHandler(uint8_t portFrom, uint8_t portTo, lmicDownlinkHandler_t handler, void* ctx, uint32_t budgetMs);
+// Same but each downlink is copied into queue (items of lmicDownlinkCopy_t) for slow consumers
+int drv_lmic_registerDownlinkQueue(uint8_t portFrom, uint8_t portTo, QueueHandle_t queue);
+void drv_lmic_unregisterDownlinkHandler(int id);
+bool drv_lmic_getDownlinkStats(int id, lmicDownlinkStats_t* stats);
+
+// Returns a subscriber id or -1 if the table is full
+int drv_lmic_subscribeEvents(lmicEventSubscriber_t subscriber, void* ctx);
+void drv_lmic_unsubscribeEvents(int id);
+// Events lost because the event ring was full
+uint32_t drv_lmic_eventsDropped();
+
 void drv_lmic_sleep();
 void drv_lmic_wakeup();
+lmicPowerState_t drv_lmic_powerState();
+void drv_lmic_getPowerStats(lmicPowerStats_t* stats);
 
 bool lmic_hal_asserCalled();
 void lmic_hal_increase_systicks(uint32_t ticks);
+uint32_t lmic_hal_irqMaskedMaxCycles();
+void lmic_hal_irqMaskedResetStats();
 
 #endif /* DRV_LORAWAN_LMIC_DRV_LMIC_H_ */
@@ -0,0 +1,163 @@
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+#include <string.h>
+
+// Energy ledger, integrates the current of the radio state and the LMIC task over osticks
+
+// Approximated from the SX1272 and STM32L151 datasheets
+const lmicEnergyProfile_t LMIC_ENERGY_PROFILE_SX1272 = {
+	.baseUa = 2,
+	.mcuUa = 7000,
+	.standbyUa = 1400,
+	.rxUa = 10500,
+	.txUa = {
+		24000, 25000, 26000, 27000, 28000, 30000, 32000, 35000, // 2 - 9 dBm
+		38000, 42000, 46000, 51000, 57000, 66000, 77000, 90000, // 10 - 17 dBm
+	},
+};
+
+#define TICKS_PER_UAH ((uint64_t) OSTICKS_PER_SEC * 3600) // uA * osticks
+
+static lmicEnergyProfile_t profile;
+
+static struct {
+	ostime_t since; // start of the current state
+	uint8_t radio; // HAL_RADIO_*
+	uint8_t txLevel; // index into profile.txUa
+	bool mcuBusy;
+	uint64_t ticks[LMIC_ENERGY_STATES];
+	uint64_t charge[LMIC_ENERGY_STATES]; // uA * osticks
+	uint64_t txTicks[LMIC_ENERGY_TX_LEVELS];
+	uint64_t uplinkMark; // active charge when the previous uplink completed
+	uint64_t uplinkSum;
+	uint64_t lastUplink;
+	uint32_t uplinks;
+} ledger;
+
+static void account(lmicEnergyState_t state, uint32_t ua, uint32_t dt) {
+	ledger.ticks[state] += dt;
+	ledger.charge[state] += (uint64_t) ua * dt;
+}
+
+// Book the time since the last change to the current state, call with IRQs disabled
+static void accrue() {
+	ostime_t now = os_getTime();
+	uint32_t dt = (uint32_t) (now - ledger.since);
+	ledger.since = now;
+
+	account(LMIC_ENERGY_BASE, profile.baseUa, dt);
+	if (ledger.mcuBusy) {
+		account(LMIC_ENERGY_MCU, profile.mcuUa, dt);
+	}
+	switch (ledger.radio) {
+	case HAL_RADIO_STANDBY:
+		account(LMIC_ENERGY_STANDBY, profile.standbyUa, dt);
+		break;
+	case HAL_RADIO_RX:
+		account(LMIC_ENERGY_RX, profile.rxUa, dt);
+		break;
+	case HAL_RADIO_TX:
+		account(LMIC_ENERGY_TX, profile.txUa[ledger.txLevel], dt);
+		ledger.txTicks[ledger.txLevel] += dt;
+		break;
+	}
+}
+
+static uint64_t activeCharge() {
+	uint64_t sum = 0;
+	for (int s = LMIC_ENERGY_MCU; s < LMIC_ENERGY_STATES; s++) {
+		sum += ledger.charge[s];
+	}
+	return sum;
+}
+
+// Before os_init(), the timer starts at 0 there
+void lmic_energyInit(const lmicEnergyProfile_t* p) {
+	profile = *p;
+	memset(&ledger, 0, sizeof(ledger));
+}
+
+static uint8_t txLevel(int8_t txpow) {
+	if (txpow < LMIC_ENERGY_TX_MIN_DBM) {
+		txpow = LMIC_ENERGY_TX_MIN_DBM;
+	} else if (txpow >= LMIC_ENERGY_TX_MIN_DBM + LMIC_ENERGY_TX_LEVELS) {
+		txpow = LMIC_ENERGY_TX_MIN_DBM + LMIC_ENERGY_TX_LEVELS - 1;
+	}
+	return txpow - LMIC_ENERGY_TX_MIN_DBM;
+}
+
+void lmic_energyRadioState(uint8_t state, int8_t txpow) {
+	lmic_hal_disableIRQs();
+	accrue();
+	ledger.radio = state;
+	ledger.txLevel = txLevel(txpow);
+	lmic_hal_enableIRQs();
+}
+
+// TX current of the profile at txpow dBm
+uint32_t lmic_energyTxUa(int8_t txpow) {
+	return profile.txUa[txLevel(txpow)];
+}
+
+void lmic_energyMcu(bool busy) {
+	lmic_hal_disableIRQs();
+	accrue();
+	ledger.mcuBusy = busy;
+	lmic_hal_enableIRQs();
+}
+
+// On EV_TXCOMPLETE
+void lmic_energyUplink() {
+	lmic_hal_disableIRQs();
+	accrue();
+	uint64_t active = activeCharge();
+	ledger.lastUplink = active - ledger.uplinkMark;
+	ledger.uplinkMark = active;
+	ledger.uplinkSum += ledger.lastUplink;
+	ledger.uplinks++;
+	lmic_hal_enableIRQs();
+}
+
+static uint32_t ticksToMs(uint64_t ticks) {
+	return (uint32_t) (ticks * 1000 / OSTICKS_PER_SEC);
+}
+
+static uint32_t chargeToNAh(uint64_t charge) {
+	return (uint32_t) (charge * 1000 / TICKS_PER_UAH);
+}
+
+void drv_lmic_getEnergyStats(lmicEnergyStats_t* stats) {
+	lmic_hal_disableIRQs();
+	accrue();
+	stats->seconds = (uint32_t) (ledger.ticks[LMIC_ENERGY_BASE] / OSTICKS_PER_SEC);
+	stats->mcuMs = ticksToMs(ledger.ticks[LMIC_ENERGY_MCU]);
+	stats->standbyMs = ticksToMs(ledger.ticks[LMIC_ENERGY_STANDBY]);
+	stats->rxMs = ticksToMs(ledger.ticks[LMIC_ENERGY_RX]);
+	stats->txMs = ticksToMs(ledger.ticks[LMIC_ENERGY_TX]);
+	for (int l = 0; l < LMIC_ENERGY_TX_LEVELS; l++) {
+		stats->txMsPerLevel[l] = ticksToMs(ledger.txTicks[l]);
+	}
+	uint64_t total = 0;
+	for (int s = 0; s < LMIC_ENERGY_STATES; s++) {
+		stats->uAh[s] = (uint32_t) (ledger.charge[s] / TICKS_PER_UAH);
+		total += ledger.charge[s];
+	}
+	stats->totalUAh = (uint32_t) (total / TICKS_PER_UAH);
+	stats->uplinks = ledger.uplinks;
+	stats->lastUplinkNAh = chargeToNAh(ledger.lastUplink);
+	stats->avgUplinkNAh = ledger.uplinks ? chargeToNAh(ledger.uplinkSum / ledger.uplinks) : 0;
+	lmic_hal_enableIRQs();
+}
+
+void drv_lmic_resetEnergyStats() {
+	lmic_hal_disableIRQs();
+	accrue();
+	memset(ledger.ticks, 0, sizeof(ledger.ticks));
+	memset(ledger.charge, 0, sizeof(ledger.charge));
+	memset(ledger.txTicks, 0, sizeof(ledger.txTicks));
+	ledger.uplinkMark = 0;
+	ledger.uplinkSum = 0;
+	ledger.lastUplink = 0;
+	ledger.uplinks = 0;
+	lmic_hal_enableIRQs();
+}
@@ -0,0 +1,470 @@
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+#include <string.h>
+
+// Fragmented data block transport (LoRaWAN TS004 v1.0.0) on LMIC_FRAG_PORT, one session at a time.
+//
+// Fragments 1..nbFrag are the image, every later one is the XOR of a pseudo random half of them.
+// Uncoded fragments go straight to the storage. With the first coded fragment the set of missing
+// fragments is fixed and every further fragment is reduced to a row over the missing ones
+// (elimination over GF(2)), so any nbFrag independent fragments rebuild the image. The reduced
+// row data is kept in the storage slot of its pivot fragment, the work memory only holds the bits.
+
+enum {
+	FRAG_PACKAGE_VERSION = 0x00,
+	FRAG_SESSION_STATUS = 0x01,
+	FRAG_SESSION_SETUP = 0x02,
+	FRAG_SESSION_DELETE = 0x03,
+	FRAG_DATA_FRAGMENT = 0x08,
+};
+
+#define FRAG_PACKAGE_ID 3
+#define FRAG_PACKAGE_VERSION_NUM 1
+
+// FragSessionSetupAns status bits
+#define SETUP_ENCODING_UNSUPPORTED 0x01
+#define SETUP_NOT_ENOUGH_MEMORY 0x02
+#define SETUP_INDEX_NOT_SUPPORTED 0x04
+#define SETUP_WRONG_DESCRIPTOR 0x08
+
+static lmicFragCfg_t cfg;
+
+static struct {
+	lmicFragState_t state;
+	uint8_t index; // FragIndex
+	uint8_t groups; // McGroupBitMask
+	uint16_t nbFrag;
+	uint8_t fragSize;
+	uint8_t padding;
+	uint32_t descriptor;
+	bool coded; // missing fragments are fixed, fragments are decoded as rows
+	bool memoryShort;
+	uint16_t fragments;
+	uint16_t used;
+	uint16_t numMissing;
+	uint16_t rank; // rows in the matrix
+	uint16_t rowBytes;
+	// In the work memory
+	uint16_t* missing; // row index -> fragment index, ascending
+	uint8_t* have; // uncoded fragments received before the first coded one
+	uint8_t* line; // parity line over nbFrag fragments
+	uint8_t* rowPresent;
+	uint8_t* row;
+	uint8_t* matrix; // maxMissing rows, row p has no bits below p
+} s;
+
+static uint8_t data[LMIC_FRAG_MAX_FRAG_SIZE];
+static uint8_t tmp[LMIC_FRAG_MAX_FRAG_SIZE];
+
+// Answer waiting for the uplink of the application to finish, a newer one replaces it
+static uint8_t pendingAns[16];
+static uint8_t pendingLen;
+
+static bool bitGet(const uint8_t* bits, uint16_t i) {
+	return (bits[i >> 3] >> (i & 7)) & 1;
+}
+
+static void bitSet(uint8_t* bits, uint16_t i) {
+	bits[i >> 3] |= 1 << (i & 7);
+}
+
+static void xorBuf(uint8_t* dst, const uint8_t* src, uint16_t len) {
+	for (uint16_t i = 0; i < len; i++) {
+		dst[i] ^= src[i];
+	}
+}
+
+static bool readFrag(uint16_t idx, uint8_t* buf) {
+	return cfg.read((uint32_t) idx * s.fragSize, buf, s.fragSize, cfg.ctx);
+}
+
+static bool writeFrag(uint16_t idx, const uint8_t* buf) {
+	return cfg.write((uint32_t) idx * s.fragSize, buf, s.fragSize, cfg.ctx);
+}
+
+static uint32_t prbs23(uint32_t x) {
+	uint32_t b0 = x & 1;
+	uint32_t b1 = (x & 32) >> 5;
+	return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+// Parity line of coded fragment n (1 = first coded one), TS004 reference generator
+static void parityLine(uint16_t n) {
+	uint16_t m = s.nbFrag;
+	uint32_t mod = m + ((m & (m - 1)) == 0 ? 1 : 0);
+	uint32_t x = 1 + 1001 * (uint32_t) n;
+	memset(s.line, 0, LMIC_FRAG_BITS(m));
+	for (uint16_t c = 0; c < m / 2; c++) {
+		uint32_t r;
+		do {
+			x = prbs23(x);
+			r = x % mod;
+		} while (r >= m);
+		bitSet(s.line, r);
+	}
+}
+
+static void layoutWorkMem() {
+	uint8_t* p = cfg.workMem;
+	s.missing = (uint16_t*) p;
+	p += 2 * cfg.maxMissing;
+	s.have = p;
+	p += LMIC_FRAG_BITS(cfg.maxFrags);
+	s.line = p;
+	p += LMIC_FRAG_BITS(cfg.maxFrags);
+	s.rowBytes = LMIC_FRAG_BITS(cfg.maxMissing);
+	s.rowPresent = p;
+	p += s.rowBytes;
+	s.row = p;
+	p += s.rowBytes;
+	s.matrix = p;
+}
+
+// Fix the missing fragments, false if there are more than the matrix can hold
+static bool startCoding() {
+	uint16_t n = 0;
+	for (uint16_t i = 0; i < s.nbFrag; i++) {
+		if (bitGet(s.have, i)) {
+			continue;
+		}
+		if (n == cfg.maxMissing) {
+			return false;
+		}
+		s.missing[n++] = i;
+	}
+	s.numMissing = n;
+	s.rank = 0;
+	memset(s.rowPresent, 0, s.rowBytes);
+	s.coded = true;
+	return true;
+}
+
+// Row index of missing fragment idx
+static uint16_t missingRow(uint16_t idx) {
+	uint16_t lo = 0;
+	uint16_t hi = s.numMissing;
+	while (lo < hi) {
+		uint16_t mid = (lo + hi) / 2;
+		if (s.missing[mid] < idx) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Eliminate s.row / data against the matrix and keep it if it is independent
+static bool addRow(bool* added) {
+	*added = false;
+	for (uint16_t p = 0; p < s.numMissing; p++) {
+		if (!bitGet(s.row, p)) {
+			continue;
+		}
+		uint8_t* r = s.matrix + p * s.rowBytes;
+		if (!bitGet(s.rowPresent, p)) {
+			memcpy(r, s.row, s.rowBytes);
+			bitSet(s.rowPresent, p);
+			s.rank++;
+			*added = true;
+			return writeFrag(s.missing[p], data);
+		}
+		xorBuf(s.row, r, s.rowBytes);
+		if (!readFrag(s.missing[p], tmp)) {
+			return false;
+		}
+		xorBuf(data, tmp, s.fragSize);
+	}
+	return true;
+}
+
+// Back substitution once the matrix has full rank, leaves the plain fragments in the storage
+static bool solve() {
+	for (int p = s.numMissing - 1; p >= 0; p--) {
+		const uint8_t* r = s.matrix + p * s.rowBytes;
+		bool changed = false;
+		if (!readFrag(s.missing[p], data)) {
+			return false;
+		}
+		for (uint16_t q = p + 1; q < s.numMissing; q++) {
+			if (!bitGet(r, q)) {
+				continue;
+			}
+			if (!readFrag(s.missing[q], tmp)) {
+				return false;
+			}
+			xorBuf(data, tmp, s.fragSize);
+			changed = true;
+		}
+		if (changed && !writeFrag(s.missing[p], data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void complete() {
+	s.state = LMIC_FRAG_COMPLETE;
+	if (cfg.complete != NULL) {
+		cfg.complete((uint32_t) s.nbFrag * s.fragSize - s.padding, s.descriptor, cfg.ctx);
+	}
+}
+
+// Fragment n (1..nbFrag uncoded, above coded), false on a storage error
+static bool onFragment(uint16_t n, const uint8_t* payload) {
+	s.fragments++;
+	if (!s.coded && n <= s.nbFrag) {
+		uint16_t idx = n - 1;
+		if (bitGet(s.have, idx)) {
+			return true;
+		}
+		if (!writeFrag(idx, payload)) {
+			return false;
+		}
+		bitSet(s.have, idx);
+		s.used++;
+		if (s.used == s.nbFrag) {
+			complete();
+		}
+		return true;
+	}
+
+	if (!s.coded && !startCoding()) {
+		s.memoryShort = true;
+		return true;
+	}
+
+	memcpy(data, payload, s.fragSize);
+	memset(s.row, 0, s.rowBytes);
+	if (n <= s.nbFrag) {
+		// Late uncoded fragment, a row with a single bit
+		uint16_t idx = n - 1;
+		if (bitGet(s.have, idx)) {
+			return true;
+		}
+		bitSet(s.row, missingRow(idx));
+	} else {
+		// Fold the fragments already received into the data, keep the bits of the missing ones
+		parityLine(n - s.nbFrag);
+		uint16_t row = 0;
+		for (uint16_t idx = 0; idx < s.nbFrag; idx++) {
+			bool inLine = bitGet(s.line, idx);
+			if (!bitGet(s.have, idx)) {
+				if (inLine) {
+					bitSet(s.row, row);
+				}
+				row++;
+			} else if (inLine) {
+				if (!readFrag(idx, tmp)) {
+					return false;
+				}
+				xorBuf(data, tmp, s.fragSize);
+			}
+		}
+	}
+
+	bool added;
+	if (!addRow(&added)) {
+		return false;
+	}
+	if (!added) {
+		return true;
+	}
+	s.used++;
+	if (s.rank == s.numMissing) {
+		if (!solve()) {
+			return false;
+		}
+		complete();
+	}
+	return true;
+}
+
+static uint8_t setupSession(const uint8_t* p) {
+	uint8_t index = (p[0] >> 4) & 0x03;
+	uint16_t nbFrag = p[1] | (p[2] << 8);
+	uint8_t fragSize = p[3];
+	uint8_t algo = (p[4] >> 3) & 0x07;
+	uint8_t padding = p[5];
+	uint32_t descriptor = p[6] | (p[7] << 8) | (p[8] << 16) | ((uint32_t) p[9] << 24);
+
+	uint8_t status = 0;
+	if (algo != 0) {
+		status |= SETUP_ENCODING_UNSUPPORTED;
+	}
+	if (cfg.workMem == NULL || (s.state == LMIC_FRAG_RECEIVING && s.index != index)) {
+		status |= SETUP_INDEX_NOT_SUPPORTED;
+	}
+	if (nbFrag == 0 || nbFrag > cfg.maxFrags || nbFrag > 0x3FFF || fragSize == 0
+			|| fragSize > LMIC_FRAG_MAX_FRAG_SIZE || padding >= fragSize
+			|| (uint32_t) nbFrag * fragSize > cfg.maxSize) {
+		status |= SETUP_NOT_ENOUGH_MEMORY;
+	}
+	if (status == 0 && cfg.start != NULL
+			&& !cfg.start((uint32_t) nbFrag * fragSize - padding, descriptor, cfg.ctx)) {
+		status |= SETUP_WRONG_DESCRIPTOR;
+	}
+	if (status == 0) {
+		s.state = LMIC_FRAG_RECEIVING;
+		s.index = index;
+		s.groups = p[0] & 0x0F;
+		s.nbFrag = nbFrag;
+		s.fragSize = fragSize;
+		s.padding = padding;
+		s.descriptor = descriptor;
+		s.coded = false;
+		s.memoryShort = false;
+		s.fragments = 0;
+		s.used = 0;
+		s.numMissing = 0;
+		s.rank = 0;
+		memset(s.have, 0, LMIC_FRAG_BITS(nbFrag));
+	}
+	return status | (index << 6);
+}
+
+static uint16_t stillMissing() {
+	if (s.state != LMIC_FRAG_RECEIVING) {
+		return 0;
+	}
+	return s.coded ? s.numMissing - s.rank : s.nbFrag - s.used;
+}
+
+void drv_lmic_fragInit(const lmicFragCfg_t* fragCfg) {
+	configASSERT(fragCfg->write != NULL && fragCfg->read != NULL);
+	configASSERT(fragCfg->workMem != NULL && fragCfg->maxFrags > 0 && fragCfg->maxMissing > 0);
+	taskENTER_CRITICAL();
+	cfg = *fragCfg;
+	memset(&s, 0, sizeof(s));
+	layoutWorkMem();
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_fragProcess(const uint8_t* in, uint8_t len, uint8_t group) {
+	uint8_t ans[16];
+	uint8_t alen = 0;
+	uint8_t pos = 0;
+
+	while (pos < len) {
+		uint8_t cid = in[pos++];
+		const uint8_t* p = in + pos;
+		uint8_t left = len - pos;
+
+		if (cid == FRAG_PACKAGE_VERSION) {
+			if ((size_t) alen + 3 > sizeof(ans)) {
+				break;
+			}
+			ans[alen++] = FRAG_PACKAGE_VERSION;
+			ans[alen++] = FRAG_PACKAGE_ID;
+			ans[alen++] = FRAG_PACKAGE_VERSION_NUM;
+		} else if (cid == FRAG_SESSION_STATUS) {
+			if (left < 1 || (size_t) alen + 5 > sizeof(ans)) {
+				break;
+			}
+			pos += 1;
+			uint8_t index = (p[0] >> 1) & 0x03;
+			bool all = p[0] & 0x01;
+			if (s.state == LMIC_FRAG_IDLE || s.index != index) {
+				continue;
+			}
+			uint16_t missing = stillMissing();
+			if (!all && missing == 0) {
+				continue;
+			}
+			uint16_t received = (s.used & 0x3FFF) | (index << 14);
+			ans[alen++] = FRAG_SESSION_STATUS;
+			ans[alen++] = received;
+			ans[alen++] = received >> 8;
+			ans[alen++] = missing > 255 ? 255 : missing;
+			ans[alen++] = s.memoryShort ? 0x01 : 0x00;
+		} else if (cid == FRAG_SESSION_SETUP) {
+			if (left < 10 || (size_t) alen + 2 > sizeof(ans)) {
+				break;
+			}
+			pos += 10;
+			ans[alen++] = FRAG_SESSION_SETUP;
+			ans[alen++] = setupSession(p);
+		} else if (cid == FRAG_SESSION_DELETE) {
+			if (left < 1 || (size_t) alen + 2 > sizeof(ans)) {
+				break;
+			}
+			pos += 1;
+			uint8_t index = p[0] & 0x03;
+			uint8_t status = index;
+			if (s.state == LMIC_FRAG_IDLE || s.index != index) {
+				status |= 0x04; // session does not exist
+			} else {
+				s.state = LMIC_FRAG_IDLE;
+			}
+			ans[alen++] = FRAG_SESSION_DELETE;
+			ans[alen++] = status;
+		} else if (cid == FRAG_DATA_FRAGMENT) {
+			// Takes the rest of the frame
+			pos = len;
+			if (left < 2 || left - 2 != s.fragSize || s.state != LMIC_FRAG_RECEIVING) {
+				break;
+			}
+			uint16_t indexAndN = p[0] | (p[1] << 8);
+			uint16_t n = indexAndN & 0x3FFF;
+			if ((indexAndN >> 14) != s.index || n == 0) {
+				break;
+			}
+			if (group != MCAST_NONE && !(s.groups & (1 << group))) {
+				break;
+			}
+			if (!onFragment(n, p + 2)) {
+				s.state = LMIC_FRAG_FAILED;
+			}
+		} else {
+			// Unknown command, the length of the rest is unknown
+			break;
+		}
+	}
+
+	if (alen > 0) {
+		taskENTER_CRITICAL();
+		memcpy(pendingAns, ans, alen);
+		pendingLen = alen;
+		taskEXIT_CRITICAL();
+		lmic_fragFlush();
+	}
+}
+
+// Sends a pending answer once no uplink is running or queued, a new send would drop it.
+// Called after each job batch of the LMIC task.
+void lmic_fragFlush() {
+	uint8_t ans[sizeof(pendingAns)];
+	taskENTER_CRITICAL();
+	uint8_t alen = 0;
+	if (pendingLen > 0 && lmic_txIdle()) {
+		alen = pendingLen;
+		memcpy(ans, pendingAns, alen);
+		pendingLen = 0;
+	}
+	taskEXIT_CRITICAL();
+	if (alen > 0 && !drv_lmic_send(LMIC_FRAG_PORT, ans, alen, 0)) {
+		taskENTER_CRITICAL();
+		if (pendingLen == 0) {
+			memcpy(pendingAns, ans, alen);
+			pendingLen = alen;
+		}
+		taskEXIT_CRITICAL();
+	}
+}
+
+void drv_lmic_fragHandler(const lmicDownlink_t* downlink, void* ctx) {
+	drv_lmic_fragProcess(downlink->data, downlink->len, downlink->group);
+}
+
+void drv_lmic_fragGetStats(lmicFragStats_t* stats) {
+	taskENTER_CRITICAL();
+	stats->state = s.state;
+	stats->index = s.index;
+	stats->nbFrag = s.nbFrag;
+	stats->fragSize = s.fragSize;
+	stats->fragments = s.fragments;
+	stats->used = s.used;
+	stats->missing = stillMissing();
+	stats->memoryShort = s.memoryShort;
+	taskEXIT_CRITICAL();
+}
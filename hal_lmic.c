@@ -1,7 +1,7 @@
 #include "drv_lmic.h"
 #include "lmic/oslmic.h"
 
-#include "github.com/Lobaro/c-utils/logging.h"
+#include "trace_lmic.h"
 
 
 // LMIC hal implementation based on freeRTOS
@@ -12,6 +12,52 @@ volatile bool assertCalled = false;
 
 static lmicApi_t api;
 
+/*
+ * Priority the LMIC critical sections raise BASEPRI to.
+ * Must be the most urgent (numerically lowest) priority of all interrupts
+ * calling into LMIC, i.e. TIM9 and the radio DIO lines. The board has to
+ * configure the DIO EXTI priorities to this value or less urgent.
+ * Interrupts more urgent than this keep running while LMIC is masked.
+ */
+#ifndef LMIC_HAL_IRQ_PRIORITY
+#define LMIC_HAL_IRQ_PRIORITY 0x70
+#endif
+
+/*
+ * With LMIC_HAL_DIO0_CAPTURE TIM9 channel 1 latches the ostick of the DIO0 rising edge,
+ * so TX/RX done timestamps do not include the interrupt latency.
+ * The board has to route DIO0 to TIM9_CH1 (alternate function) in addition to its EXTI line.
+ */
+
+// Nesting depth of lmic_hal_disableIRQs() and BASEPRI to restore on the outermost enable
+static volatile uint32_t irqNesting = 0;
+static uint32_t irqSavedBasepri = 0;
+
+#ifdef LMIC_HAL_IRQ_STATS
+// Cycle counter based measurement of the masked window
+static uint32_t irqMaskedStart = 0;
+static volatile uint32_t irqMaskedMaxCycles = 0;
+static volatile uint32_t irqMaskedCount = 0;
+
+static void irqStatsInit() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+#define IRQ_STATS_BEGIN() do { irqMaskedStart = DWT->CYCCNT; } while (0)
+#define IRQ_STATS_END() do { \
+		uint32_t cycles = DWT->CYCCNT - irqMaskedStart; \
+		if (cycles > irqMaskedMaxCycles) { \
+			irqMaskedMaxCycles = cycles; \
+		} \
+		irqMaskedCount++; \
+	} while (0)
+#else
+#define IRQ_STATS_BEGIN() do { } while (0)
+#define IRQ_STATS_END() do { } while (0)
+#endif
+
 bool lmic_hal_asserCalled() {
 	return assertCalled;
 }
@@ -50,17 +96,27 @@ void lmic_hal_init(lmicApi_t lmicApi) {
 			TIM9->PSC = (640 - 1); // HSE_CLOCK_HWTIMER_PSC-1);  XXX: define HSE_CLOCK_HWTIMER_PSC somewhere
 #endif
 
-	NVIC->IP[TIM9_IRQn] = 0x70; // interrupt priority
+	NVIC->IP[TIM9_IRQn] = LMIC_HAL_IRQ_PRIORITY; // interrupt priority
 	NVIC->ISER[TIM9_IRQn >> 5] = 1 << (TIM9_IRQn & 0x1F);  // set enable IRQ
 
 	// enable update (overflow) interrupt
 	TIM9->DIER |= TIM_DIER_UIE;
 
+#ifdef LMIC_HAL_DIO0_CAPTURE
+	// channel 1 input capture on TI1 (DIO0), rising edge, no filter, no interrupt
+	TIM9->CCMR1 = (TIM9->CCMR1 & ~(TIM_CCMR1_CC1S | TIM_CCMR1_IC1F | TIM_CCMR1_IC1PSC)) | TIM_CCMR1_CC1S_0;
+	TIM9->CCER = (TIM9->CCER & ~(TIM_CCER_CC1P | TIM_CCER_CC1NP)) | TIM_CCER_CC1E;
+#endif
+
 	TIM9->CNT = 0;
 	tim9Overflows = 0;
 
 	// Enable timer counting
 	TIM9->CR1 = TIM_CR1_CEN;
+
+#ifdef LMIC_HAL_IRQ_STATS
+	irqStatsInit();
+#endif
 }
 
 
@@ -96,42 +152,57 @@ u1_t lmic_hal_spi(u1_t outval) {
 	return hal_spi2_send(outval);
 }
 
-/* Masks off all bits but the VECTACTIVE bits in the ICSR register.
- *
- * Defined by FreeRTOS port and different per architecture
+/*
+ * Worst case time in CPU cycles LMIC kept its interrupts masked
+ * since the last reset. Always 0 without LMIC_HAL_IRQ_STATS.
  */
-#define portVECTACTIVE_MASK					( 0xFFUL )
+uint32_t lmic_hal_irqMaskedMaxCycles() {
+#ifdef LMIC_HAL_IRQ_STATS
+	return irqMaskedMaxCycles;
+#else
+	return 0;
+#endif
+}
 
-// static UBaseType_t uxSavedInterruptStatus;
+void lmic_hal_irqMaskedResetStats() {
+#ifdef LMIC_HAL_IRQ_STATS
+	irqMaskedMaxCycles = 0;
+	irqMaskedCount = 0;
+#endif
+}
 
 /*
  * disable all CPU interrupts.
  *   - might be invoked nested
  *   - will be followed by matching call to hal_enableIRQs()
+ *
+ * Only interrupts up to LMIC_HAL_IRQ_PRIORITY are masked via BASEPRI,
+ * the RTOS and more urgent interrupts keep running.
+ * Can be called from task and ISR context.
  */
 void lmic_hal_disableIRQs(void) {
-	//taskENTER_CRITICAL();
-
-	/*
-	 if (( portNVIC_INT_CTRL_REG & portVECTACTIVE_MASK) == 0) {
-	 taskENTER_CRITICAL();
-	 } else {
-	 uxSavedInterruptStatus = taskEXIT_CRITICAL_FROM_ISR();
-	 }*/
+	uint32_t basepri = __get_BASEPRI();
+	// Only raises the mask, never lowers an already more restrictive BASEPRI
+	__set_BASEPRI_MAX(LMIC_HAL_IRQ_PRIORITY);
+	__DSB();
+	__ISB();
+
+	if (irqNesting++ == 0) {
+		irqSavedBasepri = basepri;
+		IRQ_STATS_BEGIN();
+	}
 }
 
 /*
  * enable CPU interrupts.
  */
 void lmic_hal_enableIRQs(void) {
-	//taskEXIT_CRITICAL();
+	configASSERT(irqNesting > 0);
 
-	/*
-	 if (( portNVIC_INT_CTRL_REG & portVECTACTIVE_MASK) == 0) {
-	 taskEXIT_CRITICAL();
-	 } else {
-	 taskEXIT_CRITICAL_FROM_ISR(uxSavedInterruptStatus);
-	 }*/
+	if (--irqNesting == 0) {
+		IRQ_STATS_END();
+		__set_BASEPRI(irqSavedBasepri);
+	}
 }
 
 /*
@@ -179,10 +250,8 @@ static uint16_t deltaticks(uint32_t time) {
  * busy-wait until specified timestamp (in ticks) is reached.
  */
 void lmic_hal_waitUntil(uint32_t time) {
-	void hal_rtc_waitUntil(uint32_t time) {
-		while (deltaticks(time) != 0)
-			; // busy wait until timestamp is reached
-	}
+	while (deltaticks(time) != 0)
+		; // busy wait until timestamp is reached
 }
 
 /*
@@ -192,7 +261,7 @@ void lmic_hal_waitUntil(uint32_t time) {
  */
 u1_t lmic_hal_checkTimer(uint32_t targettime) {
 	uint16_t dt;
-	TIM9->SR &= ~TIM_SR_CC2IF; // clear any pending interrupts
+	TIM9->SR = ~TIM_SR_CC2IF; // clear any pending interrupts (rc_w0, a read-modify-write could lose a capture)
 	if ((dt = deltaticks(targettime)) < 5) { // event is now (a few ticks ahead)
 		TIM9->DIER &= ~TIM_DIER_CC2IE; // disable IE
 		return 1;
@@ -204,14 +273,36 @@ u1_t lmic_hal_checkTimer(uint32_t targettime) {
 	}
 }
 
+u1_t lmic_hal_dio0Capture(uint32_t* ticks) {
+#ifdef LMIC_HAL_DIO0_CAPTURE
+	if ((TIM9->SR & TIM_SR_CC1IF) == 0) {
+		return 0;
+	}
+	uint32_t now = lmic_hal_ticks();
+	uint16_t ccr = TIM9->CCR1; // reading CCR1 clears CC1IF
+	TIM9->SR = ~TIM_SR_CC1OF;
+	// Extend the 16 bit capture with the current time, valid while the edge is < 2s ago
+	*ticks = now - (uint16_t) ((uint16_t) now - ccr);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void lmic_hal_radioState(uint8_t state, int8_t txpow) {
+	lmic_energyRadioState(state, txpow);
+}
+
 void TIM9_IRQHandler() {
-	if (TIM9->SR & TIM_SR_UIF) { // overflow, ~ every 2 seconds
+	uint32_t sr = TIM9->SR;
+	if (sr & TIM_SR_UIF) { // overflow, ~ every 2 seconds
 		tim9Overflows++;
 	}
-	if ((TIM9->SR & TIM_SR_CC2IF) && (TIM9->DIER & TIM_DIER_CC2IE)) { // compare expired
+	if ((sr & TIM_SR_CC2IF) && (TIM9->DIER & TIM_DIER_CC2IE)) { // compare expired
 		// do nothing, only wake up cpu
 	}
-	TIM9->SR = 0; // clear IRQ flags
+	// clear handled IRQ flags only (rc_w0), the DIO0 capture flag is left to lmic_hal_dio0Capture()
+	TIM9->SR = ~(sr & (TIM_SR_UIF | TIM_SR_CC2IF));
 
 	drv_lmic_systick_irq_handler();
 }
@@ -223,7 +314,8 @@ void TIM9_IRQHandler() {
  */
 void lmic_hal_failed(char* file, int linenum) {
 	assertCalled = true;
-	Log("LMIC ASSERT: %d:%s\n", (int) linenum, file);
+	TRACE_ERR(TRACE_HAL_ASSERT, linenum, (uintptr_t) file, 0);
+	lmic_traceFlush(); // nothing runs after the assert
 	vAssertCalled(file, linenum);
 	//configASSERT(false);
 }
@@ -228,9 +228,14 @@ static void aesroundkeys () {
     }
 }
 
+void os_aesExpandKey () {
+    aesroundkeys();
+}
+
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len) {
         
-        aesroundkeys();
+        if( (mode & AES_RKEYS) == 0 )
+            aesroundkeys();
 
         if( mode & AES_MICNOAUX ) {
             AESAUX[0] = AESAUX[1] = AESAUX[2] = AESAUX[3] = 0;
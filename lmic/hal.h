@@ -133,6 +133,21 @@ void lmic_hal_waitUntil (uint32_t time);
  */
 uint8_t lmic_hal_checkTimer (uint32_t targettime);
 
+/*
+ * latched timer tick of the last DIO0 rising edge.
+ *   - return 1 and the tick if a new edge was captured since the last call
+ *   - return 0 if there is none or the HAL has no capture hardware
+ */
+uint8_t lmic_hal_dio0Capture (uint32_t* ticks);
+
+/*
+ * radio entered a new power state (HAL_RADIO_*), txpow in dBm while transmitting.
+ *   - called from task and IRQ context with IRQs disabled
+ *   - used for energy accounting
+ */
+enum { HAL_RADIO_SLEEP, HAL_RADIO_STANDBY, HAL_RADIO_RX, HAL_RADIO_TX };
+void lmic_hal_radioState (uint8_t state, int8_t txpow);
+
 /*
  * perform fatal failure action.
  *   - called by assertions
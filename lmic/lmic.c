@@ -16,6 +16,13 @@
 #define MINRX_SYMS 5
 #endif // !defined(MINRX_SYMS)
 #define PAMBL_SYMS 8
+#if !defined(RX_CLOCK_PPM)
+#define RX_CLOCK_PPM 30   // default clock error budget of the class A windows (LSE crystal)
+#endif
+#if !defined(RX_TSERR_us)
+#define RX_TSERR_us 500   // timestamp uncertainty until calibrated
+#endif
+#define RX_CAL_MIN 4      // downlinks before the calibrated uncertainty is used
 #define PAMBL_FSK  5
 #define PRERX_FSK  1
 #define RXLEN_FSK  (1+5+2)
@@ -189,6 +196,34 @@ static void aes_cipher (xref2cu1_t key, u4_t devaddr, u4_t seqno, int dndir, xre
 }
 
 
+// Round keys for the *Rk variants, saves the key expansion per frame
+static void aes_expandKey (xref2cu1_t key, u4_t* rk) {
+    os_copyMem(AESkey,key,16);
+    os_aesExpandKey();
+    os_copyMem((xref2u1_t)rk,AESkey,AES_RKEYS_LEN);
+}
+
+
+static int aes_verifyMicRk (const u4_t* rk, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t pdu, int len) {
+    micB0(devaddr, seqno, dndir, len);
+    os_copyMem(AESkey,(xref2cu1_t)rk,AES_RKEYS_LEN);
+    return os_aes(AES_MIC|AES_RKEYS, pdu, len) == os_rmsbf4(pdu+len);
+}
+
+
+static void aes_cipherRk (const u4_t* rk, u4_t devaddr, u4_t seqno, int dndir, xref2u1_t payload, int len) {
+    if( len <= 0 )
+        return;
+    os_clearMem(AESaux, 16);
+    AESaux[0] = AESaux[15] = 1; // mode=cipher / dir=down / block counter=1
+    AESaux[5] = dndir?1:0;
+    os_wlsbf4(AESaux+ 6,devaddr);
+    os_wlsbf4(AESaux+10,seqno);
+    os_copyMem(AESkey,(xref2cu1_t)rk,AES_RKEYS_LEN);
+    os_aes(AES_CTR|AES_RKEYS, payload, len);
+}
+
+
 static void aes_sessKeys (u2_t devnonce, xref2cu1_t artnonce, xref2u1_t nwkkey, xref2u1_t artkey) {
     os_clearMem(nwkkey, 16);
     nwkkey[0] = 0x01;
@@ -342,14 +377,16 @@ extern inline int   sameSfBw (rps_t r1, rps_t r2);
 // ================================================================================
 
 
-// Adjust DR for TX retries
-//  - indexed by retry count
-//  - return steps to lower DR
-static const u1_t DRADJUST[2+TXCONF_ATTEMPTS +3] = {
-    // normal frames - 1st try / no retry
-    0,
-    // confirmed frames
-    0,0,1,0,1,0,1,0,0
+// Default retries: one DR lower for the 3rd and 5th attempt, up to RETRY_PERIOD_secs random delay
+static const retrypol_t RETRY_DEFAULT = {
+    .attempts    = TXCONF_ATTEMPTS,
+    .drSteps     = TXCONF_DR_STEPS,
+    .newChnl     = 0,
+    .backoffMode = RETRY_BACKOFF_FIXED,
+    .backoff     = 0,
+    .backoffMax  = 0,
+    .jitter      = sec2osticks(RETRY_PERIOD_secs),
+    .deadline    = 0,
 };
 
 
@@ -420,6 +457,50 @@ static void calcBcnRxWindowFromMillis (u1_t ms, bit_t ini) {
 }
 
 
+// Class A window sizing. The window opens early and the symbol timeout grows by the
+// timing error expected after delay: clock error (ppm) plus timestamp uncertainty.
+// Downlink arrival times calibrate a bias and the uncertainty, see rxCalibrate().
+static void rxWindow (ostime_t delay, dr_t dr) {
+    ostime_t hsym = dr2hsym(dr);
+    // rounded up, a few 10 ppm over 1-2 s are less than a tick and would vanish
+    ostime_t err  = (ostime_t)(((s8_t)delay * LMIC.rxPpm + 999999) / 1000000);
+    // calibrated: 3 mean deviations (~2.4 sigma) + 1 tick resolution
+    err += LMIC.rxCalCnt < RX_CAL_MIN ? us2osticks(RX_TSERR_us) : 3*LMIC.rxDev + 1;
+    // window covers +/-err around the nominal preamble: 2*err more, in symbols (2 hsym)
+    ostime_t syms = MINRX_SYMS + (err + hsym - 1) / hsym;
+    if( syms > 255 )
+        syms = 255;
+    LMIC.rxNominal = LMIC.txend + delay + LMIC.rxBias;
+    LMIC.rxtime    = LMIC.rxNominal + (PAMBL_SYMS-MINRX_SYMS)*hsym - err;
+    LMIC.rxsyms    = syms;
+    LMIC.rxModelTotal  += syms * 2*hsym;
+    LMIC.rxLegacyTotal += MINRX_SYMS * 2*hsym;
+}
+
+// Valid class A downlink of dlen bytes received, LMIC.rxtime holds the RX done time
+static void rxCalibrate (u1_t dlen) {
+    if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2)) == 0 || getSf(LMIC.rps) == FSK )
+        return;
+    // preamble start vs nominal
+    ostime_t off   = LMIC.rxtime - calcAirTime(LMIC.rps, dlen) - LMIC.rxNominal;
+    ostime_t limit = PAMBL_SYMS*2*dr2hsym((LMIC.txrxFlags & TXRX_DNW1) != 0 ? LMIC.dndr : LMIC.dn2Dr);
+    if( off > limit || off < -limit )
+        return; // implausible
+    if( LMIC.rxCalCnt == 0 ) {
+        LMIC.rxBias = off;
+        LMIC.rxDev  = 0;
+    } else {
+        LMIC.rxBias += off / 4;
+        LMIC.rxDev  += ((off < 0 ? -off : off) - LMIC.rxDev) / 4;
+    }
+    if( LMIC.rxCalCnt != 0xFF )
+        LMIC.rxCalCnt++;
+}
+
+void LMIC_setClockError (u2_t ppm) {
+    LMIC.rxPpm = ppm;
+}
+
 // Setup scheduled RX window (ping/multicast slot)
 static void rxschedInit (xref2rxsched_t rxsched) {
     os_clearMem(AESkey,16);
@@ -469,8 +550,7 @@ static ostime_t rndDelay (u1_t secSpan) {
 }
 
 
-static void txDelay (ostime_t reftime, u1_t secSpan) {
-    reftime += rndDelay(secSpan);
+static void txDelayUntil (ostime_t reftime) {
     if( LMIC.globalDutyRate == 0  ||  (reftime - LMIC.globalDutyAvail) > 0 ) {
         LMIC.globalDutyAvail = reftime;
         LMIC.opmode |= OP_RNDTX;
@@ -478,6 +558,11 @@ static void txDelay (ostime_t reftime, u1_t secSpan) {
 }
 
 
+static void txDelay (ostime_t reftime, u1_t secSpan) {
+    txDelayUntil(reftime + rndDelay(secSpan));
+}
+
+
 static void setDrJoin (u1_t reason, u1_t dr) {
     EV(drChange, INFO, (e_.reason    = reason,
                         e_.deveui    = MAIN::CDEV->getEui(),
@@ -508,6 +593,205 @@ static void setDrTxpow (u1_t reason, u1_t dr, s1_t pow) {
 }
 
 
+// ================================================================================
+// Device side ADR
+// Keeps a window of link budget samples, from downlink SNR and LinkCheckAns margins,
+// and picks the fastest DR / lowest power that keeps devAdrMargin.
+
+#if defined(CFG_eu868)
+#define devAdrMaxPow() (LMIC.bands[LMIC.channelFreq[LMIC.txChnl] & 0x3].txpow)
+#else
+#define devAdrMaxPow() ((s1_t)MAX_TXPOW_125kHz)
+#endif
+
+// SNR (dB) needed to demodulate dr, rounded towards the conservative side
+static s1_t devAdrReqSnr (dr_t dr) {
+    return -(15 + 5*(getSf(updr2rps(dr)) - SF7)) / 2;
+}
+
+// Power the gateway most likely sent a downlink on freq with
+static s1_t devAdrGwPow (u4_t freq) {
+#if defined(CFG_eu868)
+    if( freq >= 869400000 && freq <= 869650000 )
+        return DEVADR_GW_TXPOW_HI;
+#endif
+    return DEVADR_GW_TXPOW;
+}
+
+static void devAdrSample (s1_t snrAt0dBm) {
+    LMIC.devAdrSilent = 0;
+    LMIC.devAdrHist[LMIC.devAdrNext] = snrAt0dBm;
+    LMIC.devAdrNext = (LMIC.devAdrNext + 1) % DEVADR_HIST;
+    if( LMIC.devAdrCnt < DEVADR_HIST )
+        LMIC.devAdrCnt++;
+}
+
+static bit_t devAdrUsable (dr_t dr) {
+#if defined(CFG_eu868)
+    return (LMIC.channelMap & LMIC.drChMask[dr]) != 0;
+#else
+    return 1;
+#endif
+}
+
+// Fastest DR, then lowest power keeping margin. Falls back to the slowest DR at full power.
+static void devAdrPick (s1_t link, s1_t margin, dr_t* pdr, s1_t* ppow) {
+    s1_t maxPow = devAdrMaxPow();
+    dr_t dr = DR_SF7;
+    while( !devAdrUsable(dr) || link + maxPow - devAdrReqSnr(dr) < margin ) {
+        if( decDR(dr) == dr ) {
+            *pdr = dr;
+            *ppow = maxPow;
+            return;
+        }
+        dr = decDR(dr);
+    }
+    s1_t pow = maxPow;
+    while( pow - DEVADR_POW_STEP >= DEVADR_MIN_TXPOW &&
+           link + pow - DEVADR_POW_STEP - devAdrReqSnr(dr) >= margin )
+        pow -= DEVADR_POW_STEP;
+    *pdr = dr;
+    *ppow = pow;
+}
+
+static void devAdrUpdate (void) {
+    s1_t link;
+    if( LMIC.devAdrMargin == 0 || !LMIC_linkBudget(&link) )
+        return;
+
+    dr_t curDr  = (dr_t)LMIC.datarate;
+    s1_t curPow = LMIC.adrTxPow < devAdrMaxPow() ? LMIC.adrTxPow : devAdrMaxPow();
+    dr_t dr;
+    s1_t pow;
+    // Faster only with the hysteresis on top, slower as soon as the margin is gone
+    devAdrPick(link, LMIC.devAdrMargin + LMIC.devAdrHyst, &dr, &pow);
+    if( dr > curDr || (dr == curDr && pow < curPow) ) {
+        LMIC.devAdrUps++;
+    } else if( link + curPow - devAdrReqSnr(curDr) < LMIC.devAdrMargin ) {
+        devAdrPick(link, LMIC.devAdrMargin, &dr, &pow);
+        if( dr == curDr && pow == curPow )
+            return;
+        LMIC.devAdrDowns++;
+    } else {
+        return;
+    }
+    setDrTxpow(DRCHG_DEVADR, dr, pow);
+}
+
+// Uplink without any downlink. Unconfirmed uplinks with link check off never get an answer
+// once the link is too weak, so back off blindly: full power first, then one DR slower.
+static void devAdrNoRx (void) {
+    if( LMIC.devAdrMargin == 0 || ++LMIC.devAdrSilent < DEVADR_SILENT_UPS )
+        return;
+    LMIC.devAdrSilent = 0;
+    LMIC.devAdrCnt = LMIC.devAdrNext = 0;  // stale, a faster setting needs fresh samples
+    s1_t maxPow = devAdrMaxPow();
+    if( LMIC.adrTxPow < maxPow ) {
+        setDrTxpow(DRCHG_DEVADR, LMIC.datarate, maxPow);
+    } else if( decDR((dr_t)LMIC.datarate) != LMIC.datarate ) {
+        setDrTxpow(DRCHG_DEVADR, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+    } else {
+        return;
+    }
+    LMIC.devAdrDowns++;
+}
+
+// Samples are collected also while off, turning it on acts on the existing window
+void LMIC_setDeviceAdr (u1_t marginDb, u1_t hystDb) {
+    LMIC.devAdrMargin = marginDb;
+    LMIC.devAdrHyst   = hystDb;
+}
+
+// Link budget and limits for rate decisions of the application, e.g. per message
+bit_t LMIC_linkBudget (s1_t* snrAt0dBm) {
+    if( LMIC.devAdrCnt < DEVADR_MIN_SAMPLES )
+        return 0;
+    s2_t sum = 0;
+    for( u1_t i=0; i<LMIC.devAdrCnt; i++ )
+        sum += LMIC.devAdrHist[i];
+    *snrAt0dBm = sum / LMIC.devAdrCnt;
+    return 1;
+}
+
+s1_t LMIC_demodSnr (dr_t dr) {
+    return devAdrReqSnr(dr);
+}
+
+bit_t LMIC_drUsable (dr_t dr) {
+    return devAdrUsable(dr);
+}
+
+s1_t LMIC_maxTxPow (void) {
+    return devAdrMaxPow();
+}
+
+u1_t LMIC_maxFrameLen (dr_t dr) {
+    return maxFrameLen(dr);
+}
+
+
+// ================================================================================
+// Retry policy of confirmed uplinks
+
+// Delay of the next retry after txCnt failed attempts
+static ostime_t retryBackoff (void) {
+    ostime_t delay = LMIC.retryPol.backoff;
+    if( LMIC.retryPol.backoffMode == RETRY_BACKOFF_EXP ) {
+        for( u1_t i=1; i<LMIC.txCnt && delay < ((ostime_t)1 << 29); i++ )
+            delay <<= 1;
+        if( LMIC.retryPol.backoffMax != 0 && delay > LMIC.retryPol.backoffMax )
+            delay = LMIC.retryPol.backoffMax;
+    }
+    if( LMIC.retryPol.jitter > 0 )
+        delay += (ostime_t)(((u8_t)LMIC.retryPol.jitter * os_getRndU2()) >> 16);
+    return delay;
+}
+
+// Schedules the next attempt of a confirmed uplink, 0 if the policy gives up
+static bit_t retrySchedule (void) {
+    if( LMIC.txCnt >= LMIC.retryPol.attempts )
+        return 0;
+    ostime_t txbeg = LMIC.rxtime + retryBackoff();
+    if( LMIC.retryPol.deadline != 0 && LMIC.txAttCnt != 0 &&
+        txbeg - LMIC.txAtt[0].txbeg > LMIC.retryPol.deadline )
+        return 0;
+    LMIC.txCnt += 1;
+    if( (LMIC.retryPol.drSteps >> (LMIC.txCnt-1)) & 1 )
+        setDrTxpow(DRCHG_NOACK, decDR((dr_t)LMIC.datarate), KEEP_TXPOW);
+    txDelayUntil(txbeg);
+    return 1;
+}
+
+// Leaves the channel of the previous attempt out of map for a retry, if others remain
+static u8_t retryChnlMask (u8_t map, u1_t prev) {
+    if( LMIC.txCnt > 1 && LMIC.retryPol.newChnl && prev < 64 && (map & ~((u8_t)1 << prev)) != 0 )
+        map &= ~((u8_t)1 << prev);
+    return map;
+}
+
+static void retryRecord (ostime_t txbeg, dr_t dr) {
+    if( LMIC.txCnt <= 1 )
+        LMIC.txAttCnt = 0;
+    if( LMIC.txAttCnt >= TXCONF_MAX_ATTEMPTS )
+        return;
+    txatt_t* att = &LMIC.txAtt[LMIC.txAttCnt++];
+    att->txbeg  = txbeg;
+    att->dr     = dr;
+    att->chnl   = LMIC.txChnl;
+    att->txpow  = LMIC.txpow;
+    att->result = TXATT_NONE;
+}
+
+// Takes effect with the next uplink, a confirmed uplink in progress keeps counting its attempts
+void LMIC_setRetryPolicy (const retrypol_t* pol) {
+    LMIC.retryPol = pol != NULL ? *pol : RETRY_DEFAULT;
+    if( LMIC.retryPol.attempts == 0 )
+        LMIC.retryPol.attempts = 1;
+    else if( LMIC.retryPol.attempts > TXCONF_MAX_ATTEMPTS )
+        LMIC.retryPol.attempts = TXCONF_MAX_ATTEMPTS;
+}
+
+
 void LMIC_stopPingable (void) {
     LMIC.opmode &= ~(OP_PINGABLE|OP_PINGINI);
 }
@@ -524,6 +808,20 @@ void LMIC_setPingable (u1_t intvExp) {
 }
 
 
+// Select a TX channel from a non-empty channel bitmap: the next one after last (round robin)
+// or a random one if random hopping is enabled
+static u1_t pickChnl (u8_t map, u1_t last) {
+    if( LMIC.randomHop ) {
+        u1_t n = os_getRndU1() % __builtin_popcountll(map);
+        while( n-- > 0 )
+            map &= map-1; // drop lowest channel
+        return __builtin_ctzll(map);
+    }
+    u8_t above = last >= 63 ? 0 : map & (~(u8_t)0 << (last+1));
+    return __builtin_ctzll(above != 0 ? above : map);
+}
+
+
 #if defined(CFG_eu868)
 // ================================================================================
 //
@@ -540,10 +838,134 @@ static const u4_t iniChannelFreq[12] = {
     EU868_F4|BAND_MILLI, EU868_F5|BAND_MILLI, EU868_F6|BAND_DECI
 };
 
+// Keep the per band and per datarate channel masks in sync with channelFreq/channelDrMap
+static void updateChMasks (u1_t chidx) {
+    u2_t bit = 1<<chidx;
+    for( u1_t b=0; b<MAX_BANDS; b++ )
+        LMIC.bandChMask[b] &= ~bit;
+    if( LMIC.channelFreq[chidx] != 0 )
+        LMIC.bandChMask[LMIC.channelFreq[chidx] & 0x3] |= bit;
+    for( u1_t dr=0; dr<16; dr++ ) {
+        if( (LMIC.channelDrMap[chidx] & (1<<dr)) != 0 )
+            LMIC.drChMask[dr] |= bit;
+        else
+            LMIC.drChMask[dr] &= ~bit;
+    }
+}
+
+static u1_t countChnls (u2_t map) {
+    u1_t n = 0;
+    for( ; map != 0; map &= map-1 )
+        n++;
+    return n;
+}
+
+// Uplink on txChnl finished, acked: 1 = ACK, 0 = no ACK
+static void chStatsConf (bit_t acked) {
+    u1_t chnl = LMIC.txChnl;
+    chstats_t* st = &LMIC.chStats[chnl];
+    if( acked )
+        st->ackCnt++;
+    else
+        st->nackCnt++;
+    u2_t conf = st->ackCnt + st->nackCnt;
+    if( conf > CHSTATS_MAX_CONF ) {
+        st->ackCnt  >>= 1;
+        st->nackCnt >>= 1;
+    }
+    if( acked || conf < CHSTATS_MIN_CONF || st->ackCnt*100 >= CHSTATS_MIN_SUCCESS*conf )
+        return;
+    // Bad channel - leave it out for a while if enough others remain for hopping
+    u2_t active = LMIC.channelMap & ~LMIC.chBlocked & ~(1<<chnl);
+    if( countChnls(active) < CHSTATS_MIN_ACTIVE )
+        return;
+    LMIC.chBlocked |= 1<<chnl;
+    st->blockEnd = os_getTime() + sec2osticks(CHSTATS_BLOCK_secs);
+    st->ackCnt = st->nackCnt = 0; // fresh start once unblocked
+}
+
+static void chStatsTx (void) {
+    chstats_t* st = &LMIC.chStats[LMIC.txChnl];
+    if( st->txCnt != 0xFFFF )
+        st->txCnt++;
+}
+
+static void chStatsRx (void) {
+    chstats_t* st = &LMIC.chStats[LMIC.txChnl];
+    if( st->rxCnt != 0xFFFF )
+        st->rxCnt++;
+    if( (LMIC.txrxFlags & TXRX_DNW1) == 0 )
+        return; // RX2 is not on this channel's frequency
+    s2_t rssi = LMIC.rssi - RSSI_OFF;
+    if( st->rx1Cnt != 0xFFFF )
+        st->rx1Cnt++;
+    if( st->rx1Cnt == 1 ) {
+        st->rssi = rssi;
+        st->snr  = LMIC.snr;
+    } else {
+        st->rssi += (rssi - st->rssi) / 4;
+        st->snr  += (LMIC.snr - st->snr) / 4;
+    }
+}
+
+// Release channels whose block time is over
+static void chStatsExpire (ostime_t now) {
+    for( u2_t map = LMIC.chBlocked; map != 0; map &= map-1 ) {
+        u1_t chnl = __builtin_ctz(map);
+        if( now - LMIC.chStats[chnl].blockEnd >= 0 )
+            LMIC.chBlocked &= ~(1<<chnl);
+    }
+}
+
+static void resetChStats (u1_t chnl) {
+    os_clearMem(&LMIC.chStats[chnl], sizeof(chstats_t));
+    LMIC.chBlocked &= ~(1<<chnl);
+}
+
+const chstats_t* LMIC_getChannelStats (u1_t channel) {
+    if( channel >= MAX_CHANNELS )
+        return NULL;
+    return &LMIC.chStats[channel];
+}
+
+u2_t LMIC_getBlockedChannels (void) {
+    return LMIC.chBlocked;
+}
+
+void LMIC_resetChannelStats (void) {
+    os_clearMem(&LMIC.chStats, sizeof(LMIC.chStats));
+    LMIC.chBlocked = 0;
+}
+
+// Listen before talk on txChnl, returns 0 if the TX has to be deferred
+static bit_t lbtClear (void) {
+    LMIC.freq = LMIC.channelFreq[LMIC.txChnl] & ~(u4_t)3;
+    LMIC.rps  = updr2rps(LMIC.datarate);
+    LMIC.lbtChecks++;
+    if( radio_channelFree(LMIC.lbtMode, LMIC.lbtThreshold) ) {
+        LMIC.lbtDeferCnt = 0;
+        return 1;
+    }
+    if( LMIC.lbtDeferCnt >= LMIC.lbtMaxDefer ) {
+        // Do not starve the uplink
+        LMIC.lbtForced++;
+        LMIC.lbtDeferCnt = 0;
+        return 1;
+    }
+    LMIC.lbtDeferCnt++;
+    LMIC.lbtDeferred++;
+    // Retry after the backoff, on whichever channel is eligible then
+    txDelay(os_getTime() + ms2osticks(LMIC.lbtBackoff), 0);
+    LMIC.opmode |= OP_NEXTCHNL;
+    return 0;
+}
+
 static void initDefaultChannels (bit_t join) {
     os_clearMem(&LMIC.channelFreq, sizeof(LMIC.channelFreq));
     os_clearMem(&LMIC.channelDrMap, sizeof(LMIC.channelDrMap));
     os_clearMem(&LMIC.bands, sizeof(LMIC.bands));
+    os_clearMem(&LMIC.bandChMask, sizeof(LMIC.bandChMask));
+    os_clearMem(&LMIC.drChMask, sizeof(LMIC.drChMask));
 
     LMIC.channelMap = 0x3F;
     u1_t su = join ? 0 : 6;
@@ -555,6 +977,8 @@ static void initDefaultChannels (bit_t join) {
         LMIC.channelDrMap[5] = DR_RANGE_MAP(DR_SF12,DR_SF7);
         LMIC.channelDrMap[1] = DR_RANGE_MAP(DR_SF12,DR_FSK);
     }
+    for( u1_t fu=0; fu<6; fu++ )
+        updateChMasks(fu);
 
     LMIC.bands[BAND_MILLI].txcap    = 1000;  // 0.1%
     LMIC.bands[BAND_MILLI].txpow    = 14;
@@ -598,13 +1022,19 @@ bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
     LMIC.channelFreq [chidx] = freq;
     LMIC.channelDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF12,DR_SF7) : drmap;
     LMIC.channelMap |= 1<<chidx;  // enabled right away
+    updateChMasks(chidx);
+    resetChStats(chidx);
     return 1;
 }
 
 void LMIC_disableChannel (u1_t channel) {
+    if( channel >= MAX_CHANNELS )
+        return;
     LMIC.channelFreq[channel] = 0;
     LMIC.channelDrMap[channel] = 0;
     LMIC.channelMap &= ~(1<<channel);
+    updateChMasks(channel);
+    resetChStats(channel);
 }
 
 static u4_t convFreq (xref2u1_t ptr) {
@@ -635,6 +1065,12 @@ static void updateTx (ostime_t txbeg) {
     xref2band_t band = &LMIC.bands[freq & 0x3];
     LMIC.freq  = freq & ~(u4_t)3;
     LMIC.txpow = band->txpow;
+    if( LMIC.msgTxPow != 0 ) {
+        if( LMIC.msgTxPow < LMIC.txpow )
+            LMIC.txpow = LMIC.msgTxPow;  // chosen for this uplink by the application
+    } else if( LMIC.devAdrMargin != 0 && LMIC.adrTxPow < LMIC.txpow ) {
+        LMIC.txpow = LMIC.adrTxPow;  // device ADR lowers the power, otherwise the band power is used
+    }
     band->avail = txbeg + airtime * band->txcap;
     if( LMIC.globalDutyRate != 0 )
         LMIC.globalDutyAvail = txbeg + (airtime<<LMIC.globalDutyRate);
@@ -642,6 +1078,7 @@ static void updateTx (ostime_t txbeg) {
 
 static ostime_t nextTx (ostime_t now) {
     u1_t bmap=0xF;
+    chStatsExpire(now);
     do {
         ostime_t mintime = now + /*10h*/sec2osticks(36000); // Some time in the future to find mintime from bands
         u1_t band=0;
@@ -650,16 +1087,13 @@ static ostime_t nextTx (ostime_t now) {
                 mintime = LMIC.bands[band = bi].avail;
         }
         // Find next channel in given band
-        u1_t chnl = LMIC.bands[band].lastchnl;
-        for( u1_t ci=0; ci<MAX_CHANNELS; ci++ ) {
-            if( (chnl = (chnl+1)) >= MAX_CHANNELS )
-                chnl -=  MAX_CHANNELS;
-            if( (LMIC.channelMap & (1<<chnl)) != 0  &&  // channel enabled
-                (LMIC.channelDrMap[chnl] & (1<<(LMIC.datarate&0xF))) != 0  &&
-                band == (LMIC.channelFreq[chnl] & 0x3) ) { // in selected band
-                LMIC.txChnl = LMIC.bands[band].lastchnl = chnl;
-                return mintime;
-            }
+        u2_t map = LMIC.channelMap & LMIC.bandChMask[band] & LMIC.drChMask[LMIC.datarate&0xF];
+        map = retryChnlMask(map, LMIC.txChnl);
+        if( (map & ~LMIC.chBlocked) != 0 )
+            map &= ~LMIC.chBlocked; // prefer good channels
+        if( map != 0 ) {
+            LMIC.txChnl = LMIC.bands[band].lastchnl = pickChnl(map, LMIC.bands[band].lastchnl);
+            return mintime;
         }
         if( (bmap &= ~(1<<band)) == 0 ) {
             // No feasible channel  found!
@@ -749,13 +1183,14 @@ bit_t LMIC_setupChannel (u1_t chidx, u4_t freq, u2_t drmap, s1_t band) {
     chidx -= 72;
     LMIC.xchFreq[chidx] = freq;
     LMIC.xchDrMap[chidx] = drmap==0 ? DR_RANGE_MAP(DR_SF10,DR_SF8C) : drmap;
+    chidx += 72;
     LMIC.channelMap[chidx>>4] |= (1<<(chidx&0xF));
     return 1;
 }
 
 void LMIC_disableChannel (u1_t channel) {
     if( channel < 72+MAX_XCHANNELS )
-        LMIC.channelMap[channel/4] &= ~(1<<(channel&0xF));
+        LMIC.channelMap[channel>>4] &= ~(1<<(channel&0xF));
 }
 
 static u1_t mapChannels (u1_t chpage, u2_t chmap) {
@@ -796,24 +1231,34 @@ static void updateTx (ostime_t txbeg) {
 
 // US does not have duty cycling - return now as earliest TX time
 #define nextTx(now) (_nextTx(),(now))
+// No channel quality tracking on US915
+#define chStatsTx() do{}while(0)
+#define chStatsConf(acked) do{}while(0)
+#define chStatsRx() do{}while(0)
+// No listen before talk on US915 (frequency hopping)
+#define lbtClear() 1
 static void _nextTx (void) {
     if( LMIC.chRnd==0 )
         LMIC.chRnd = os_getRndU1() & 0x3F;
     if( LMIC.datarate >= DR_SF8C ) { // 500kHz
-        u1_t map = LMIC.channelMap[64/16]&0xFF;
-        for( u1_t i=0; i<8; i++ ) {
-            if( (map & (1<<(++LMIC.chRnd & 7))) != 0 ) {
-                LMIC.txChnl = 64 + (LMIC.chRnd & 7);
-                return;
-            }
+        u1_t map = retryChnlMask(LMIC.channelMap[64/16]&0xFF, LMIC.txChnl-64);
+        if( map != 0 ) {
+            u1_t chnl = pickChnl(map, LMIC.chRnd & 7);
+            LMIC.chRnd = (LMIC.chRnd & ~7) | chnl;
+            LMIC.txChnl = 64 + chnl;
+            return;
         }
     } else { // 125kHz
-        for( u1_t i=0; i<64; i++ ) {
-            u1_t chnl = ++LMIC.chRnd & 0x3F;
-            if( (LMIC.channelMap[(chnl >> 4)] & (1<<(chnl & 0xF))) != 0 ) {
-                LMIC.txChnl = chnl;
-                return;
-            }
+        u8_t map = (u8_t)LMIC.channelMap[0]
+            | ((u8_t)LMIC.channelMap[1] << 16)
+            | ((u8_t)LMIC.channelMap[2] << 32)
+            | ((u8_t)LMIC.channelMap[3] << 48);
+        map = retryChnlMask(map, LMIC.txChnl);
+        if( map != 0 ) {
+            u1_t chnl = pickChnl(map, LMIC.chRnd & 0x3F);
+            LMIC.chRnd = (LMIC.chRnd & ~0x3F) | chnl;
+            LMIC.txChnl = chnl;
+            return;
         }
     }
     // No feasible channel  found! Keep old one.
@@ -960,6 +1405,47 @@ static int decodeBeacon (void) {
 }
 
 
+static mcgroup_t* mcastGroup (devaddr_t addr) {
+    for( u1_t i=0; i<LMIC_MCAST_GROUPS; i++ ) {
+        if( LMIC.mcast[i].addr == addr && addr != 0 )
+            return &LMIC.mcast[i];
+    }
+    return 0;
+}
+
+// Frame for multicast group grp. Only unconfirmed application data without
+// MAC commands is allowed and only in ping slots or class C windows.
+static bit_t decodeMcast (mcgroup_t* grp, int ftype, int fct, u4_t seqno, int poff, int pend) {
+    xref2u1_t d = LMIC.frame;
+    if( ftype != HDR_FTYPE_DADN || (fct & (FCT_ACK|FCT_OPTLEN)) != 0 ||
+        pend <= poff || d[poff] == 0 ||
+        (LMIC.txrxFlags & (TXRX_PING|TXRX_CLASSC)) == 0 ) {
+        grp->rejected++;
+        goto norx;
+    }
+    seqno = grp->seqnoDn + (u2_t)(seqno - grp->seqnoDn);
+    if( !aes_verifyMicRk(grp->nwkRk, grp->addr, seqno, /*dn*/1, d, pend) ) {
+        grp->micErrors++;
+        goto norx;
+    }
+    if( seqno < grp->seqnoDn ) {
+        grp->rejected++;  // no replays, multicast frames are never confirmed
+        goto norx;
+    }
+    grp->seqnoDn = seqno+1;
+    grp->frames++;
+    poff++;  // port
+    aes_cipherRk(grp->artRk, grp->addr, seqno, /*dn*/1, d+poff, pend-poff);
+    LMIC.dnGroup   = grp - LMIC.mcast;
+    LMIC.txrxFlags |= TXRX_PORT;
+    LMIC.dataBeg   = poff;
+    LMIC.dataLen   = pend-poff;
+    return 1;
+  norx:
+    LMIC.dataLen = 0;
+    return 0;
+}
+
 static bit_t decodeFrame (void) {
     xref2u1_t d = LMIC.frame;
     u1_t hdr    = d[0];
@@ -986,8 +1472,10 @@ static bit_t decodeFrame (void) {
     int  ackup = (fct & FCT_ACK) != 0 ? 1 : 0;   // ACK last up frame
     int  poff  = OFF_DAT_OPTS+olen;
     int  pend  = dlen-4;  // MIC
+    mcgroup_t* grp = 0;
 
-    if( addr != LMIC.devaddr ) {
+    LMIC.dnGroup = MCAST_NONE;
+    if( addr != LMIC.devaddr && (grp = mcastGroup(addr)) == 0 ) {
         EV(specCond, WARN, (e_.reason = EV::specCond_t::ALIEN_ADDRESS,
                             e_.eui    = MAIN::CDEV->getEui(),
                             e_.info   = addr,
@@ -1000,6 +1488,8 @@ static bit_t decodeFrame (void) {
                            e_.info   = 0x1000000 + (poff-pend) + (fct<<8) + (dlen<<16)));
         goto norx;
     }
+    if( grp != 0 )
+        return decodeMcast(grp, ftype, fct, seqno, poff, pend);
 
     int port = -1;
     int replayConf = 0;
@@ -1017,6 +1507,7 @@ static bit_t decodeFrame (void) {
                            e_.info3  = LMIC.devaddr));
         goto norx;
     }
+    rxCalibrate(dlen);
     if( seqno < LMIC.seqnoDn ) {
         if( (s4_t)seqno > (s4_t)LMIC.seqnoDn ) {
             EV(specCond, INFO, (e_.reason = EV::specCond_t::DNSEQNO_ROLL_OVER,
@@ -1049,6 +1540,7 @@ static bit_t decodeFrame (void) {
         LMIC.dnConf = (ftype == HDR_FTYPE_DCDN ? FCT_ACK : 0);
     }
 
+    LMIC.moreData = (fct & FCT_MORE) != 0;
     if( LMIC.dnConf || (fct & FCT_MORE) )
         LMIC.opmode |= OP_POLL;
 
@@ -1060,14 +1552,17 @@ static bit_t decodeFrame (void) {
     // Process OPTS
     int m = LMIC.rssi - RSSI_OFF - getSensitivity(LMIC.rps);
     LMIC.margin = m < 0 ? 0 : m > 254 ? 254 : m;
+    devAdrSample(LMIC.snr/4 - devAdrGwPow(LMIC.freq));
 
     xref2u1_t opts = &d[OFF_DAT_OPTS];
     int oidx = 0;
     while( oidx < olen ) {
         switch( opts[oidx] ) {
         case MCMD_LCHK_ANS: {
-            //int gwmargin = opts[oidx+1];
+            int gwmargin = opts[oidx+1];
             //int ngws = opts[oidx+2];
+            if( gwmargin <= 254 )  // 255 = unknown
+                devAdrSample(gwmargin + devAdrReqSnr((dr_t)LMIC.txDr) - LMIC.txpow);
             oidx += 3;
             continue;
         }
@@ -1156,6 +1651,18 @@ static bit_t decodeFrame (void) {
             LMIC.pingSetAns = flags;
             continue;
         }
+        case MCMD_TIME_ANS: {
+            // Network time at the end of the uplink carrying the request
+            if( LMIC.devTimeReq == 2 ) {
+                LMIC.netTimeSec  = os_rlsbf4(&opts[oidx+1]);
+                LMIC.netTimeFrac = opts[oidx+5];
+                LMIC.netTimeRef  = LMIC.txend;
+                LMIC.netTimeNew  = 1;
+                LMIC.devTimeReq  = 0;
+            }
+            oidx += 6;
+            continue;
+        }
         case MCMD_BCNI_ANS: {
             // Ignore if tracking already enabled
             if( (LMIC.opmode & OP_TRACK) == 0 ) {
@@ -1195,6 +1702,8 @@ static bit_t decodeFrame (void) {
                            e_.eui    = MAIN::CDEV->getEui(),
                            e_.info   = 0x1000000 + (oidx) + (olen<<8)));
     }
+    if( (LMIC.ladrAns & 0x80) == 0 )
+        devAdrUpdate();  // a LinkADRReq of the network takes precedence
 
     if( !replayConf ) {
         // Handle payload only if not a replay
@@ -1253,6 +1762,7 @@ static bit_t decodeFrame (void) {
 
 
 static void setupRx2 (void) {
+    os_jobRxCheck(LMIC.rxtime);
     LMIC.txrxFlags = TXRX_DNW2;
     LMIC.rps = dndr2rps(LMIC.dn2Dr);
     LMIC.freq = LMIC.dn2Freq;
@@ -1263,11 +1773,13 @@ static void setupRx2 (void) {
 
 static void schedRx2 (ostime_t delay, osjobcb_t func) {
     // Add 1.5 symbols we need 5 out of 8. Try to sync 1.5 symbols into the preamble.
-    LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dn2Dr);
+    // Widened by the expected timing error.
+    rxWindow(delay, LMIC.dn2Dr);
     os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
 }
 
 static void setupRx1 (osjobcb_t func) {
+    os_jobRxCheck(LMIC.rxtime);
     LMIC.txrxFlags = TXRX_DNW1;
     // Turn LMIC.rps from TX over to RX
     LMIC.rps = setNocrc(LMIC.rps,1);
@@ -1296,9 +1808,9 @@ static void txDone (ostime_t delay, osjobcb_t func) {
     else
 #endif
     {
-        LMIC.rxtime = LMIC.txend + delay + (PAMBL_SYMS-MINRX_SYMS)*dr2hsym(LMIC.dndr);
-        LMIC.rxsyms = MINRX_SYMS;
+        rxWindow(delay, LMIC.dndr);
     }
+    LMIC.rxWinUplinks++;
     os_setTimedCallback(&LMIC.osjob, LMIC.rxtime - RX_RAMPUP, func);
 }
 
@@ -1363,6 +1875,7 @@ static bit_t processJoinAccept (void) {
                            e_.info   = mic));
         goto badframe;
     }
+    rxCalibrate(dlen);
 
     u4_t addr = os_rlsbf4(LMIC.frame+OFF_JA_DEVADDR);
     LMIC.devaddr = addr;
@@ -1432,6 +1945,7 @@ static void processRx1Jacc (xref2osjob_t osjob) {
 
 
 static void setupRx1Jacc (xref2osjob_t osjob) {
+    LMIC.radioGap = DELAY_JACC2_osticks - DELAY_JACC1_osticks;
     setupRx1(FUNC_ADDR(processRx1Jacc));
 }
 
@@ -1444,6 +1958,137 @@ static void jreqDone (xref2osjob_t osjob) {
 
 // Fwd decl.
 static bit_t processDnData(void);
+static bit_t processDnFrame(bit_t decoded);
+
+// ======================================== Class C
+
+// symbols after the preamble until a LoRa header is valid
+#if !defined(RXC_HDR_SYMS)
+#define RXC_HDR_SYMS 8
+#endif
+
+static void processRxC (xref2osjob_t osjob);
+
+// (Re)start the continuous receiver on the RX2 frequency/DR, LMIC.osjob is reserved for its RX done
+static bit_t rxcListen (void) {
+    if( getSf(dndr2rps(LMIC.dn2Dr)) == FSK )
+        return 0; // the radio only has continuous RX for LoRa
+    ostime_t now = os_getTime();
+    if( LMIC.rxcOffSince != 0 ) {
+        ostime_t off = now - LMIC.rxcOffSince;
+        LMIC.rxcOffTotal += off;
+        if( off > LMIC.rxcOffMax )
+            LMIC.rxcOffMax = off;
+        LMIC.rxcOffSince = 0;
+    }
+    os_clearCallback(&LMIC.osjob);
+    LMIC.freq    = LMIC.dn2Freq;
+    LMIC.rps     = dndr2rps(LMIC.dn2Dr);
+    LMIC.dataLen = 0;
+    LMIC.osjob.func = FUNC_ADDR(processRxC);
+    LMIC.rxcOn   = 1;
+    os_radio(RADIO_RXON);
+    return 1;
+}
+
+// Listen between transactions, 0 if class C does not apply right now
+static bit_t rxcStart (void) {
+    if( (LMIC.opmode & OP_CLASSC) == 0 ) {
+        LMIC.rxcOffSince = 0; // off time only counts while class C is enabled
+        return 0;
+    }
+    if( LMIC.devaddr == 0 || (LMIC.opmode & (OP_JOINING|OP_SCAN|OP_TRACK|OP_TXRXPEND|OP_SHUTDOWN)) != 0 )
+        return 0;
+    return rxcListen();
+}
+
+// Pre-empt the receiver for TX or other radio use
+static void rxcStop (void) {
+    os_clearCallback(&LMIC.rxcjob);
+    if( !LMIC.rxcOn )
+        return;
+    LMIC.rxcOn = 0;
+    LMIC.rxcOffSince = os_getTime() | 1;
+    os_clearCallback(&LMIC.osjob);
+    os_radio(RADIO_RST);
+}
+
+// No downlink in RX2 of the pending transaction
+static void rxcRx2End (xref2osjob_t osjob) {
+    if( !LMIC.rxcExtended && radio_rxActive() ) {
+        // A frame is coming in, its RX done completes the transaction if it is ours.
+        // Bounded by the longest frame in case its header turns out invalid.
+        LMIC.rxcExtended = 1;
+        os_setTimedCallback(&LMIC.rxcjob, os_getTime() + calcAirTime(LMIC.rps, MAX_LEN_FRAME),
+                            FUNC_ADDR(rxcRx2End));
+        return;
+    }
+    rxcStop();
+    LMIC.txrxFlags = 0;  // nothing in 1st/2nd DN slot
+    LMIC.dataLen = 0;
+    processDnData();     // engineUpdate() resumes the receiver
+}
+
+// Class C RX2 starts right after RX1 and lasts until a downlink sent at RX2 would have been detected
+static bit_t rxcRx2 (void) {
+    if( !rxcListen() )
+        return 0;
+    LMIC.rxNominal   = LMIC.txend + DELAY_DNW2_osticks + LMIC.rxBias;
+    LMIC.rxcExtended = 0;
+    os_setTimedCallback(&LMIC.rxcjob,
+                        LMIC.rxNominal + (PAMBL_SYMS+RXC_HDR_SYMS)*2*dr2hsym(LMIC.dn2Dr) + us2osticks(RX_TSERR_us),
+                        FUNC_ADDR(rxcRx2End));
+    return 1;
+}
+
+static void processRxC (xref2osjob_t osjob) {
+    // the radio went to sleep with the RX done
+    LMIC.rxcOn = 0;
+    LMIC.rxcOffSince = LMIC.rxtime | 1;
+    if( (LMIC.opmode & OP_TXRXPEND) != 0 ) {
+        // RX2 of the pending transaction - only a frame for this device ends it,
+        // others on the shared RX2 channel must not cut the window short
+        u4_t addr = LMIC.dataLen >= OFF_DAT_OPTS+4 ? os_rlsbf4(&LMIC.frame[OFF_DAT_ADDR]) : 0;
+        if( addr == LMIC.devaddr ) {
+            LMIC.txrxFlags = TXRX_DNW2;
+            if( decodeFrame() ) {
+                os_clearCallback(&LMIC.rxcjob);
+                processDnFrame(1);
+                return;
+            }
+        } else {
+            LMIC.txrxFlags = TXRX_CLASSC;
+            if( decodeFrame() ) {  // multicast group of this device
+                LMIC.rxcFrames++;
+                reportEvent(EV_RXCOMPLETE);
+            }
+        }
+        // engineUpdate() is a no-op while pending, rxcjob still ends RX2
+        rxcListen();
+        return;
+    }
+    LMIC.txrxFlags = TXRX_CLASSC;
+    if( decodeFrame() ) {
+        LMIC.rxcFrames++;
+        reportEvent(EV_RXCOMPLETE);
+        return;
+    }
+    engineUpdate();
+}
+
+void LMIC_setClassC (bit_t enabled) {
+    if( enabled ) {
+        LMIC.opmode |= OP_CLASSC;
+    } else {
+        LMIC.opmode &= ~OP_CLASSC;
+        if( (LMIC.opmode & OP_TXRXPEND) != 0 )
+            return; // a running class C RX2 still completes the transaction
+        rxcStop();
+        LMIC.rxcOffSince = 0;
+    }
+    if( LMIC.devaddr != 0 ) // do not start joining from here
+        engineUpdate();
+}
 
 static void processRx2DnDataDelay (xref2osjob_t osjob) {
     processDnData();
@@ -1470,12 +2115,16 @@ static void setupRx2DnData (xref2osjob_t osjob) {
 
 
 static void processRx1DnData (xref2osjob_t osjob) {
-    if( LMIC.dataLen == 0 || !processDnData() )
+    if( LMIC.dataLen == 0 || !processDnData() ) {
+        if( (LMIC.opmode & OP_CLASSC) != 0 && rxcRx2() )
+            return;
         schedRx2(DELAY_DNW2_osticks, FUNC_ADDR(setupRx2DnData));
+    }
 }
 
 
 static void setupRx1DnData (xref2osjob_t osjob) {
+    LMIC.radioGap = DELAY_DNW2_osticks - DELAY_DNW1_osticks;
     setupRx1(FUNC_ADDR(processRx1DnData));
 }
 
@@ -1528,6 +2177,11 @@ static void buildDataFrame (void) {
         LMIC.frame[end] = MCMD_BCNI_REQ;
         end += 1;
     }
+    if( LMIC.devTimeReq ) {
+        LMIC.frame[end] = MCMD_TIME_REQ;
+        end += 1;
+        LMIC.devTimeReq = 2;
+    }
     if( LMIC.adrChanged ) {
         if( LMIC.adrAckReq < 0 )
             LMIC.adrAckReq = 0;
@@ -1567,7 +2221,7 @@ static void buildDataFrame (void) {
                            e_.eui    = MAIN::CDEV->getEui(),
                            e_.info   = LMIC.seqnoUp-1,
                            e_.info2  = ((LMIC.txCnt+1) |
-                                        (DRADJUST[LMIC.txCnt+1] << 8) |
+                                        (((LMIC.retryPol.drSteps >> (LMIC.txCnt-1)) & 1) << 8) |
                                         ((LMIC.datarate|DR_PAGE)<<16))));
     }
     os_wlsbf2(LMIC.frame+OFF_DAT_SEQNO, LMIC.seqnoUp-1);
@@ -1743,16 +2397,21 @@ static void processPingRx (xref2osjob_t osjob) {
 
 
 static bit_t processDnData (void) {
+    return processDnFrame(0);
+}
+
+// decoded: decodeFrame() already accepted the frame
+static bit_t processDnFrame (bit_t decoded) {
     ASSERT((LMIC.opmode & OP_TXRXPEND)!=0);
 
+    if( decoded )
+        goto txcomplete;
     if( LMIC.dataLen == 0 ) {
       norx:
         if( LMIC.txCnt != 0 ) {
-            if( LMIC.txCnt < TXCONF_ATTEMPTS ) {
-                LMIC.txCnt += 1;
-                setDrTxpow(DRCHG_NOACK, lowerDR(LMIC.datarate, DRADJUST[LMIC.txCnt]), KEEP_TXPOW);
-                // Schedule another retransmission
-                txDelay(LMIC.rxtime, RETRY_PERIOD_secs);
+            chStatsConf(0);
+            // Schedule another retransmission
+            if( retrySchedule() ) {
                 LMIC.opmode &= ~OP_TXRXPEND;
                 engineUpdate();
                 return 1;
@@ -1764,9 +2423,22 @@ static bit_t processDnData (void) {
         }
         if( LMIC.adrAckReq != LINK_CHECK_OFF )
             LMIC.adrAckReq += 1;
+        devAdrNoRx();
         LMIC.dataBeg = LMIC.dataLen = 0;
       txcomplete:
         LMIC.opmode &= ~(OP_TXDATA|OP_TXRXPEND);
+        if( LMIC.txAttCnt != 0 )
+            LMIC.txAtt[LMIC.txAttCnt-1].result = (LMIC.txrxFlags & TXRX_ACK) != 0 ? TXATT_ACK
+                : (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2)) != 0 ? TXATT_RX : TXATT_NONE;
+        if( LMIC.devTimeReq == 2 )
+            LMIC.devTimeReq = 0;  // not answered, the application may ask again
+        if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2)) != 0 ) {
+            chStatsRx();
+            if( (LMIC.txrxFlags & TXRX_ACK) != 0 )
+                chStatsConf(1);
+            else if( (LMIC.txrxFlags & TXRX_NACK) != 0 )
+                chStatsConf(0);
+        }
         if( (LMIC.txrxFlags & (TXRX_DNW1|TXRX_DNW2|TXRX_PING)) != 0  &&  (LMIC.opmode & OP_LINKDEAD) != 0 ) {
             LMIC.opmode &= ~OP_LINKDEAD;
             reportEvent(EV_LINK_ALIVE);
@@ -1870,22 +2542,52 @@ static void processBeacon (xref2osjob_t osjob) {
 
 
 static void startRxBcn (xref2osjob_t osjob) {
+    os_jobRxCheck(LMIC.rxtime);
     LMIC.osjob.func = FUNC_ADDR(processBeacon);
     os_radio(RADIO_RX);
 }
 
 
 static void startRxPing (xref2osjob_t osjob) {
+    os_jobRxCheck(LMIC.rxtime);
     LMIC.osjob.func = FUNC_ADDR(processPingRx);
     os_radio(RADIO_RX);
 }
 
 
 // Decide what to do next for the MAC layer of a device
+// Engine run ahead of txbeg. LBT has to sense right before the TX and cannot preload the radio.
+#define txLead() (LMIC.lbtMode != LBT_OFF ? TX_RAMPUP : TX_PREP)
+
+static void txStarted (void) {
+    LMIC.txLatency = os_getTime() - LMIC.txGoTime;
+    if( LMIC.txLatency > LMIC.txLatencyMax )
+        LMIC.txLatencyMax = LMIC.txLatency;
+}
+
+// Start the TX preloaded by engineUpdate
+static void txGo (xref2osjob_t osjob) {
+    os_radio(RADIO_TXGO);
+    LMIC.txPreloaded++;
+    txStarted();
+}
+
+// t if it is inside of a TX slot, otherwise the start of the next slot
+static ostime_t nextSlot (ostime_t t) {
+    ostime_t d = (t - LMIC.slotEpoch - LMIC.slotOffset) % LMIC.slotPeriod;
+    if( d < 0 )
+        d += LMIC.slotPeriod;
+    if( d < LMIC.slotWidth )
+        return t;
+    return t + LMIC.slotPeriod - d;
+}
+
 static void engineUpdate (void) {
     // Check for ongoing state: scan or TX/RX transaction
     if( (LMIC.opmode & (OP_SCAN|OP_TXRXPEND|OP_SHUTDOWN)) != 0 ) 
         return;
+    // Class C receiver is restarted on the way out
+    rxcStop();
 
     if( LMIC.devaddr == 0 && (LMIC.opmode & OP_JOINING) == 0 ) {
         LMIC_startJoining();
@@ -1916,6 +2618,10 @@ static void engineUpdate (void) {
         // Delayed TX or waiting for duty cycle?
         if( (LMIC.globalDutyRate != 0 || (LMIC.opmode & OP_RNDTX) != 0)  &&  (txbeg - LMIC.globalDutyAvail) < 0 )
             txbeg = LMIC.globalDutyAvail;
+        // Time slotted uplinks: the first attempt of a frame waits for the next slot
+        // in which the band is available, retransmissions go right away
+        if( LMIC.slotPeriod != 0 && !jacc && LMIC.txCnt == 0 )
+            txbeg = nextSlot(txbeg);
         // If we're tracking a beacon...
         // then make sure TX-RX transaction is complete before beacon
         if( (LMIC.opmode & OP_TRACK) != 0 &&
@@ -1927,9 +2633,16 @@ static void engineUpdate (void) {
             goto checkrx;
         }
         // Earliest possible time vs overhead to setup radio
-        if( txbeg - (now + TX_RAMPUP) < 0 ) {
-            // We could send right now!
-        txbeg = now;
+        if( txbeg - (now + txLead()) < 0 ) {
+            // Build the frame now. If txbeg is still ahead the radio is preloaded
+            // and only the TX start is left for txjob at txbeg.
+            bit_t preload = txbeg - (now + TX_RAMPUP) >= 0;
+            if( !preload )
+                txbeg = now; // We could send right now!
+            if( LMIC.lbtMode != LBT_OFF && !lbtClear() ) {
+                txbeg = LMIC.globalDutyAvail;
+                goto txdelay;
+            }
             dr_t txdr = (dr_t)LMIC.datarate;
             if( jacc ) {
                 u1_t ftype;
@@ -1970,7 +2683,26 @@ static void engineUpdate (void) {
             LMIC.dndr   = txdr;  // carry TX datarate (can be != LMIC.datarate) over to txDone/setupRx1
             LMIC.opmode = (LMIC.opmode & ~(OP_POLL|OP_RNDTX)) | OP_TXRXPEND | OP_NEXTCHNL;
             updateTx(txbeg);
+            if( LMIC.txCnt <= 1 ) // first attempt of an uplink
+                LMIC.txAirtime = 0;
+            LMIC.txAirtime += calcAirTime(LMIC.rps, LMIC.dataLen);
+            LMIC.txDr = txdr;
+            if( !jacc ) {
+                chStatsTx();
+                retryRecord(txbeg, txdr);
+            }
+            LMIC.txGoTime = txbeg;
+            LMIC.radioGap = jacc ? DELAY_JACC1_osticks : DELAY_DNW1_osticks; // until RX1
+            if( preload ) {
+                os_clearCallback(&LMIC.osjob); // only armed by the TX done IRQ
+                os_radio(RADIO_TXPREP);
+                LMIC.txPrepTime = os_getTime() - now;
+                os_setTimedCallback(&LMIC.txjob, txbeg, FUNC_ADDR(txGo));
+                return;
+            }
             os_radio(RADIO_TX);
+            LMIC.txPrepTime = os_getTime() - now;
+            txStarted();
             return;
         }
         // Cannot yet TX
@@ -1981,8 +2713,10 @@ static void engineUpdate (void) {
             txbeg += 1;  // TX delayed by one tick (insignificant amount of time)
     } else {
         // No TX pending - no scheduled RX
-        if( (LMIC.opmode & OP_TRACK) == 0 )
+        if( (LMIC.opmode & OP_TRACK) == 0 ) {
+            rxcStart();
             return;
+        }
     }
 
     // Are we pingable?
@@ -2023,7 +2757,11 @@ static void engineUpdate (void) {
                        e_.eui    = MAIN::CDEV->getEui(),
                        e_.info   = osticks2ms(txbeg-now),
                        e_.info2  = LMIC.seqnoUp-1));
-    os_setTimedCallback(&LMIC.osjob, txbeg-TX_RAMPUP, FUNC_ADDR(runEngineUpdate));
+    if( rxcStart() ) {
+        os_setTimedCallback(&LMIC.rxcjob, txbeg-txLead(), FUNC_ADDR(runEngineUpdate));
+        return;
+    }
+    os_setTimedCallback(&LMIC.osjob, txbeg-txLead(), FUNC_ADDR(runEngineUpdate));
 }
 
 
@@ -2032,6 +2770,21 @@ void LMIC_setAdrMode (bit_t enabled) {
 }
 
 
+void LMIC_setRandomHopping (bit_t enabled) {
+    LMIC.randomHop = enabled;
+}
+
+
+// threshold is only used by LBT_RSSI. After maxDefer consecutive deferrals the frame is sent anyway.
+void LMIC_setLbt (u1_t mode, s1_t threshold, u2_t backoffMs, u1_t maxDefer) {
+    LMIC.lbtMode      = mode;
+    LMIC.lbtThreshold = threshold;
+    LMIC.lbtBackoff   = backoffMs;
+    LMIC.lbtMaxDefer  = maxDefer;
+    LMIC.lbtDeferCnt  = 0;
+}
+
+
 //  Should we have/need an ext. API like this?
 void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
     setDrTxpow(DRCHG_SET, dr, txpow);
@@ -2044,6 +2797,10 @@ void LMIC_shutdownRADIO(){
 
 void LMIC_shutdown (void) {
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.txjob);
+    os_clearCallback(&LMIC.rxcjob);
+    LMIC.rxcOn = 0;
+    LMIC.rxcOffSince = 0;
     os_radio(RADIO_RST);
     LMIC.opmode |= OP_SHUTDOWN;
 }
@@ -2055,6 +2812,8 @@ void LMIC_reset (void) {
                        e_.info   = EV_RESET));
     os_radio(RADIO_RST);
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.txjob);
+    os_clearCallback(&LMIC.rxcjob);
 
     // Do not reset lowPower setting
     bool useLowPowerAntennaOutput = LMIC.useLowPowerAntennaOutput;
@@ -2071,6 +2830,9 @@ void LMIC_reset (void) {
     LMIC.ping.dr      =  DR_PING;   // ditto
     LMIC.ping.intvExp =  0xFF;
     LMIC.useLowPowerAntennaOutput = useLowPowerAntennaOutput;
+    LMIC.rxPpm        =  RX_CLOCK_PPM;
+    LMIC.dnGroup      =  MCAST_NONE;
+    LMIC.retryPol     =  RETRY_DEFAULT;
 #if defined(CFG_us915)
     initDefaultChannels();
 #endif
@@ -2094,7 +2856,9 @@ void LMIC_clrTxData (void) {
     LMIC.pendTxLen = 0;
     if( (LMIC.opmode & (OP_JOINING|OP_SCAN)) != 0 ) // do not interfere with JOINING
         return;
+    rxcStop();
     os_clearCallback(&LMIC.osjob);
+    os_clearCallback(&LMIC.txjob);
     os_radio(RADIO_RST);
     engineUpdate();
 }
@@ -2172,6 +2936,42 @@ void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t
     DO_DEVDB(LMIC.seqnoDn, seqnoDn);
 }
 
+// Keys as for LMIC_setSession(), seqnoDn is the next expected group FCntDown
+bit_t LMIC_setMulticastGroup (u1_t idx, devaddr_t addr, xref2cu1_t nwkKey, xref2cu1_t artKey, u4_t seqnoDn) {
+    if( idx >= LMIC_MCAST_GROUPS || addr == 0 )
+        return 0;
+    mcgroup_t* grp = &LMIC.mcast[idx];
+    os_clearMem((xref2u1_t)grp, SIZEOFEXPR(*grp));
+    aes_expandKey(nwkKey, grp->nwkRk);
+    aes_expandKey(artKey, grp->artRk);
+    grp->seqnoDn = seqnoDn;
+    grp->addr    = addr;
+    return 1;
+}
+
+void LMIC_clearMulticastGroup (u1_t idx) {
+    if( idx < LMIC_MCAST_GROUPS )
+        os_clearMem((xref2u1_t)&LMIC.mcast[idx], SIZEOFEXPR(LMIC.mcast[idx]));
+}
+
+// The answer refers to LMIC.txend of the uplink, see netTimeRef
+void LMIC_requestNetworkTime (void) {
+    LMIC.devTimeReq = 1;
+}
+
+// Uplinks start within width after epoch + offset + n*period, period 0 = off.
+// |now - epoch| has to stay below 2^31 osticks, i.e. the caller moves the epoch along.
+void LMIC_setTxSlots (ostime_t epoch, ostime_t period, ostime_t offset, ostime_t width) {
+    LMIC.slotEpoch  = epoch;
+    LMIC.slotPeriod = period;
+    LMIC.slotOffset = period != 0 ? offset % period : 0;
+    LMIC.slotWidth  = width;
+}
+
+ostime_t LMIC_nextTxSlot (ostime_t t) {
+    return LMIC.slotPeriod != 0 ? nextSlot(t) : t;
+}
+
 // Enable/disable link check validation.
 // LMIC sets the ADRACKREQ bit in UP frames if there were no DN frames
 // for a while. It expects the network to provide a DN message to prove
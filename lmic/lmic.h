@@ -42,6 +42,7 @@
 
 enum { MAX_FRAME_LEN      =  64 };   //!< Library cap on max frame length
 enum { TXCONF_ATTEMPTS    =   5 };   //!< Transmit attempts for confirmed frames
+enum { TXCONF_DR_STEPS    = (1<<2)|(1<<4) }; // attempts going one DR lower (3rd and 5th)
 enum { MAX_MISSED_BCNS    =  20 };   // threshold for triggering rejoin requests
 enum { MAX_RXSYMS         = 100 };   // stop tracking beacon beyond this
 
@@ -50,6 +51,15 @@ enum { LINK_CHECK_CONT    =  12 ,    // continue with this after reported dead l
        LINK_CHECK_INIT    = -12 ,    // UP frame count until we inc datarate
        LINK_CHECK_OFF     =-128 };   // link check disabled
 
+// Device side ADR
+enum { DEVADR_HIST        =   8 };   // link budget samples kept (sliding window)
+enum { DEVADR_MIN_SAMPLES =   3 };   // samples needed before a decision
+enum { DEVADR_GW_TXPOW    =  14 };   // dBm, assumed gateway power to turn downlink SNR into uplink budget
+enum { DEVADR_GW_TXPOW_HI =  27 };   // dBm, the same in the 869.4-869.65 MHz sub-band (EU868 RX2)
+enum { DEVADR_POW_STEP    =   3 };   // dB
+enum { DEVADR_MIN_TXPOW   =   2 };   // dBm
+enum { DEVADR_SILENT_UPS  =   8 };   // uplinks without a sample before backing off
+
 enum { TIME_RESYNC        = 6*128 }; // secs
 enum { TXRX_GUARD_ms      =  6000 };  // msecs - don't start TX-RX transaction before beacon
 enum { JOIN_GUARD_ms      =  9000 };  // msecs - don't start Join Req/Acc transaction before beacon
@@ -71,6 +81,25 @@ struct band_t {
 };
 TYPEDEF_xref2band_t; //!< \internal
 
+// Channel quality tracking
+enum { CHSTATS_MIN_CONF    =    4 };  // confirmed uplinks needed before a channel is judged
+enum { CHSTATS_MAX_CONF    =   32 };  // ACK/NACK counters are halved beyond this (sliding history)
+enum { CHSTATS_MIN_SUCCESS =   50 };  // percent ACKed below which a channel is blocked
+enum { CHSTATS_BLOCK_secs  = 3600 };  // how long a bad channel is left out
+enum { CHSTATS_MIN_ACTIVE  =    3 };  // never hop on fewer channels than this
+
+struct chstats_t {
+    u2_t     txCnt;     // frames sent on this channel
+    u2_t     ackCnt;    // confirmed frames acked
+    u2_t     nackCnt;   // confirmed frames not acked
+    u2_t     rxCnt;     // downlinks received after TX on this channel
+    u2_t     rx1Cnt;    // of these in RX1, they make up the averages below
+    s2_t     rssi;      // average RSSI of RX1 downlinks [dBm]
+    s1_t     snr;       // average SNR of RX1 downlinks [dB*4]
+    ostime_t blockEnd;  // channel is left out until this time (see chBlocked)
+};
+typedef struct chstats_t chstats_t;
+
 #elif defined(CFG_us915)  // US915 spectrum =================================================
 
 enum { MAX_XCHANNELS = 2 };      // extra channels in RAM, channels 0-71 are immutable 
@@ -78,8 +107,34 @@ enum { MAX_TXPOW_125kHz = 30 };
 
 #endif // ==========================================================================
 
+// Retransmissions of confirmed uplinks, see LMIC_setRetryPolicy()
+enum { TXCONF_MAX_ATTEMPTS = 8 };
+enum { RETRY_BACKOFF_FIXED, RETRY_BACKOFF_EXP };
+struct retrypol_t {
+    u1_t     attempts;    // including the first, 1..TXCONF_MAX_ATTEMPTS
+    u1_t     drSteps;     // bit n set: attempt n+1 goes one DR lower than attempt n
+    u1_t     newChnl;     // retry on another channel than the previous attempt, if there is one
+    u1_t     backoffMode; // RETRY_BACKOFF_FIXED or RETRY_BACKOFF_EXP (doubled per retry)
+    ostime_t backoff;     // from the end of the RX windows of a failed attempt
+    ostime_t backoffMax;  // RETRY_BACKOFF_EXP: upper bound, 0 = none
+    ostime_t jitter;      // random 0..jitter added to the backoff
+    ostime_t deadline;    // no retry starts later than this after the first attempt, 0 = none
+};
+typedef struct retrypol_t retrypol_t;
+
+// Outcome of one uplink attempt
+enum { TXATT_NONE, TXATT_RX, TXATT_ACK };
+struct txatt_t {
+    ostime_t txbeg;
+    u1_t     dr;
+    u1_t     chnl;
+    s1_t     txpow;
+    u1_t     result;      // TXATT_NONE: nothing received, TXATT_RX: downlink without ACK
+};
+typedef struct txatt_t txatt_t;
+
 // Keep in sync with evdefs.hpp::drChange
-enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD };
+enum { DRCHG_SET, DRCHG_NOJACC, DRCHG_NOACK, DRCHG_NOADRACK, DRCHG_NWKCMD, DRCHG_DEVADR };
 enum { KEEP_TXPOW = -128 };
 
 
@@ -115,8 +170,26 @@ struct bcninfo_t {
     s4_t     lon;     //!< Lon field of last beacon (valid only if BCN_FULL set)
 };
 
+// Multicast groups, received in ping slots and class C windows
+#if !defined(LMIC_MCAST_GROUPS)
+#define LMIC_MCAST_GROUPS 2
+#endif
+enum { MCAST_NONE = 0xFF };  // lmic_t.dnGroup of a unicast frame
+struct mcgroup_t {
+    devaddr_t addr;      // 0 = unused
+    u4_t      seqnoDn;   // next expected FCntDown
+    u4_t      nwkRk[AES_RKEYS_LEN/4]; // McNwkSKey, expanded
+    u4_t      artRk[AES_RKEYS_LEN/4]; // McAppSKey, expanded
+    u4_t      frames;    // frames accepted
+    u4_t      micErrors; // address matched, MIC did not
+    u4_t      rejected;  // old counter, confirmed, MAC commands or outside ping/class C
+};
+typedef struct mcgroup_t mcgroup_t;
+
 // purpose of receive window - lmic_t.rxState
-enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3 };
+enum { RADIO_RST=0, RADIO_TX=1, RADIO_RX=2, RADIO_RXON=3, RADIO_TXPREP=4, RADIO_TXGO=5 };
+// Listen before talk modes - lmic_t.lbtMode
+enum { LBT_OFF=0, LBT_RSSI=1, LBT_CAD=2 };
 // Netid values /  lmic_t.netid
 enum { NETID_NONE=(int)~0U, NETID_MASK=(int)0xFFFFFF };
 // MAC operation modes (lmic_t.opmode).
@@ -135,6 +208,7 @@ enum { OP_NONE     = 0x0000,
        OP_NEXTCHNL = 0x0800, // find a new channel
        OP_LINKDEAD = 0x1000, // link was reported as dead
        OP_TESTMODE = 0x2000, // developer test mode
+       OP_CLASSC   = 0x4000, // class C: receive on RX2 between TX/RX transactions
 };
 // TX-RX transaction flags - report back to user
 enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
@@ -143,6 +217,7 @@ enum { TXRX_ACK    = 0x80,   // confirmed UP frame was acked
        TXRX_PORT   = 0x10,   // set if a frame with a port was RXed, LMIC.frame[LMIC.dataBeg-1] => port
        TXRX_DNW1   = 0x01,   // received in 1st DN slot
        TXRX_DNW2   = 0x02,   // received in 2dn DN slot
+       TXRX_CLASSC = 0x08,   // received by the class C receiver outside of a transaction
        TXRX_PING   = 0x04 }; // received in a scheduled RX slot
 // Event types for event callback
 enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND,
@@ -242,6 +317,77 @@ struct lmic_t {
 
     //Lobaro Additions
     u1_t		useLowPowerAntennaOutput;
+    ostime_t    txAirtime;    // airtime of the current uplink, summed over all attempts
+    u1_t        txDr;         // datarate of the last TX
+    u1_t        randomHop;    // pick a random eligible channel instead of the next one
+    u1_t        lbtMode;      // listen before talk: LBT_OFF, LBT_RSSI or LBT_CAD
+    s1_t        lbtThreshold; // LBT_RSSI: channel is busy above this RSSI (dBm)
+    u1_t        lbtMaxDefer;  // deferrals of one frame before it is sent regardless
+    u1_t        lbtDeferCnt;  // consecutive deferrals of the pending frame
+    u2_t        lbtBackoff;   // minimum backoff (ms) after a busy channel, up to 1s random is added
+    u4_t        lbtChecks;    // channel assessments done
+    u4_t        lbtDeferred;  // TX deferred due to a busy channel
+    u4_t        lbtForced;    // TX sent on a busy channel after lbtMaxDefer deferrals
+    osjob_t     txjob;        // starts a preloaded TX at txGoTime
+    ostime_t    txGoTime;     // planned RF start of the last TX
+    ostime_t    txPrepTime;   // frame build and radio setup of the last TX
+    ostime_t    txLatency;    // RF start - txGoTime of the last TX (wake-to-RF)
+    ostime_t    txLatencyMax;
+    u4_t        txPreloaded;  // TX started from a preloaded radio
+    ostime_t    radioGap;     // expected idle time after the running TX/RX, 0 = unknown
+    u4_t        radioSleeps;  // power policy decisions after TX/RX
+    u4_t        radioStandbys;
+    u4_t        radioRegWrites; // configuration register writes
+    u4_t        radioRegSkips;  // writes skipped, register already held the value
+    u4_t        irqCaptures;  // TX/RX done timestamps taken from the DIO0 capture
+    ostime_t    irqLatency;   // software timestamp - capture of the last one
+    ostime_t    irqLatencyMax;
+    u4_t        irqLatencySum;
+    u2_t        rxPpm;        // clock error budget of the class A windows
+    u1_t        rxCalCnt;     // downlinks the window calibration is based on (saturates)
+    ostime_t    rxBias;       // calibrated downlink preamble start vs txend + delay
+    ostime_t    rxDev;        // calibrated mean deviation from rxBias
+    ostime_t    rxNominal;    // expected preamble start of the current window
+    u4_t        rxWinUplinks; // uplinks that opened class A windows
+    u4_t        rxOnTotal;    // measured radio RX-on time of single RX windows
+    u4_t        rxModelTotal; // window timeouts set by the sizing model
+    u4_t        rxLegacyTotal; // same with the fixed MINRX_SYMS timeout
+    osjob_t     rxcjob;       // class C: end of RX2 and engine wakeups while the receiver is on
+    u1_t        rxcOn;        // class C receiver running
+    u1_t        rxcExtended;  // end of RX2 deferred for a frame in progress
+    ostime_t    rxcOffSince;  // class C receiver stopped at, 0 = running or class C off
+    u4_t        rxcFrames;    // frames received outside of a transaction
+    u4_t        rxcOffTotal;  // time the class C receiver was off for TX, RX1 and restarts
+    ostime_t    rxcOffMax;
+    mcgroup_t   mcast[LMIC_MCAST_GROUPS];
+    u1_t        dnGroup;      // multicast group of the last received frame, MCAST_NONE = unicast
+    u1_t        devTimeReq;   // DeviceTimeReq: 1 = attach to next uplink, 2 = sent in the current one
+    u1_t        netTimeNew;   // set with each DeviceTimeAns, cleared by the application
+    u4_t        netTimeSec;   // GPS seconds at netTimeRef
+    u1_t        netTimeFrac;  // 1/256 s
+    ostime_t    netTimeRef;   // txend of the uplink the answer refers to
+    ostime_t    slotEpoch;    // time slotted uplinks, see LMIC_setTxSlots()
+    ostime_t    slotPeriod;   // 0 = off
+    ostime_t    slotOffset;
+    ostime_t    slotWidth;
+    u1_t        devAdrMargin; // device ADR: margin (dB) over the demodulation floor to keep, 0 = off
+    u1_t        devAdrHyst;   // extra margin (dB) before stepping to a faster DR / lower power
+    u1_t        devAdrCnt;    // samples in devAdrHist
+    u1_t        devAdrNext;
+    u1_t        devAdrSilent; // uplinks since the last sample
+    s1_t        devAdrHist[DEVADR_HIST]; // uplink SNR (dB) the link would give at 0 dBm
+    u4_t        devAdrUps;    // changes to a faster DR / lower power
+    u4_t        devAdrDowns;  // changes to a slower DR / higher power
+    s1_t        msgTxPow;     // power limit of the current uplink set by the application, 0 = none
+    retrypol_t  retryPol;     // retransmissions of confirmed uplinks
+    txatt_t     txAtt[TXCONF_MAX_ATTEMPTS]; // attempts of the current uplink
+    u1_t        txAttCnt;
+#if defined(CFG_eu868)
+    u2_t        bandChMask[MAX_BANDS]; // defined channels per band
+    u2_t        drChMask[16];          // defined channels per datarate
+    chstats_t   chStats[MAX_CHANNELS];
+    u2_t        chBlocked;             // channels temporarily left out due to bad quality
+#endif
 };
 //! \var struct lmic_t LMIC
 //! The state of LMIC MAC layer is encapsulated in this variable.
@@ -258,6 +404,25 @@ void  LMIC_disableChannel (u1_t channel);
 
 void  LMIC_setDrTxpow   (dr_t dr, s1_t txpow);  // set default/start DR/txpow
 void  LMIC_setAdrMode   (bit_t enabled);        // set ADR mode (if mobile turn off)
+void  LMIC_setRandomHopping (bit_t enabled);    // random instead of round robin channel selection
+void  LMIC_setLbt       (u1_t mode, s1_t threshold, u2_t backoffMs, u1_t maxDefer); // listen before talk (EU868)
+void  LMIC_setClockError (u2_t ppm);           // clock error budget of the RX windows
+void  LMIC_setClassC    (bit_t enabled);        // continuous RX2 between transactions
+void  LMIC_requestNetworkTime (void);           // DeviceTimeReq with the next uplink
+void  LMIC_setTxSlots   (ostime_t epoch, ostime_t period, ostime_t offset, ostime_t width);
+ostime_t LMIC_nextTxSlot (ostime_t t);
+void  LMIC_setDeviceAdr (u1_t marginDb, u1_t hystDb); // rate control from SNR history, marginDb 0 = off
+bit_t LMIC_linkBudget   (s1_t* snrAt0dBm);         // average of the device ADR window, 0 with too few samples
+s1_t  LMIC_demodSnr     (dr_t dr);                 // SNR (dB) needed to demodulate dr
+bit_t LMIC_drUsable     (dr_t dr);                 // dr allowed on an enabled channel
+s1_t  LMIC_maxTxPow     (void);
+u1_t  LMIC_maxFrameLen  (dr_t dr);
+void  LMIC_setRetryPolicy (const retrypol_t* pol); // NULL = TXCONF_ATTEMPTS with the LMIC 1.5 DR steps
+#if defined(CFG_eu868)
+const chstats_t* LMIC_getChannelStats (u1_t channel);
+u2_t  LMIC_getBlockedChannels (void);
+void  LMIC_resetChannelStats (void);
+#endif
 bit_t LMIC_startJoining (void);
 
 void  LMIC_shutdown     (void);
@@ -277,6 +442,8 @@ void  LMIC_setPingable   (u1_t intvExp);
 void  LMIC_tryRejoin     (void);
 
 void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
+bit_t LMIC_setMulticastGroup (u1_t idx, devaddr_t addr, xref2cu1_t nwkKey, xref2cu1_t artKey, u4_t seqnoDn);
+void  LMIC_clearMulticastGroup (u1_t idx);
 void LMIC_setLinkCheckMode (bit_t enabled);
 
 // Special APIs - for development or testing
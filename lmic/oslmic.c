@@ -15,6 +15,10 @@
 static struct {
 	osjob_t* scheduledjobs;
 	osjob_t* runnablejobs;
+#if defined(CFG_jobstats)
+	jobstats_t* curstats; // stats of the timed job currently running
+	jobstats_t stats[JOBSTATS_MAX_FUNCS];
+#endif
 } OS;
 
 void os_init(lmicApi_t lmicApi) {
@@ -93,31 +97,172 @@ osjob_t* os_nextJob() {
 	return NULL;
 }
 
+#if defined(CFG_jobstats)
+static jobstats_t* jobStatsFor(osjobcb_t func) {
+	for (u1_t i = 0; i < JOBSTATS_MAX_FUNCS; i++) {
+		jobstats_t* st = &OS.stats[i];
+		if (st->func == func) {
+			return st;
+		}
+		if (st->func == NULL) {
+			st->func = func;
+			return st;
+		}
+	}
+	return NULL; // table full - not tracked
+}
+
+static void jobStatsRecord(osjob_t* job, ostime_t now) {
+	jobstats_t* st = jobStatsFor(job->func);
+	OS.curstats = st;
+	if (st == NULL) {
+		return;
+	}
+	ostime_t late = now - job->deadline;
+	if (st->count == 0 || late < st->min) {
+		st->min = late;
+	}
+	if (st->count == 0 || late > st->max) {
+		st->max = late;
+	}
+	if (st->count != 0xFFFF) {
+		st->count++;
+	}
+	u1_t b = 0;
+	while (late > 0 && b < JOBSTATS_BUCKETS - 1) {
+		late >>= 1;
+		b++;
+	}
+	if (st->hist[b] != 0xFFFF) {
+		st->hist[b]++;
+	}
+}
+
+const jobstats_t* os_jobStats(u1_t idx) {
+	if (idx >= JOBSTATS_MAX_FUNCS || OS.stats[idx].func == NULL) {
+		return NULL;
+	}
+	return &OS.stats[idx];
+}
+
+void os_jobStatsReset(void) {
+	lmic_hal_disableIRQs();
+	OS.curstats = NULL;
+	memset(OS.stats, 0x00, sizeof(OS.stats));
+	lmic_hal_enableIRQs();
+}
+
+uint os_jobStatsDump(xref2u1_t buf, uint len) {
+	if (len < JOBSTATS_DUMP_HDRLEN) {
+		return 0;
+	}
+	uint pos = JOBSTATS_DUMP_HDRLEN;
+	u1_t n = 0;
+	for (u1_t i = 0; i < JOBSTATS_MAX_FUNCS && OS.stats[i].func != NULL; i++) {
+		if (pos + JOBSTATS_DUMP_ENTRYLEN > len) {
+			break;
+		}
+		const jobstats_t* st = &OS.stats[i];
+		os_wlsbf4(buf + pos, (u4_t) (uintptr_t) st->func);
+		os_wlsbf2(buf + pos + 4, st->count);
+		os_wlsbf2(buf + pos + 6, st->rxLate);
+		os_wlsbf4(buf + pos + 8, (u4_t) st->min);
+		os_wlsbf4(buf + pos + 12, (u4_t) st->max);
+		pos += 16;
+		for (u1_t b = 0; b < JOBSTATS_BUCKETS; b++, pos += 2) {
+			os_wlsbf2(buf + pos, st->hist[b]);
+		}
+		n++;
+	}
+	buf[0] = JOBSTATS_DUMP_VERSION;
+	buf[1] = n;
+	buf[2] = JOBSTATS_BUCKETS;
+	return pos;
+}
+
+void os_jobRxCheck(ostime_t rxtime) {
+	jobstats_t* st = OS.curstats;
+	if (st != NULL && os_getTime() - (rxtime - RX_RAMPUP) > 0 && st->rxLate != 0xFFFF) {
+		st->rxLate++;
+	}
+}
+#endif
+
+// dequeue the next runnable or expired timed job, NULL if nothing is due
+// (the timer is then armed for the next deadline)
+static osjob_t* takeDueJob(void) {
+	osjob_t* j = NULL;
+	lmic_hal_disableIRQs();
+	// check for runnable jobs
+	if (OS.runnablejobs) {
+		j = OS.runnablejobs;
+		OS.runnablejobs = j->next;
+	} else if (OS.scheduledjobs && lmic_hal_checkTimer(OS.scheduledjobs->deadline)) { // check for expired timed jobs
+		j = OS.scheduledjobs;
+		OS.scheduledjobs = j->next;
+#if defined(CFG_jobstats)
+		jobStatsRecord(j, os_getTime());
+#endif
+	}
+	lmic_hal_enableIRQs();
+	return j;
+}
+
+static void runJob(osjob_t* j) {
+	j->func(j);
+#if defined(CFG_jobstats)
+	OS.curstats = NULL;
+#endif
+}
+
+// time until the next job is due (0 if runnable or expired), returns 0 if no job is queued at all
+bit_t os_nextJobDelay(ostime_t* delay) {
+	bit_t pending = 1;
+	lmic_hal_disableIRQs();
+	if (OS.runnablejobs) {
+		*delay = 0;
+	} else if (OS.scheduledjobs) {
+		ostime_t d = OS.scheduledjobs->deadline - os_getTime();
+		*delay = d > 0 ? d : 0;
+	} else {
+		pending = 0;
+	}
+	lmic_hal_enableIRQs();
+	return pending;
+}
+
 // execute jobs from timer and from run queue
 void os_runloop(bit_t loopForever) {
 	while (1) {
-		osjob_t* j = NULL;
-		lmic_hal_disableIRQs();
-
-		// check for runnable jobs
-		if (OS.runnablejobs) {
-			j = OS.runnablejobs;
-			OS.runnablejobs = j->next;
-		} else if (OS.scheduledjobs && lmic_hal_checkTimer(OS.scheduledjobs->deadline)) { // check for expired timed jobs
-			j = OS.scheduledjobs;
-			OS.scheduledjobs = j->next;
+		osjob_t* j = takeDueJob();
+		if (j) { // run job callback
+			runJob(j);
 		} else { // nothing pending
 			lmic_hal_sleep(); // wake by irq (timer already restarted)
 		}
-		lmic_hal_enableIRQs();
 
-		if (j) { // run job callback
-			j->func(j);
+		if (!loopForever) {
+			break;
 		}
+	}
+}
 
-		if (!loopForever) {
+// execute all due jobs, bounded by maxjobs and by maxtime osticks of runtime
+// returns the number of jobs executed
+u1_t os_runloopBatch(u1_t maxjobs, ostime_t maxtime) {
+	ostime_t start = os_getTime();
+	u1_t n = 0;
+	while (n < maxjobs) {
+		osjob_t* j = takeDueJob();
+		if (j == NULL) {
+			break;
+		}
+		runJob(j);
+		n++;
+		if (os_getTime() - start >= maxtime) {
 			break;
 		}
 	}
+	return n;
 }
 
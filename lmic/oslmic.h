@@ -79,6 +79,8 @@ u1_t radio_rand1 (void);
 
 void radio_init (void);
 void radio_irq_handler (u1_t dio);
+bit_t radio_channelFree (u1_t mode, s1_t threshold);
+bit_t radio_rxActive (void);
 void os_init(lmicApi_t lmicApi);
 void os_runloop (bit_t loopForever);
 osjob_t* os_nextJob();
@@ -92,6 +94,10 @@ osjob_t* os_nextJob();
 #ifndef TX_RAMPUP
 #define TX_RAMPUP  (us2osticks(2000))
 #endif
+// Frame build and radio preload ahead of a TX, TX_RAMPUP disables preloading
+#ifndef TX_PREP
+#define TX_PREP    (us2osticks(10000))
+#endif
 
 #ifndef OSTICKS_PER_SEC
 #define OSTICKS_PER_SEC 32768
@@ -126,6 +132,40 @@ struct osjob_t {
 TYPEDEF_xref2osjob_t;
 
 
+#if defined(CFG_jobstats)
+// Dispatch latency statistics of timed jobs (actual start - deadline), kept per job function.
+// Bucket 0 counts jobs started on time (or early), bucket n (n>0) latencies of [2^(n-1), 2^n) osticks,
+// the last bucket everything beyond.
+enum { JOBSTATS_MAX_FUNCS = 16 };
+enum { JOBSTATS_BUCKETS   = 12 };
+enum { JOBSTATS_DUMP_VERSION = 1 };
+enum { JOBSTATS_DUMP_HDRLEN  = 3,
+       JOBSTATS_DUMP_ENTRYLEN = 4+2+2+4+4+2*JOBSTATS_BUCKETS };
+
+typedef struct jobstats_t jobstats_t;
+struct jobstats_t {
+    osjobcb_t func;
+    u2_t      count;     // number of timed dispatches
+    u2_t      rxLate;    // RX jobs that started after rxtime - RX_RAMPUP
+    ostime_t  min;       // min/max of actual start - deadline
+    ostime_t  max;
+    u2_t      hist[JOBSTATS_BUCKETS];
+};
+
+//! Get statistics entry idx (0..JOBSTATS_MAX_FUNCS-1), NULL if unused.
+const jobstats_t* os_jobStats (u1_t idx);
+void os_jobStatsReset (void);
+//! Write compact binary dump (LSBF) into buf, returns number of bytes written.
+//! Format: u1 version, u1 entries, u1 buckets, then per entry
+//! u4 func, u2 count, u2 rxLate, s4 min, s4 max, u2 hist[buckets].
+uint os_jobStatsDump (xref2u1_t buf, uint len);
+//! Called by RX jobs of the MAC to flag windows opened too late.
+void os_jobRxCheck (ostime_t rxtime);
+#else
+#define os_jobRxCheck(rxtime) /**/
+#endif
+
+
 #ifndef HAS_os_calls
 
 #ifndef os_getDevKey
@@ -149,6 +189,12 @@ void os_clearCallback (xref2osjob_t job);
 #ifndef os_getTime
 ostime_t os_getTime (void);
 #endif
+#ifndef os_runloopBatch
+u1_t os_runloopBatch (u1_t maxjobs, ostime_t maxtime);
+#endif
+#ifndef os_nextJobDelay
+bit_t os_nextJobDelay (ostime_t* delay);
+#endif
 #ifndef os_getTimeSecs
 uint os_getTimeSecs (void);
 #endif
@@ -204,13 +250,17 @@ u2_t os_crc16 (xref2u1_t d, uint len);
 #define AES_MIC       0x02
 #define AES_CTR       0x04
 #define AES_MICNOAUX  0x08
+#define AES_RKEYS     0x40 // AESkey already holds round keys from os_aesExpandKey()
 #endif
+#define AES_RKEYS_LEN (11*16) // 1+10 round keys
 #ifndef AESkey  // if AESkey is defined as macro all other values must be too
 extern xref2u1_t AESkey;
 extern xref2u1_t AESaux;
 #endif
 #ifndef os_aes
 u4_t os_aes (u1_t mode, xref2u1_t buf, u2_t len);
+// expand the key in AESkey into AES_RKEYS_LEN bytes of round keys, in place
+void os_aesExpandKey (void);
 #endif
 
 
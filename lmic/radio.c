@@ -251,6 +251,29 @@
 // (initialized by radio_init(), used by radio_rand1())
 static u1_t randbuf[16];
 
+// Shadow of the modem configuration registers. All registers but the FIFO are retained
+// in SLEEP, so rewriting an unchanged value can be skipped. Invalidated on modem change.
+#define REG_SHADOW_SIZE 0x48 // up to RegDioMapping1/2
+static u1_t regShadow[REG_SHADOW_SIZE];
+static u1_t regShadowValid[REG_SHADOW_SIZE/8];
+
+// start of the running single RX, 0 = none
+static ostime_t rxOnStart;
+
+// Radio power policy after TX/RX: stay in STANDBY if the radio is needed again before
+// idling there costs more than waking up from SLEEP (oscillator start) and reprogramming
+// the modem. Break even is in the low ms range, so RX1/RX2 gaps of 1s go to SLEEP.
+#if !defined(RADIO_STANDBY_uA)
+#define RADIO_STANDBY_uA 1400 // SX1272 standby current
+#endif
+#if !defined(RADIO_WAKE_us)
+#define RADIO_WAKE_us    250  // sleep to standby, oscillator startup
+#endif
+#if !defined(RADIO_RECONF_nAs)
+#define RADIO_RECONF_nAs 1500 // MCU and SPI charge of a modem setup
+#endif
+#define RADIO_STANDBY_BREAKEVEN us2osticks(RADIO_WAKE_us + RADIO_RECONF_nAs*1000/RADIO_STANDBY_uA)
+
 
 #ifdef CFG_sx1276_radio
 #define LNA_RX_GAIN (0x20|0x1)
@@ -260,6 +283,28 @@ static u1_t randbuf[16];
 //#error Missing CFG_sx1272_radio/CFG_sx1276_radio
 #endif
 
+// listen before talk: RSSI register offset (dBm) and 125kHz modem config for the RSSI scan
+#ifdef CFG_sx1276_radio
+#define LBT_RSSI_CORR 157 // HF port
+#define LBT_REG_MODEM_CONFIG1 0x72
+#else //CFG_sx1272_radio
+#define LBT_RSSI_CORR 139
+#define LBT_REG_MODEM_CONFIG1 0x0A
+#endif
+
+// ETSI EN 300 220 minimum listen time
+#if !defined(LBT_SCAN_us)
+#define LBT_SCAN_us 5000
+#endif
+// RSSI needs a few hundred us in RX before it is valid
+#if !defined(LBT_SETTLE_us)
+#define LBT_SETTLE_us 500
+#endif
+// upper bound of a CAD, 2 symbols at SF12/125kHz are 66ms
+#if !defined(LBT_CAD_TIMEOUT_ms)
+#define LBT_CAD_TIMEOUT_ms 100
+#endif
+
 
 static void writeReg (u1_t addr, u1_t data ) {
     lmic_hal_pin_nss(0);
@@ -276,6 +321,28 @@ static u1_t readReg (u1_t addr) {
     return val;
 }
 
+// write a configuration register, skipped if the radio already holds the value
+static void writeRegCached (u1_t addr, u1_t data) {
+    ASSERT( addr < REG_SHADOW_SIZE );
+    u1_t bit = 1 << (addr & 7);
+    if( (regShadowValid[addr>>3] & bit) != 0 && regShadow[addr] == data ) {
+        LMIC.radioRegSkips++;
+        return;
+    }
+    writeReg(addr, data);
+    regShadow[addr] = data;
+    regShadowValid[addr>>3] |= bit;
+    LMIC.radioRegWrites++;
+}
+
+static void shadowInvalidate () {
+    os_clearMem(regShadowValid, sizeof(regShadowValid));
+}
+
+static void shadowDrop (u1_t addr) {
+    regShadowValid[addr>>3] &= ~(1 << (addr & 7));
+}
+
 static void writeBuf (u1_t addr, xref2u1_t buf, u1_t len) {
     lmic_hal_pin_nss(0);
     lmic_hal_spi(addr | 0x80);
@@ -296,14 +363,22 @@ static void readBuf (u1_t addr, xref2u1_t buf, u1_t len) {
 
 static void opmode (u1_t mode) {
     writeReg(RegOpMode, (readReg(RegOpMode) & ~OPMODE_MASK) | mode);
+    lmic_hal_radioState(mode == OPMODE_SLEEP ? HAL_RADIO_SLEEP :
+                        mode == OPMODE_TX ? HAL_RADIO_TX :
+                        mode >= OPMODE_RX ? HAL_RADIO_RX : HAL_RADIO_STANDBY, LMIC.txpow);
 }
 
+// select LoRa modem, a radio already in LoRa SLEEP or STANDBY keeps its mode
 static void opmodeLora() {
     u1_t u = OPMODE_LORA;
 #ifdef CFG_sx1276_radio
     u |= 0x8;   // TBD: sx1276 high freq
 #endif
+    if( (readReg(RegOpMode) & ~OPMODE_MASK) == u )
+        return;
+    opmode(OPMODE_SLEEP); // modem can only be changed in SLEEP
     writeReg(RegOpMode, u);
+    shadowInvalidate();
 }
 
 static void opmodeFSK() {
@@ -311,7 +386,9 @@ static void opmodeFSK() {
 #ifdef CFG_sx1276_radio
     u |= 0x8;   // TBD: sx1276 high freq
 #endif
+    opmode(OPMODE_SLEEP); // modem can only be changed in SLEEP
     writeReg(RegOpMode, u);
+    shadowInvalidate();
 }
 
 // configure LoRa modem (cfg1, cfg2)
@@ -339,22 +416,22 @@ static void configLoraModem () {
 
         if (getIh(LMIC.rps)) {
             mc1 |= SX1276_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeRegCached(LORARegPayloadLength, getIh(LMIC.rps)); // required length
         }
         // set ModemConfig1
-        writeReg(LORARegModemConfig1, mc1);
+        writeRegCached(LORARegModemConfig1, mc1);
 
         mc2 = (SX1272_MC2_SF7 + ((sf-1)<<4));
         if (getNocrc(LMIC.rps) == 0) {
             mc2 |= SX1276_MC2_RX_PAYLOAD_CRCON;
         }
-        writeReg(LORARegModemConfig2, mc2);
+        writeRegCached(LORARegModemConfig2, mc2);
         
         mc3 = SX1276_MC3_AGCAUTO;
         if ((sf == SF11 || sf == SF12) && getBw(LMIC.rps) == BW125) {
             mc3 |= SX1276_MC3_LOW_DATA_RATE_OPTIMIZE;
         }
-        writeReg(LORARegModemConfig3, mc3);
+        writeRegCached(LORARegModemConfig3, mc3);
 //#elif CFG_sx1272_radio
 #else
         u1_t mc1 = (getBw(LMIC.rps)<<6);
@@ -376,13 +453,13 @@ static void configLoraModem () {
         
         if (getIh(LMIC.rps)) {
             mc1 |= SX1272_MC1_IMPLICIT_HEADER_MODE_ON;
-            writeReg(LORARegPayloadLength, getIh(LMIC.rps)); // required length
+            writeRegCached(LORARegPayloadLength, getIh(LMIC.rps)); // required length
         }
         // set ModemConfig1
-        writeReg(LORARegModemConfig1, mc1);
+        writeRegCached(LORARegModemConfig1, mc1);
         
         // set ModemConfig2 (sf, AgcAutoOn=1 SymbTimeoutHi=00)
-        writeReg(LORARegModemConfig2, (SX1272_MC2_SF7 + ((sf-1)<<4)) | 0x04);
+        writeRegCached(LORARegModemConfig2, (SX1272_MC2_SF7 + ((sf-1)<<4)) | 0x04);
 //#else
 //#error Missing CFG_sx1272_radio/CFG_sx1276_radio
 #endif /* CFG_sx1272_radio */
@@ -391,9 +468,12 @@ static void configLoraModem () {
 static void configChannel () {
     // set frequency: FQ = (FRF * 32 Mhz) / (2 ^ 19)
     u8_t frf = ((u8_t)LMIC.freq << 19) / 32000000;
-    writeReg(RegFrfMsb, (u1_t)(frf>>16));
-    writeReg(RegFrfMid, (u1_t)(frf>> 8));
-    writeReg(RegFrfLsb, (u1_t)(frf>> 0));
+    u4_t writes = LMIC.radioRegWrites;
+    writeRegCached(RegFrfMsb, (u1_t)(frf>>16));
+    writeRegCached(RegFrfMid, (u1_t)(frf>> 8));
+    if( LMIC.radioRegWrites != writes )
+        shadowDrop(RegFrfLsb); // a new frequency only takes effect with the RegFrfLsb write
+    writeRegCached(RegFrfLsb, (u1_t)(frf>> 0));
 }
 
 
@@ -408,7 +488,7 @@ static void configPower () {
         pw = 2;
     }
     // check board type for BOOST pin
-    writeReg(RegPaConfig, (u1_t)(0x80|(pw&0xf)));
+    writeRegCached(RegPaConfig, (u1_t)(0x80|(pw&0xf)));
     writeReg(RegPaDac, readReg(RegPaDac)|0x4);
 
 #else // CFG_sx1272_radio
@@ -421,9 +501,9 @@ static void configPower () {
     }
     if (LMIC.useLowPowerAntennaOutput) {
     	// Lobaro Addition for LowPoer antenna output
-    	writeReg(RegPaConfig, (u1_t)(0x00|(pw-2)));
+    	writeRegCached(RegPaConfig, (u1_t)(0x00|(pw-2)));
     } else {
-    	writeReg(RegPaConfig, (u1_t)(0x80|(pw-2)));
+    	writeRegCached(RegPaConfig, (u1_t)(0x80|(pw-2)));
     }
 //#else
 //#error Missing CFG_sx1272_radio/CFG_sx1276_radio
@@ -431,9 +511,11 @@ static void configPower () {
 }
 
 static void txfsk () {
-    // select FSK modem (from sleep mode)
+    // select FSK modem (via sleep mode)
+    opmode(OPMODE_SLEEP);
     writeReg(RegOpMode, 0x10); // FSK, BT=0.5
     ASSERT(readReg(RegOpMode) == 0x10);
+    shadowInvalidate();
     // enter standby mode (required for FIFO loading))
     opmode(OPMODE_STANDBY);
     // set bitrate
@@ -468,9 +550,7 @@ static void txfsk () {
 
     // enable antenna switch for TX
     lmic_hal_pin_rxtx(1);
-    
-    // now we actually start the transmission
-    opmode(OPMODE_TX);
+    // radio stays in STANDBY until txgo()
 }
 
 
@@ -490,10 +570,10 @@ static void txlora () {
     writeReg(RegPaRamp, (readReg(RegPaRamp) & 0xF0) | 0x08); // set PA ramp-up time 50 uSec
     configPower();
     // set sync word
-    writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+    writeRegCached(LORARegSyncWord, LORA_MAC_PREAMBLE);
     
     // set the IRQ mapping DIO0=TxDone DIO1=NOP DIO2=NOP
-    writeReg(RegDioMapping1, MAP_DIO0_LORA_TXDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
+    writeRegCached(RegDioMapping1, MAP_DIO0_LORA_TXDONE|MAP_DIO1_LORA_NOP|MAP_DIO2_LORA_NOP);
     // clear all radio IRQ flags
     writeReg(LORARegIrqFlags, 0xFF);
     // mask all IRQs but TxDone
@@ -502,30 +582,40 @@ static void txlora () {
     // initialize the payload size and address pointers    
     writeReg(LORARegFifoTxBaseAddr, 0x00);
     writeReg(LORARegFifoAddrPtr, 0x00);
-    writeReg(LORARegPayloadLength, LMIC.dataLen);
+    writeRegCached(LORARegPayloadLength, LMIC.dataLen);
        
     // download buffer to the radio FIFO
     writeBuf(RegFifo, LMIC.frame, LMIC.dataLen);
 
     // enable antenna switch for TX
     lmic_hal_pin_rxtx(1);
-    
-    // now we actually start the transmission
-    opmode(OPMODE_TX);
+    // radio stays in STANDBY until txgo()
 }
 
-// start transmitter (buf=LMIC.frame, len=LMIC.dataLen)
-static void starttx () {
-    ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
+// load modem, channel and FIFO, radio is left in STANDBY (buf=LMIC.frame, len=LMIC.dataLen)
+static void preptx () {
+    ASSERT( (readReg(RegOpMode) & OPMODE_MASK) <= OPMODE_STANDBY ); // SLEEP or STANDBY
     if(getSf(LMIC.rps) == FSK) { // FSK modem
         txfsk();
     } else { // LoRa modem
         txlora();
     }
+}
+
+// start a transmission loaded by preptx()
+static void txgo () {
+    // now we actually start the transmission
+    opmode(OPMODE_TX);
     // the radio will go back to STANDBY mode as soon as the TX is finished
     // the corresponding IRQ will inform us about completion.
 }
 
+// start transmitter (buf=LMIC.frame, len=LMIC.dataLen)
+static void starttx () {
+    preptx();
+    txgo();
+}
+
 enum { RXMODE_SINGLE, RXMODE_SCAN, RXMODE_RSSI };
 
 static const u1_t rxlorairqmask[] = {
@@ -543,8 +633,8 @@ static void rxlora (u1_t rxmode) {
     opmode(OPMODE_STANDBY);
     // don't use MAC settings at startup
     if(rxmode == RXMODE_RSSI) { // use fixed settings for rssi scan
-        writeReg(LORARegModemConfig1, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG1);
-        writeReg(LORARegModemConfig2, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG2);
+        writeRegCached(LORARegModemConfig1, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG1);
+        writeRegCached(LORARegModemConfig2, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG2);
     } else { // single or continuous rx mode
         // configure LoRa modem (cfg1, cfg2)
         configLoraModem();
@@ -552,20 +642,20 @@ static void rxlora (u1_t rxmode) {
         configChannel();
     }
     // set LNA gain
-    writeReg(RegLna, LNA_RX_GAIN); 
+    writeRegCached(RegLna, LNA_RX_GAIN);
     // set max payload size
-    writeReg(LORARegPayloadMaxLength, 64);
+    writeRegCached(LORARegPayloadMaxLength, 64);
 #if !defined(DISABLE_INVERT_IQ_ON_RX)
     // use inverted I/Q signal (prevent mote-to-mote communication)
     writeReg(LORARegInvertIQ, readReg(LORARegInvertIQ)|(1<<6));
 #endif
     // set symbol timeout (for single rx)
-    writeReg(LORARegSymbTimeoutLsb, LMIC.rxsyms);
+    writeRegCached(LORARegSymbTimeoutLsb, LMIC.rxsyms);
     // set sync word
-    writeReg(LORARegSyncWord, LORA_MAC_PREAMBLE);
+    writeRegCached(LORARegSyncWord, LORA_MAC_PREAMBLE);
     
     // configure DIO mapping DIO0=RxDone DIO1=RxTout DIO2=NOP
-    writeReg(RegDioMapping1, MAP_DIO0_LORA_RXDONE|MAP_DIO1_LORA_RXTOUT|MAP_DIO2_LORA_NOP);
+    writeRegCached(RegDioMapping1, MAP_DIO0_LORA_RXDONE|MAP_DIO1_LORA_RXTOUT|MAP_DIO2_LORA_NOP);
     // clear all radio IRQ flags
     writeReg(LORARegIrqFlags, 0xFF);
     // enable required radio IRQs
@@ -578,6 +668,7 @@ static void rxlora (u1_t rxmode) {
     if (rxmode == RXMODE_SINGLE) { // single rx
         lmic_hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
         opmode(OPMODE_RX_SINGLE);
+        rxOnStart = os_getTime() | 1;
     } else { // continous rx (scan or rssi)
         opmode(OPMODE_RX); 
     }
@@ -632,10 +723,11 @@ static void rxfsk (u1_t rxmode) {
     // now instruct the radio to receive
     lmic_hal_waitUntil(LMIC.rxtime); // busy wait until exact rx time
     opmode(OPMODE_RX); // no single rx mode available in FSK
+    rxOnStart = os_getTime() | 1;
 }
 
 static void startrx (u1_t rxmode) {
-    ASSERT( (readReg(RegOpMode) & OPMODE_MASK) == OPMODE_SLEEP );
+    ASSERT( (readReg(RegOpMode) & OPMODE_MASK) <= OPMODE_STANDBY ); // SLEEP or STANDBY
     if(getSf(LMIC.rps) == FSK) { // FSK modem
         rxfsk(rxmode);
     } else { // LoRa modem
@@ -645,6 +737,58 @@ static void startrx (u1_t rxmode) {
     // or timed out, and the corresponding IRQ will inform us about completion.
 }
 
+// clear channel assessment on LMIC.freq before TX (listen before talk)
+// LBT_RSSI: peak RSSI over LBT_SCAN_us must stay at or below threshold (dBm)
+// LBT_CAD:  LoRa channel activity detection with LMIC.rps (FSK falls back to RSSI)
+// returns 1 if the channel is free, the radio is back in SLEEP afterwards
+bit_t radio_channelFree (u1_t mode, s1_t threshold) {
+    ASSERT( (readReg(RegOpMode) & OPMODE_MASK) <= OPMODE_STANDBY ); // SLEEP or STANDBY
+    opmodeLora();
+    ASSERT((readReg(RegOpMode) & OPMODE_LORA) != 0);
+    opmode(OPMODE_STANDBY);
+    configChannel();
+    writeRegCached(RegLna, LNA_RX_GAIN);
+    // sensing only, the DIO lines stay quiet (CAD flags are not mapped)
+    writeRegCached(RegDioMapping1, MAP_DIO0_LORA_RXDONE|MAP_DIO1_LORA_RXTOUT|MAP_DIO2_LORA_NOP);
+    writeReg(LORARegIrqFlags, 0xFF);
+    lmic_hal_pin_rxtx(0);
+
+    bit_t free = 1;
+    if( mode == LBT_CAD && getSf(LMIC.rps) != FSK ) {
+        configLoraModem();
+        writeRegCached(LORARegSyncWord, LORA_MAC_PREAMBLE);
+        writeReg(LORARegIrqFlagsMask, ~(IRQ_LORA_CDDONE_MASK|IRQ_LORA_CDDETD_MASK));
+        opmode(OPMODE_CAD);
+        ostime_t timeout = os_getTime() + ms2osticks(LBT_CAD_TIMEOUT_ms);
+        while( (readReg(LORARegIrqFlags) & IRQ_LORA_CDDONE_MASK) == 0 && os_getTime() - timeout < 0 );
+        free = (readReg(LORARegIrqFlags) & IRQ_LORA_CDDETD_MASK) == 0;
+    } else {
+        writeRegCached(LORARegModemConfig1, LBT_REG_MODEM_CONFIG1);
+        writeRegCached(LORARegModemConfig2, RXLORA_RXMODE_RSSI_REG_MODEM_CONFIG2);
+        writeReg(LORARegIrqFlagsMask, 0xFF);
+        opmode(OPMODE_RX);
+        lmic_hal_waitUntil(os_getTime() + us2osticks(LBT_SETTLE_us));
+        ostime_t end = os_getTime() + us2osticks(LBT_SCAN_us);
+        do {
+            if( (s2_t)readReg(LORARegRssiValue) - LBT_RSSI_CORR > threshold ) {
+                free = 0;
+                break;
+            }
+        } while( os_getTime() - end < 0 );
+    }
+    writeReg(LORARegIrqFlags, 0xFF);
+    opmode(OPMODE_SLEEP);
+    return free;
+}
+
+// continuous LoRa RX is synchronized to a frame (preamble locked or header valid)
+bit_t radio_rxActive () {
+    lmic_hal_disableIRQs();
+    bit_t active = (readReg(LORARegModemStat) & 0x0A) != 0; // signal synchronized, header info valid
+    lmic_hal_enableIRQs();
+    return active;
+}
+
 // get random seed from wideband noise rssi
 void radio_init () {
     lmic_hal_disableIRQs();
@@ -660,6 +804,7 @@ void radio_init () {
     lmic_hal_waitUntil(os_getTime()+ms2osticks(5)); // wait 5ms
 
     opmode(OPMODE_SLEEP);
+    shadowInvalidate(); // registers are back to their reset values
 
     // some sanity checks, e.g., read version number
     u1_t v = readReg(RegVersion);
@@ -704,6 +849,7 @@ void radio_init () {
 #endif /* CFG_sx1276mb1_board */
 
     opmode(OPMODE_SLEEP);
+    shadowInvalidate(); // PaConfig and Frf were written directly
 
     lmic_hal_enableIRQs();
 }
@@ -739,15 +885,51 @@ static const u2_t LORA_RXDONE_FIXUP[] = {
     [SF12] = us2osticks(31189), // (1022 ticks)
 };
 
+// power state after TX/RX, next: a TX done or RX timeout that another TX/RX follows
+// LMIC.radioGap is the expected time until the radio is used again, 0 = unknown
+static void radioIdle (bit_t next) {
+    if( next && LMIC.radioGap != 0 && LMIC.radioGap < RADIO_STANDBY_BREAKEVEN ) {
+        opmode(OPMODE_STANDBY);
+        LMIC.radioStandbys++;
+    } else {
+        opmode(OPMODE_SLEEP);
+        LMIC.radioSleeps++;
+    }
+    LMIC.radioGap = 0;
+}
+
+// captures older than this are left over from an edge that was not handled
+#if !defined(IRQ_CAPTURE_MAX_ms)
+#define IRQ_CAPTURE_MAX_ms 100
+#endif
+
+// time of the DIO edge: the HAL capture if there is one, else the software timestamp now
+static ostime_t irqTime (u1_t dio, ostime_t now) {
+    uint32_t cap;
+    if( dio != 0 || !lmic_hal_dio0Capture(&cap) )
+        return now;
+    ostime_t latency = now - (ostime_t)cap;
+    if( latency < 0 || latency > ms2osticks(IRQ_CAPTURE_MAX_ms) )
+        return now;
+    LMIC.irqCaptures++;
+    LMIC.irqLatency = latency;
+    LMIC.irqLatencySum += latency;
+    if( latency > LMIC.irqLatencyMax )
+        LMIC.irqLatencyMax = latency;
+    return cap;
+}
+
 // called by hal ext IRQ handler
 // (radio goes to stanby mode after tx/rx operations)
 void radio_irq_handler (u1_t dio) {
-    ostime_t now = os_getTime();
+    ostime_t now = irqTime(dio, os_getTime());
+    bit_t next = 0; // another TX/RX is about to follow
     if( (readReg(RegOpMode) & OPMODE_LORA) != 0) { // LORA modem
         u1_t flags = readReg(LORARegIrqFlags);
         if( flags & IRQ_LORA_TXDONE_MASK ) {
             // save exact tx time
             LMIC.txend = now - us2osticks(43); // TXDONE FIXUP
+            next = 1;
         } else if( flags & IRQ_LORA_RXDONE_MASK ) {
             // save exact rx time
             if(getBw(LMIC.rps) == BW125) {
@@ -767,6 +949,7 @@ void radio_irq_handler (u1_t dio) {
         } else if( flags & IRQ_LORA_RXTOUT_MASK ) {
             // indicate timeout
             LMIC.dataLen = 0;
+            next = 1;
         }
         // mask all radio IRQs
         writeReg(LORARegIrqFlagsMask, 0xFF);
@@ -778,6 +961,7 @@ void radio_irq_handler (u1_t dio) {
         if( flags2 & IRQ_FSK2_PACKETSENT_MASK ) {
             // save exact tx time
             LMIC.txend = now;
+            next = 1;
         } else if( flags2 & IRQ_FSK2_PAYLOADREADY_MASK ) {
             // save exact rx time
             LMIC.rxtime = now;
@@ -791,12 +975,17 @@ void radio_irq_handler (u1_t dio) {
         } else if( flags1 & IRQ_FSK1_TIMEOUT_MASK ) {
             // indicate timeout
             LMIC.dataLen = 0;
+            next = 1;
         } else {
             ASSERT(0); // Lobaro: Was while(1);
         }
     }
-    // go from stanby to sleep
-    opmode(OPMODE_SLEEP);
+    if( rxOnStart != 0 ) {
+        LMIC.rxOnTotal += now - rxOnStart;
+        rxOnStart = 0;
+    }
+    // go from stanby to sleep, unless the next TX/RX follows too soon
+    radioIdle(next);
     // run os job (use preset func ptr)
     os_setCallback(&LMIC.osjob, LMIC.osjob.func);
 }
@@ -807,12 +996,23 @@ void os_radio (u1_t mode) {
       case RADIO_RST:
         // put radio to sleep
         opmode(OPMODE_SLEEP);
+        rxOnStart = 0;
         break;
 
       case RADIO_TX:
         // transmit frame now
         starttx(); // buf=LMIC.frame, len=LMIC.dataLen
         break;
+
+      case RADIO_TXPREP:
+        // load frame and settings, TX is started later by RADIO_TXGO
+        preptx(); // buf=LMIC.frame, len=LMIC.dataLen
+        break;
+
+      case RADIO_TXGO:
+        // transmit prepared frame now
+        txgo();
+        break;
       
       case RADIO_RX:
         // receive frame now (exactly at rxtime)
@@ -0,0 +1,183 @@
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+#include <string.h>
+
+// Channel plan presets and validation, applied by the LMIC task
+
+#define CH(f, b) { .freq = (f), .drMin = DR_SF12, .drMax = DR_SF7, .band = (b) }
+
+// LMIC keeps the duty cycle per band, so each ETSI sub band used gets a band of its own.
+// AUX carries 865 - 868 MHz (h1.4), the 1% of 868.0 - 868.6 MHz (h1.5) stays in CENTI.
+#define BAND_865 BAND_AUX
+
+#define EU868_BANDS { \
+	[BAND_MILLI] = { .txPow = 14, .txCap = 1000 }, /* 0.1%, 868.7 - 869.2 MHz */ \
+	[BAND_CENTI] = { .txPow = 14, .txCap = 100 }, /* 1%, 868.0 - 868.6 MHz */ \
+	[BAND_DECI] = { .txPow = 27, .txCap = 10 }, /* 10%, 869.4 - 869.65 MHz */ \
+	[BAND_865] = { .txPow = 14, .txCap = 100 }, /* 1%, 865 - 868 MHz */ \
+}
+
+// Mandatory LoRaWAN default channels only
+const lmicChannelPlan_t LMIC_PLAN_EU868_3CH = {
+	.numChannels = 3,
+	.channels = {
+		CH(868100000, BAND_CENTI),
+		CH(868300000, BAND_CENTI),
+		CH(868500000, BAND_CENTI),
+	},
+	.bands = EU868_BANDS,
+	.enabledMask = 0x0007,
+};
+
+// Default channels plus the common 867.1 - 867.9 MHz network channels
+const lmicChannelPlan_t LMIC_PLAN_EU868_8CH = {
+	.numChannels = 8,
+	.channels = {
+		CH(868100000, BAND_CENTI),
+		CH(868300000, BAND_CENTI),
+		CH(868500000, BAND_CENTI),
+		CH(867100000, BAND_865),
+		CH(867300000, BAND_865),
+		CH(867500000, BAND_865),
+		CH(867700000, BAND_865),
+		CH(867900000, BAND_865),
+	},
+	.bands = EU868_BANDS,
+	.enabledMask = 0x00FF,
+};
+
+// 8 channel plan extended into the 865 - 866.5 MHz and 0.1% sub bands
+const lmicChannelPlan_t LMIC_PLAN_EU868_16CH = {
+	.numChannels = 16,
+	.channels = {
+		CH(868100000, BAND_CENTI),
+		CH(868300000, BAND_CENTI),
+		CH(868500000, BAND_CENTI),
+		CH(867100000, BAND_865),
+		CH(867300000, BAND_865),
+		CH(867500000, BAND_865),
+		CH(867700000, BAND_865),
+		CH(867900000, BAND_865),
+		CH(866100000, BAND_865),
+		CH(866300000, BAND_865),
+		CH(866500000, BAND_865),
+		CH(865100000, BAND_865),
+		CH(865300000, BAND_865),
+		CH(865500000, BAND_865),
+		CH(868850000, BAND_MILLI),
+		CH(869050000, BAND_MILLI),
+	},
+	.bands = EU868_BANDS,
+	.enabledMask = 0xFFFF,
+};
+
+// ETSI EN 300 220 sub bands (ERC Rec 70-03 annex 1), each has its own duty cycle budget
+static const struct {
+	uint32_t from; // Hz
+	uint32_t to; // Hz, exclusive
+	uint16_t minCap;
+	int8_t maxPow;
+} subBands[] = {
+	{ 863000000, 865000000, 1000, 14 }, // h1.3, 0.1%
+	{ 865000000, 868000000, 100, 14 }, // h1.4, 1%
+	{ 868000000, 868600000, 100, 14 }, // h1.5 (g1), 1%
+	{ 868700000, 869200000, 1000, 14 }, // h1.6 (g2), 0.1%
+	{ 869400000, 869650000, 10, 27 }, // h1.7 (g3), 10%
+	{ 869700000, 870000000, 100, 14 }, // h1.8, 1%
+};
+#define SUB_BANDS (sizeof(subBands) / sizeof(subBands[0]))
+#define SUB_BAND_OTHER SUB_BANDS // the gaps in between, 0.1%
+
+// Regional limits of the sub band containing freq
+static bool regionalLimits(uint32_t freq, uint8_t* sub, uint16_t* minCap, int8_t* maxPow) {
+	if (freq < EU868_FREQ_MIN || freq > EU868_FREQ_MAX) {
+		return false;
+	}
+	for (uint8_t i = 0; i < SUB_BANDS; i++) {
+		if (freq >= subBands[i].from && freq < subBands[i].to) {
+			*sub = i;
+			*minCap = subBands[i].minCap;
+			*maxPow = subBands[i].maxPow;
+			return true;
+		}
+	}
+	*sub = SUB_BAND_OTHER;
+	*minCap = 1000;
+	*maxPow = 14;
+	return true;
+}
+
+lmicPlanError_t drv_lmic_validateChannelPlan(const lmicChannelPlan_t* plan) {
+	if (plan->numChannels == 0 || plan->numChannels > LMIC_PLAN_MAX_CHANNELS) {
+		return LMIC_PLAN_ERR_CHANNEL_COUNT;
+	}
+	if ((plan->enabledMask & ((1u << plan->numChannels) - 1)) == 0) {
+		return LMIC_PLAN_ERR_NO_CHANNEL;
+	}
+	uint8_t bandOfSub[SUB_BANDS + 1]; // LMIC band holding the budget of each sub band
+	memset(bandOfSub, 0xFF, sizeof(bandOfSub));
+
+	for (uint8_t ch = 0; ch < plan->numChannels; ch++) {
+		const lmicChannelDef_t* c = &plan->channels[ch];
+		if (!(plan->enabledMask & (1 << ch))) {
+			continue;
+		}
+		uint8_t sub;
+		uint16_t minCap;
+		int8_t maxPow;
+		if (!regionalLimits(c->freq, &sub, &minCap, &maxPow)) {
+			return LMIC_PLAN_ERR_FREQUENCY;
+		}
+		if (c->drMin > c->drMax || c->drMax > DR_FSK) {
+			return LMIC_PLAN_ERR_DATARATE;
+		}
+		if (c->band >= LMIC_PLAN_MAX_BANDS) {
+			return LMIC_PLAN_ERR_BAND;
+		}
+#if LORA_RF_DUTY_TESTMODE != 1
+		const lmicBandDef_t* b = &plan->bands[c->band];
+		if (b->txCap < minCap) {
+			return LMIC_PLAN_ERR_DUTY_CYCLE;
+		}
+		if (b->txPow > maxPow) {
+			return LMIC_PLAN_ERR_TXPOWER;
+		}
+		// Two LMIC bands would spend the budget of one sub band twice
+		if (bandOfSub[sub] != 0xFF && bandOfSub[sub] != c->band) {
+			return LMIC_PLAN_ERR_SUB_BAND;
+		}
+		bandOfSub[sub] = c->band;
+#endif
+	}
+	return LMIC_PLAN_OK;
+}
+
+// Must run in the LMIC task. With keepDuty the duty cycle state of the bands survives the change.
+void lmic_applyChannelPlan(const lmicChannelPlan_t* plan, bool keepDuty) {
+	for (u1_t b = 0; b < LMIC_PLAN_MAX_BANDS; b++) {
+		if (plan->bands[b].txCap == 0) {
+			continue;
+		}
+		ostime_t avail = LMIC.bands[b].avail;
+		LMIC_setupBand(b, plan->bands[b].txPow, plan->bands[b].txCap);
+		if (keepDuty) {
+			LMIC.bands[b].avail = avail;
+		}
+	}
+#if LORA_RF_DUTY_TESTMODE == 1
+	LMIC_setupBand(BAND_AUX, 14, 1);
+#endif
+
+	for (u1_t ch = 0; ch < MAX_CHANNELS; ch++) {
+		const lmicChannelDef_t* c = &plan->channels[ch];
+		if (ch < plan->numChannels && c->freq != 0 && (plan->enabledMask & (1 << ch))) {
+			s1_t band = c->band;
+#if LORA_RF_DUTY_TESTMODE == 1
+			band = BAND_AUX;
+#endif
+			LMIC_setupChannel(ch, c->freq, DR_RANGE_MAP(c->drMin, c->drMax), band);
+		} else {
+			LMIC_disableChannel(ch);
+		}
+	}
+}
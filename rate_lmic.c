@@ -0,0 +1,95 @@
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+
+// Per uplink DR and TX power, see lmicDrPolicy_t
+
+// MHDR, FHDR without FOpts, FPort and MIC on top of the payload
+#define FRAME_OVERHEAD 13
+
+static ostime_t airtime(dr_t dr, uint8_t len) {
+	return calcAirTime(updr2rps(dr), len + FRAME_OVERHEAD);
+}
+
+uint32_t lmic_rateAirtimeMs(uint8_t dr, uint8_t len) {
+	return osticks2ms(airtime(dr, len));
+}
+
+static bool fits(dr_t dr, uint8_t len, ostime_t maxAirtime) {
+	if (!LMIC_drUsable(dr) || len + FRAME_OVERHEAD > LMIC_maxFrameLen(dr)) {
+		return false;
+	}
+	return maxAirtime == 0 || airtime(dr, len) <= maxAirtime;
+}
+
+bool lmic_ratePick(lmicDrPolicy_t policy, uint8_t len, uint32_t maxAirtimeMs, uint8_t* pdr, int8_t* ppow) {
+	ostime_t maxAirtime = ms2osticks(maxAirtimeMs);
+	dr_t fastest = DR_SF7;
+	s1_t maxPow = LMIC_maxTxPow();
+	if (LMIC.adrEnabled) {
+		// The network sets the fastest DR and the highest power
+		fastest = (dr_t) LMIC.datarate;
+		if (LMIC.adrTxPow < maxPow) {
+			maxPow = LMIC.adrTxPow;
+		}
+	}
+	s1_t margin = LMIC.devAdrMargin ? LMIC.devAdrMargin : LMIC_RATE_DEFAULT_MARGIN_DB;
+	s1_t link;
+	bool known = LMIC_linkBudget(&link);
+	if (!known && (dr_t) LMIC.datarate < fastest) {
+		fastest = (dr_t) LMIC.datarate;
+	}
+
+	bool fit = false; // any DR fits
+	bool reach = false; // any DR keeps the margin at maxPow
+	dr_t reachDr = fastest; // fastest that keeps the margin
+	dr_t slowestDr = fastest;
+	dr_t energyDr = fastest;
+	s1_t energyPow = maxPow;
+	uint64_t energyCost = UINT64_MAX;
+	for (dr_t dr = fastest;; dr = decDR(dr)) {
+		if (fits(dr, len, maxAirtime)) {
+			fit = true;
+			slowestDr = dr;
+			if (!reach && (!known || link + maxPow - LMIC_demodSnr(dr) >= margin)) {
+				reach = true;
+				reachDr = dr;
+			}
+			if (policy == LMIC_DR_MIN_ENERGY && known) {
+				for (s1_t pow = maxPow; pow >= DEVADR_MIN_TXPOW && link + pow - LMIC_demodSnr(dr) >= margin; pow -= DEVADR_POW_STEP) {
+					uint64_t cost = (uint64_t) lmic_energyTxUa(pow) * (uint32_t) airtime(dr, len);
+					if (cost < energyCost) {
+						energyCost = cost;
+						energyDr = dr;
+						energyPow = pow;
+					}
+				}
+			}
+		}
+		if (decDR(dr) == dr) {
+			break;
+		}
+	}
+	if (!fit) {
+		return false;
+	}
+
+	*ppow = maxPow;
+	switch (policy) {
+	case LMIC_DR_MIN_ENERGY:
+		if (energyCost != UINT64_MAX) {
+			*pdr = energyDr;
+			*ppow = energyPow;
+			break;
+		}
+		// Without link data only the airtime is known
+		/* no break */
+	case LMIC_DR_MIN_AIRTIME:
+		// Nothing keeps the margin, the slowest DR is the best try
+		*pdr = reach ? reachDr : slowestDr;
+		break;
+	default: // LMIC_DR_MAX_RELIABILITY
+		*pdr = slowestDr;
+		break;
+	}
+	return true;
+}
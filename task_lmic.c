@@ -2,6 +2,8 @@
 #include "lmic/lmic.h"
 #include "github.com/Lobaro/c-utils/logging.h"
 #include "github.com/Lobaro/c-utils/parse.h"
+#include "event_groups.h"
+#include "trace_lmic.h"
 #include <stdbool.h>
 
 #define NOTIFY_SX_IRQ_0 (1 << 0)
@@ -11,9 +13,24 @@
 #define NOTIFY_SEND (1 << 4)
 #define NOTIFY_SLEEP (1 << 5)
 #define NOTIFY_WAKE (1 << 6)
+#define NOTIFY_EVENT (1 << 7)
+#define NOTIFY_CHANNEL_PLAN (1 << 8)
+#define NOTIFY_CLASS_C (1 << 9)
+#define NOTIFY_MCAST (1 << 10)
+#define NOTIFY_TIME (1 << 11)
+#define NOTIFY_SLOTS (1 << 12)
+
+// Power state event bits, set by the LMIC task once a transition is done
+#define POWER_EV_RUNNING (1 << 0)
+#define POWER_EV_SLEEPING (1 << 1)
+
+// Max time the LMIC task may take to acknowledge a power transition
+#define POWER_TRANSITION_TIMEOUT_MS 5000
 
 static TaskHandle_t Handle = NULL;
-static SemaphoreHandle_t LmicRunningSemaphore = NULL; // Is the task, systick and scheduler running?
+static EventGroupHandle_t LmicPowerEvents = NULL; // Is the task, systick and scheduler running?
+static volatile lmicPowerState_t powerState = LMIC_POWER_RUNNING;
+static lmicPowerStats_t powerStats;
 static SemaphoreHandle_t LmicBusySemaphore = NULL; // Is the lmic scheduler busy?
 static SemaphoreHandle_t LmicSendingSemaphore = NULL;
 
@@ -22,10 +39,121 @@ typedef struct {
 	uint8_t data[MAX_LEN_FRAME];
 	size_t len;
 	bool confirmed;
+	lmicTxHandle_t handle;
+	lmicTxCallback_t callback;
+	void* ctx;
+	TaskHandle_t notifyTask;
+	uint32_t notifyBits;
+	lmicDrPolicy_t policy;
+	uint32_t maxAirtimeMs;
+	lmicRetryPolicy_t retry;
 } SendEvent_t;
 
+// Completion target of the uplink currently handed to LMIC
+typedef struct {
+	bool active;
+	lmicTxHandle_t handle;
+	lmicTxCallback_t callback;
+	void* ctx;
+	TaskHandle_t notifyTask;
+	uint32_t notifyBits;
+	uint32_t expectedAirtimeMs;
+	bool rateSet; // DR changed for this uplink, see applyTxRate()
+	uint8_t rateDr;
+	uint8_t prevDr;
+} TxInflight_t;
+
+typedef struct {
+	bool used;
+	uint8_t portFrom;
+	uint8_t portTo;
+	lmicDownlinkHandler_t handler;
+	void* ctx;
+	QueueHandle_t queue;
+	ostime_t budget;
+	lmicDownlinkStats_t stats;
+} DownlinkHandler_t;
+
+#ifndef LMIC_DOWNLINK_MAX_HANDLERS
+#define LMIC_DOWNLINK_MAX_HANDLERS 8
+#endif
+
+#ifndef LMIC_EVENT_RING_SIZE
+#define LMIC_EVENT_RING_SIZE 16
+#endif
+#ifndef LMIC_EVENT_MAX_SUBSCRIBERS
+#define LMIC_EVENT_MAX_SUBSCRIBERS 4
+#endif
+
+typedef struct {
+	lmicEventSubscriber_t subscriber;
+	void* ctx;
+} EventSubscriber_t;
+
+// Number of completed sends that can still be queried by handle
+#define TX_RESULT_HISTORY 4
+
+// Upper bound of jobs / runtime per task wakeup before notifications are served again
+#ifndef LMIC_BATCH_MAX_JOBS
+#define LMIC_BATCH_MAX_JOBS 16
+#endif
+#ifndef LMIC_BATCH_MAX_MS
+#define LMIC_BATCH_MAX_MS 20
+#endif
+// Longest task sleep while a job is queued, in case its TIM9 compare is not armed
+#ifndef LMIC_BACKSTOP_MAX_MS
+#define LMIC_BACKSTOP_MAX_MS 60000
+#endif
+
+// Wakeup interval without jobs while time slots are on, see idleMaxSec()
+#define SLOT_IDLE_MAX_SEC 3600
+
 static QueueHandle_t SendQueue = NULL;
 static lmicCfg_t cfg;
+static lmicChannelPlan_t channelPlan;
+static volatile bool channelPlanPending = false;
+static volatile bool classCPending = false;
+static lmicMcastGroupDef_t mcastGroups[LMIC_MCAST_GROUPS];
+static volatile uint32_t mcastPending = 0; // groups to (re)apply, bit n = group n
+static volatile bool timeReqPending = false;
+static volatile bool slotsPending = false;
+static lmicSlotInfo_t slotInfo;
+static ostime_t slotLocalEpoch = 0;
+static bool started = false;
+static lmicTaskStats_t taskStats;
+static lmicTxHandle_t lastTxHandle = 0;
+static TxInflight_t txInflight;
+
+// Mirrors RETRY_DEFAULT of lmic.c, which applyRetryPolicy() uses for attempts = 0
+const lmicRetryPolicy_t LMIC_RETRY_DEFAULT = {
+	.attempts = TXCONF_ATTEMPTS,
+	.drStepMask = TXCONF_DR_STEPS,
+	.backoff = LMIC_BACKOFF_FIXED,
+	.jitterMs = RETRY_PERIOD_secs * 1000,
+};
+
+const lmicRetryPolicy_t LMIC_RETRY_ALARM = {
+	.attempts = LMIC_RETRY_MAX_ATTEMPTS,
+	.newChannel = true,
+	.backoff = LMIC_BACKOFF_EXPONENTIAL,
+	.backoffMs = 500,
+	.backoffMaxMs = 8000,
+	.jitterMs = 1000,
+	.deadlineMs = 60000,
+};
+static struct {
+	lmicTxHandle_t handle;
+	lmicTxResult_t result;
+} txResults[TX_RESULT_HISTORY];
+static uint8_t txResultsNext = 0;
+static DownlinkHandler_t downlinkHandlers[LMIC_DOWNLINK_MAX_HANDLERS];
+static EventSubscriber_t eventSubscribers[LMIC_EVENT_MAX_SUBSCRIBERS];
+static struct {
+	lmicEvent_t events[LMIC_EVENT_RING_SIZE];
+	uint8_t head; // next to write
+	uint8_t count;
+	uint32_t dropped;
+} eventRing;
 
 void drv_lmic_setOTAA(bool otaa) {
 	cfg.otaa = otaa;
@@ -78,6 +206,158 @@ void drv_lmic_setAppSessionKey(uint8_t* appSessionKey) {
 	}
 }
 
+void drv_lmic_setClassC(bool classC) {
+	cfg.classC = classC;
+	if (started) {
+		classCPending = true;
+		xTaskNotify(Handle, NOTIFY_CLASS_C, eSetBits);
+	}
+}
+
+bool drv_lmic_setMulticastGroup(uint8_t idx, const lmicMcastGroupDef_t* group) {
+	if (idx >= LMIC_MCAST_GROUPS || (group != NULL && group->addr == 0)) {
+		return false;
+	}
+	taskENTER_CRITICAL();
+	if (group != NULL) {
+		mcastGroups[idx] = *group;
+	} else {
+		mcastGroups[idx].addr = 0;
+	}
+	if (started) {
+		mcastPending |= 1u << idx;
+	}
+	taskEXIT_CRITICAL();
+
+	if (started) {
+		xTaskNotify(Handle, NOTIFY_MCAST, eSetBits);
+	}
+	return true;
+}
+
+bool drv_lmic_getMulticastStats(uint8_t idx, lmicMcastStats_t* stats) {
+	if (idx >= LMIC_MCAST_GROUPS) {
+		return false;
+	}
+	taskENTER_CRITICAL();
+	const mcgroup_t* grp = &LMIC.mcast[idx];
+	bool used = grp->addr != 0;
+	stats->frames = grp->frames;
+	stats->micErrors = grp->micErrors;
+	stats->rejected = grp->rejected;
+	stats->fcntDown = grp->seqnoDn;
+	taskEXIT_CRITICAL();
+	return used;
+}
+
+// Must run in the LMIC task between jobs, so nextTx() never sees a half updated plan
+static void applyChannelPlan() {
+	static lmicChannelPlan_t plan;
+	taskENTER_CRITICAL();
+	plan = channelPlan;
+	channelPlanPending = false;
+	taskEXIT_CRITICAL();
+	lmic_applyChannelPlan(&plan, true);
+	TRACE_INFO(TRACE_CHANNEL_PLAN, plan.numChannels, plan.enabledMask, 0);
+}
+
+// Must run in the LMIC task, the key expansion uses the shared AES buffer
+static void applyMcastGroups(uint32_t mask) {
+	for (uint8_t i = 0; i < LMIC_MCAST_GROUPS; i++) {
+		if (!(mask & (1u << i))) {
+			continue;
+		}
+		static lmicMcastGroupDef_t group;
+		taskENTER_CRITICAL();
+		group = mcastGroups[i];
+		taskEXIT_CRITICAL();
+		if (group.addr != 0) {
+			LMIC_setMulticastGroup(i, group.addr, group.nwkSKey, group.appSKey, group.fcntDown);
+		} else {
+			LMIC_clearMulticastGroup(i);
+		}
+	}
+}
+
+void drv_lmic_requestNetworkTime() {
+	// Kept until the task runs, a request before drv_lmic_start() goes with the first uplink
+	timeReqPending = true;
+	if (started) {
+		xTaskNotify(Handle, NOTIFY_TIME, eSetBits);
+	}
+}
+
+void drv_lmic_setTxSlots(const lmicSlotCfg_t* slots) {
+	configASSERT(slots->periodSec <= LMIC_SLOT_MAX_PERIOD_SEC);
+	taskENTER_CRITICAL();
+	cfg.slots = *slots;
+	slotsPending = started;
+	taskEXIT_CRITICAL();
+	if (started) {
+		xTaskNotify(Handle, NOTIFY_SLOTS, eSetBits);
+	}
+}
+
+void drv_lmic_getTxSlot(lmicSlotInfo_t* info) {
+	taskENTER_CRITICAL();
+	*info = slotInfo;
+	ostime_t now = os_getTime();
+	info->nextMs = LMIC.slotPeriod != 0 ? osticks2ms(LMIC_nextTxSlot(now) - now) : 0;
+	taskEXIT_CRITICAL();
+}
+
+// Keeps the slot epoch within one period of now, on network time once it is known
+static void updateTxSlots() {
+	if (LMIC.slotPeriod == 0) {
+		return;
+	}
+	ostime_t now = os_getTime();
+	ostime_t epoch;
+	slotInfo.synced = lmic_timeEpoch(LMIC.slotPeriod, &epoch);
+	if (!slotInfo.synced) {
+		slotLocalEpoch += (now - slotLocalEpoch) / LMIC.slotPeriod * LMIC.slotPeriod;
+		epoch = slotLocalEpoch;
+	}
+	LMIC_setTxSlots(epoch, LMIC.slotPeriod, LMIC.slotOffset, LMIC.slotWidth);
+}
+
+// Longest the task may block without a job, 0 = no limit. updateTxSlots() keeps the slot epoch
+// within a period (LMIC_SLOT_MAX_PERIOD_SEC) of now, plus this stays clear of the ostime_t wrap.
+static uint32_t idleMaxSec() {
+	uint32_t sec = lmic_timeIdleMaxSec();
+	if (LMIC.slotPeriod != 0 && (sec == 0 || sec > SLOT_IDLE_MAX_SEC)) {
+		sec = SLOT_IDLE_MAX_SEC;
+	}
+	return sec;
+}
+
+// Must run in the LMIC task, again once the DevAddr is known
+static void applyTxSlots() {
+	lmicSlotCfg_t sc;
+	taskENTER_CRITICAL();
+	sc = cfg.slots;
+	taskEXIT_CRITICAL();
+	if (sc.periodSec == 0 || sc.slotMs == 0) {
+		LMIC_setTxSlots(0, 0, 0, 0);
+		return;
+	}
+	uint32_t slots = sc.periodSec * 1000 / sc.slotMs;
+	if (slots == 0) {
+		slots = 1;
+	} else if (slots > UINT16_MAX) {
+		slots = UINT16_MAX;
+	}
+	uint32_t slot = sc.slot;
+	if (!sc.fixedSlot) {
+		slot = lmic_slotIndex(LMIC.devaddr, slots);
+	}
+	slot %= slots;
+	slotInfo.slot = slot;
+	slotInfo.slots = slots;
+	LMIC_setTxSlots(0, sec2osticks(sc.periodSec), ms2osticks(slot * sc.slotMs), ms2osticks(sc.slotMs / 2));
+	updateTxSlots();
+}
+
 //Keep in mind that in LMiC APPEUI and DEVEUI are LSBF, DEVKEY (AppKey) is MSBF. To make life easier
 void os_getArtEui(uint8_t* buf) { // provide application router ID (8 bytes, LSBF)
 	//Log("REQ: OTAA APP EUI\n");
@@ -137,21 +417,9 @@ uint32_t getDevAddr() {
 }
 
 #define LORA_OTAA 0
-#define LORA_RF_DUTY_TESTMODE 0
 
 static void LogNetworkInfo() {
-	Log("netid = %d, Dev Addr: %08x\n", LMIC.netid, LMIC.devaddr);
-	Log("Network Key: ");
-	for (int i = 0; i < 16; i++) {
-		Log("%02x", LMIC.nwkKey[i]);
-	}
-	Log("\n");
-
-	Log("App Key: ");
-	for (int i = 0; i < 16; i++) {
-		Log("%02x", LMIC.artKey[i]);
-	}
-	Log("\n");
+	TRACE_INFO(TRACE_NETWORK_INFO, LMIC.netid, LMIC.devaddr, 0);
 }
 
 static void SetupLoraWAN() {
@@ -169,31 +437,13 @@ static void SetupLoraWAN() {
 	LMIC_setLinkCheckMode(0);
 	LMIC_setAdrMode(1);
 
-	signed char band;
-#if LORA_RF_DUTY_TESTMODE == 1
-	band = BAND_AUX;
-#else
-	band = BAND_CENTI;
-#endif
-
-	LMIC_setupBand(BAND_AUX, 14, 1); //10% duty rate
-	LMIC_setupBand(BAND_CENTI, 14, 100); //1000 =  0.1%, 100 = 1%, 10 = 10%
-
 	//must be configured after setSession
-	LMIC_setupChannel(0, 868100000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);      // g-band
-	LMIC_setupChannel(1, 868300000, DR_RANGE_MAP(DR_SF12, DR_SF7), band); //DR_SF7B), band);
-	LMIC_setupChannel(2, 868500000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);
-	LMIC_setupChannel(3, 867100000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);
-	LMIC_setupChannel(4, 867300000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);      // g-band
-	LMIC_setupChannel(5, 867500000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);      // g-band
-	LMIC_setupChannel(6, 867700000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);      // g-band
-	LMIC_setupChannel(7, 867900000, DR_RANGE_MAP(DR_SF12, DR_SF7), band);      // g-band
-	LMIC_setupChannel(8, 868800000, DR_RANGE_MAP(DR_FSK, DR_FSK), BAND_MILLI);      // g2-band
+	lmic_applyChannelPlan(&channelPlan, false);
 
 	//Initial SF and Power Setup
 	s1_t txpower = (s1_t) cfg.txPower;
 	if (txpower > 14 || txpower < 0) {
-		Log("invalid START_POWER (must be 0...14dbm)! using 14dbm...\n");
+		TRACE_ERR(TRACE_INVALID_TXPOWER, txpower, 0, 0);
 		txpower = 14;
 	}
 
@@ -203,7 +453,7 @@ static void SetupLoraWAN() {
 	} else if (cfgSF > 12) {
 		cfgSF = 12;
 	}
-	Log("Spreading Factor: %d, TxPower: %d dBm\n", cfgSF, txpower);
+	TRACE_INFO(TRACE_DR_TXPOW, cfgSF, txpower, 0);
 	switch (cfgSF) {
 	case 7:
 		LMIC_setDrTxpow(DR_SF7, txpower);
@@ -218,32 +468,35 @@ static void SetupLoraWAN() {
 		LMIC_setDrTxpow(DR_SF10, txpower);
 		break;
 	case 11:
-		default:
 		LMIC_setDrTxpow(DR_SF11, txpower);
+		break;
+	case 12:
+	default:
+		LMIC_setDrTxpow(DR_SF12, txpower);
+		break;
 	}
 
-	//    LMIC_disableChannel(0);
-	//    LMIC_disableChannel(1);
-	//    LMIC_disableChannel(2);
-	LMIC_disableChannel(3);
-	LMIC_disableChannel(4);
-	LMIC_disableChannel(5);
-	LMIC_disableChannel(6);
-	LMIC_disableChannel(7);
-	LMIC_disableChannel(8);
-
 	LMIC_setAdrMode(cfg.adr);
-	Log("LMIC ADR: %d\n", cfg.adr);
+	LMIC_setDeviceAdr(cfg.adrMarginDb, cfg.adrHysteresisDb);
+	TRACE_INFO(TRACE_ADR, cfg.adr, cfg.adrMarginDb, 0);
+
+	LMIC_setLbt(cfg.lbt.mode, cfg.lbt.thresholdDbm, cfg.lbt.backoffMs, cfg.lbt.maxDeferrals);
+	if (cfg.clockPpm != 0) {
+		LMIC_setClockError(cfg.clockPpm);
+	}
+	LMIC_setClassC(cfg.classC);
+	applyMcastGroups(UINT32_MAX);
+	applyTxSlots();
 
 	if (otaa) {
 		if (LMIC_startJoining()) {
-			Log("OTAA Network join started!\n");
+			TRACE_INFO(TRACE_JOIN_STARTED, 0, 0, 0);
 			xSemaphoreTake(LmicSendingSemaphore, 0);
 		} else {
-			Log("OTAA Network already joined!\n");
+			TRACE_INFO(TRACE_ALREADY_JOINED, 0, 0, 0);
 		}
 	} else {
-		Log("ABP join done\n");
+		TRACE_INFO(TRACE_ABP_JOINED, 0, 0, 0);
 		LogNetworkInfo();
 	}
 }
@@ -273,39 +526,352 @@ void drv_lmic_sx_irq_handler(uint8_t dio) {
 	portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
-// Send unconfirmed. Add a second confirmed method when needed.
-BaseType_t drv_lmic_send(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait) {
-	configASSERT(len <= MAX_LEN_FRAME);
+lmicTxHandle_t drv_lmic_sendAsync(const lmicTxRequest_t* req, TickType_t ticksToWait) {
+	configASSERT(req->len <= MAX_LEN_FRAME);
+	configASSERT(req->policy <= LMIC_DR_MAX_RELIABILITY);
+	configASSERT(req->retry.attempts <= LMIC_RETRY_MAX_ATTEMPTS);
+
+	taskENTER_CRITICAL();
+	lastTxHandle++;
+	if (lastTxHandle == LMIC_TX_INVALID_HANDLE) {
+		lastTxHandle++;
+	}
+	lmicTxHandle_t handle = lastTxHandle;
+	taskEXIT_CRITICAL();
 
 	SendEvent_t e;
-	e.port = port;
-	memcpy(e.data, data, len);
-	e.len = len;
-	e.confirmed = false;
+	e.port = req->port;
+	memcpy(e.data, req->data, req->len);
+	e.len = req->len;
+	e.confirmed = req->confirmed;
+	e.handle = handle;
+	e.callback = req->callback;
+	e.ctx = req->ctx;
+	e.notifyTask = req->notifyTask;
+	e.notifyBits = req->notifyBits;
+	e.policy = req->policy;
+	e.maxAirtimeMs = req->maxAirtimeMs;
+	e.retry = req->retry;
 
 	// If already sending just ignore and override current packet
 	xSemaphoreTake(LmicSendingSemaphore, 0);
 
-	BaseType_t ret = xQueueSend(SendQueue, &e, ticksToWait);
+	if (xQueueSend(SendQueue, &e, ticksToWait) != pdTRUE) {
+		return LMIC_TX_INVALID_HANDLE;
+	}
 	xTaskNotify(Handle, NOTIFY_SEND, eSetBits);
-	return ret;
+	return handle;
+}
+
+// Send unconfirmed. Add a second confirmed method when needed.
+BaseType_t drv_lmic_send(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait) {
+	lmicTxRequest_t req = { .port = port, .data = data, .len = len, .confirmed = false };
+	return drv_lmic_sendAsync(&req, ticksToWait) != LMIC_TX_INVALID_HANDLE ? pdTRUE : pdFALSE;
 }
 
 BaseType_t drv_lmic_sendConfirmed(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait) {
-	configASSERT(len <= MAX_LEN_FRAME);
+	lmicTxRequest_t req = { .port = port, .data = data, .len = len, .confirmed = true };
+	return drv_lmic_sendAsync(&req, ticksToWait) != LMIC_TX_INVALID_HANDLE ? pdTRUE : pdFALSE;
+}
 
-	SendEvent_t e;
-	e.port = port;
-	memcpy(e.data, data, len);
-	e.len = len;
-	e.confirmed = true;
+bool drv_lmic_txResult(lmicTxHandle_t handle, lmicTxResult_t* result) {
+	bool found = false;
+	taskENTER_CRITICAL();
+	for (int i = 0; i < TX_RESULT_HISTORY; i++) {
+		if (handle != LMIC_TX_INVALID_HANDLE && txResults[i].handle == handle) {
+			*result = txResults[i].result;
+			found = true;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return found;
+}
 
-	// If already sending just ignore and override current packet
-	xSemaphoreTake(LmicSendingSemaphore, 0);
+// DR and power for the uplink in e, before it is handed to LMIC
+static void applyTxRate(const SendEvent_t* e) {
+	txInflight.rateSet = false;
+	// A join picks its own DRs
+	if (e->policy != LMIC_DR_DEFAULT && LMIC.devaddr != 0 && !(LMIC.opmode & OP_JOINING)) {
+		uint8_t dr;
+		int8_t txpow;
+		if (lmic_ratePick(e->policy, e->len, e->maxAirtimeMs, &dr, &txpow)) {
+			txInflight.rateSet = true;
+			txInflight.rateDr = dr;
+			txInflight.prevDr = LMIC.datarate;
+			LMIC_setDrTxpow(dr, KEEP_TXPOW);
+			LMIC.msgTxPow = txpow;
+		}
+	}
+	txInflight.expectedAirtimeMs = lmic_rateAirtimeMs(LMIC.datarate, e->len);
+	TRACE_INFO(TRACE_TX_RATE, LMIC.datarate, txInflight.rateSet ? LMIC.msgTxPow : LMIC.adrTxPow, txInflight.expectedAirtimeMs);
+}
 
-	BaseType_t ret = xQueueSend(SendQueue, &e, ticksToWait);
-	xTaskNotify(Handle, NOTIFY_SEND, eSetBits);
-	return ret;
+static void applyRetryPolicy(const lmicRetryPolicy_t* retry) {
+	if (retry->attempts == 0) {
+		LMIC_setRetryPolicy(NULL);
+		return;
+	}
+	retrypol_t pol;
+	pol.attempts = retry->attempts;
+	pol.drSteps = retry->drStepMask;
+	pol.newChnl = retry->newChannel;
+	pol.backoffMode = retry->backoff == LMIC_BACKOFF_EXPONENTIAL ? RETRY_BACKOFF_EXP : RETRY_BACKOFF_FIXED;
+	pol.backoff = ms2osticks(retry->backoffMs);
+	pol.backoffMax = ms2osticks(retry->backoffMaxMs);
+	pol.jitter = ms2osticks(retry->jitterMs);
+	pol.deadline = ms2osticks(retry->deadlineMs);
+	LMIC_setRetryPolicy(&pol);
+}
+
+// Back to the DR before the uplink, unless the network or the device ADR changed it meanwhile
+static void restoreTxRate() {
+	if (!txInflight.rateSet) {
+		return;
+	}
+	txInflight.rateSet = false;
+	LMIC.msgTxPow = 0;
+	if (LMIC.datarate == txInflight.rateDr) {
+		LMIC_setDrTxpow(txInflight.prevDr, KEEP_TXPOW);
+	}
+}
+
+// Finish the uplink currently handed to LMIC, runs in the LMIC task
+static void completeTx(lmicTxStatus_t status) {
+	if (!txInflight.active) {
+		return;
+	}
+	txInflight.active = false;
+	restoreTxRate();
+
+	lmicTxResult_t result;
+	memset(&result, 0, sizeof(result));
+	result.status = status;
+	result.seqno = LMIC.seqnoUp - 1;
+	result.airtimeMs = osticks2ms(LMIC.txAirtime);
+	result.dr = LMIC.txDr;
+	result.channel = LMIC.txChnl;
+	result.retries = LMIC.txCnt > 1 ? LMIC.txCnt - 1 : 0;
+	result.txPower = LMIC.txpow;
+	result.expectedAirtimeMs = txInflight.expectedAirtimeMs;
+	result.attempts = LMIC.txAttCnt;
+	for (int i = 0; i < LMIC.txAttCnt; i++) {
+		const txatt_t* att = &LMIC.txAtt[i];
+		result.attempt[i].offsetMs = osticks2ms(att->txbeg - LMIC.txAtt[0].txbeg);
+		result.attempt[i].dr = att->dr;
+		result.attempt[i].channel = att->chnl;
+		result.attempt[i].txPower = att->txpow;
+		result.attempt[i].outcome = att->result == TXATT_ACK ? LMIC_ATTEMPT_ACKED
+				: att->result == TXATT_RX ? LMIC_ATTEMPT_DOWNLINK : LMIC_ATTEMPT_NO_ANSWER;
+	}
+	if (status == LMIC_TX_DROPPED || status == LMIC_TX_JOIN_FAILED) {
+		result.airtimeMs = 0;
+		result.retries = 0;
+		result.attempts = 0;
+	}
+
+	taskENTER_CRITICAL();
+	txResults[txResultsNext].handle = txInflight.handle;
+	txResults[txResultsNext].result = result;
+	txResultsNext = (txResultsNext + 1) % TX_RESULT_HISTORY;
+	taskEXIT_CRITICAL();
+
+	if (txInflight.callback != NULL) {
+		txInflight.callback(txInflight.handle, &result, txInflight.ctx);
+	}
+	if (txInflight.notifyTask != NULL) {
+		xTaskNotify(txInflight.notifyTask, txInflight.notifyBits, eSetBits);
+	}
+}
+
+static int registerDownlink(uint8_t portFrom, uint8_t portTo, lmicDownlinkHandler_t handler, void* ctx, QueueHandle_t queue, uint32_t budgetMs) {
+	configASSERT(portFrom <= portTo);
+	int id = -1;
+	taskENTER_CRITICAL();
+	for (int i = 0; i < LMIC_DOWNLINK_MAX_HANDLERS; i++) {
+		DownlinkHandler_t* h = &downlinkHandlers[i];
+		if (!h->used) {
+			memset(h, 0, sizeof(DownlinkHandler_t));
+			h->portFrom = portFrom;
+			h->portTo = portTo;
+			h->handler = handler;
+			h->ctx = ctx;
+			h->queue = queue;
+			h->budget = ms2osticks(budgetMs);
+			h->used = true;
+			id = i;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return id;
+}
+
+int drv_lmic_registerDownlinkHandler(uint8_t portFrom, uint8_t portTo, lmicDownlinkHandler_t handler, void* ctx, uint32_t budgetMs) {
+	configASSERT(handler);
+	return registerDownlink(portFrom, portTo, handler, ctx, NULL, budgetMs);
+}
+
+int drv_lmic_registerDownlinkQueue(uint8_t portFrom, uint8_t portTo, QueueHandle_t queue) {
+	configASSERT(queue);
+	return registerDownlink(portFrom, portTo, NULL, NULL, queue, 0);
+}
+
+void drv_lmic_unregisterDownlinkHandler(int id) {
+	if (id < 0 || id >= LMIC_DOWNLINK_MAX_HANDLERS) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	downlinkHandlers[id].used = false;
+	taskEXIT_CRITICAL();
+}
+
+bool drv_lmic_getDownlinkStats(int id, lmicDownlinkStats_t* stats) {
+	if (id < 0 || id >= LMIC_DOWNLINK_MAX_HANDLERS || !downlinkHandlers[id].used) {
+		return false;
+	}
+	taskENTER_CRITICAL();
+	*stats = downlinkHandlers[id].stats;
+	taskEXIT_CRITICAL();
+	return true;
+}
+
+// Hand the frame in LMIC.frame to all handlers of its port, runs in the LMIC task.
+// Must finish before the next LMIC job, since that may reuse LMIC.frame.
+static void dispatchDownlink() {
+	if (!(LMIC.txrxFlags & TXRX_PORT)) {
+		return;
+	}
+
+	lmicDownlink_t dl;
+	dl.data = LMIC.frame + LMIC.dataBeg;
+	dl.len = LMIC.dataLen;
+	dl.port = LMIC.frame[LMIC.dataBeg - 1];
+	dl.rssi = LMIC.rssi - RSSI_OFF;
+	dl.snr = LMIC.snr;
+	dl.window = LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2 | TXRX_PING | TXRX_CLASSC);
+	dl.group = LMIC.dnGroup;
+	dl.fpending = dl.group == MCAST_NONE && LMIC.moreData;
+
+	int delivered = 0;
+	for (int i = 0; i < LMIC_DOWNLINK_MAX_HANDLERS; i++) {
+		DownlinkHandler_t* h = &downlinkHandlers[i];
+		if (!h->used || dl.port < h->portFrom || dl.port > h->portTo) {
+			continue;
+		}
+		delivered++;
+		h->stats.calls++;
+
+		if (h->queue != NULL) {
+			static lmicDownlinkCopy_t copy;
+			memcpy(copy.data, dl.data, dl.len);
+			copy.len = dl.len;
+			copy.port = dl.port;
+			copy.rssi = dl.rssi;
+			copy.snr = dl.snr;
+			copy.window = dl.window;
+			copy.fpending = dl.fpending;
+			copy.group = dl.group;
+			if (xQueueSend(h->queue, &copy, 0) != pdTRUE) {
+				h->stats.dropped++;
+			}
+			continue;
+		}
+
+		ostime_t start = os_getTime();
+		h->handler(&dl, h->ctx);
+		ostime_t duration = os_getTime() - start;
+		if (duration > h->budget) {
+			h->stats.overruns++;
+			TRACE_ERR(TRACE_DOWNLINK_OVERRUN, dl.port, i, osticks2ms(duration));
+		}
+		if (osticks2ms(duration) > h->stats.maxMs) {
+			h->stats.maxMs = osticks2ms(duration);
+		}
+	}
+
+	if (delivered == 0) {
+		TRACE_INFO(TRACE_DOWNLINK_UNHANDLED, dl.port, dl.len, 0);
+	}
+}
+
+int drv_lmic_subscribeEvents(lmicEventSubscriber_t subscriber, void* ctx) {
+	configASSERT(subscriber);
+	int id = -1;
+	taskENTER_CRITICAL();
+	for (int i = 0; i < LMIC_EVENT_MAX_SUBSCRIBERS; i++) {
+		if (eventSubscribers[i].subscriber == NULL) {
+			eventSubscribers[i].ctx = ctx;
+			eventSubscribers[i].subscriber = subscriber;
+			id = i;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return id;
+}
+
+void drv_lmic_unsubscribeEvents(int id) {
+	if (id < 0 || id >= LMIC_EVENT_MAX_SUBSCRIBERS) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	eventSubscribers[id].subscriber = NULL;
+	taskEXIT_CRITICAL();
+}
+
+uint32_t drv_lmic_eventsDropped() {
+	return eventRing.dropped;
+}
+
+// Snapshot the MAC state of an event, runs in LMIC job context
+static void recordEvent(ev_t ev) {
+	taskENTER_CRITICAL();
+	if (eventRing.count == LMIC_EVENT_RING_SIZE) {
+		eventRing.dropped++;
+		taskEXIT_CRITICAL();
+		return;
+	}
+	lmicEvent_t* e = &eventRing.events[eventRing.head];
+	e->ev = ev;
+	e->time = os_getTime();
+	e->txrxFlags = LMIC.txrxFlags;
+	e->seqnoUp = LMIC.seqnoUp;
+	e->seqnoDn = LMIC.seqnoDn;
+	e->dr = LMIC.datarate;
+	e->rssi = LMIC.rssi - RSSI_OFF;
+	e->snr = LMIC.snr;
+	eventRing.head = (eventRing.head + 1) % LMIC_EVENT_RING_SIZE;
+	eventRing.count++;
+	taskEXIT_CRITICAL();
+
+	// Events reported outside the LMIC task (e.g. by drv_lmic_start()) need a wakeup to be delivered
+	if (Handle != NULL && xTaskGetCurrentTaskHandle() != Handle) {
+		xTaskNotify(Handle, NOTIFY_EVENT, eSetBits);
+	}
+}
+
+// Fan out recorded events to all subscribers, runs in the LMIC task outside of LMIC jobs
+static void dispatchEvents() {
+	static lmicEvent_t e;
+	for (;;) {
+		taskENTER_CRITICAL();
+		if (eventRing.count == 0) {
+			taskEXIT_CRITICAL();
+			return;
+		}
+		uint8_t tail = (eventRing.head + LMIC_EVENT_RING_SIZE - eventRing.count) % LMIC_EVENT_RING_SIZE;
+		e = eventRing.events[tail];
+		eventRing.count--;
+		taskEXIT_CRITICAL();
+
+		for (int i = 0; i < LMIC_EVENT_MAX_SUBSCRIBERS; i++) {
+			lmicEventSubscriber_t subscriber = eventSubscribers[i].subscriber;
+			if (subscriber != NULL) {
+				subscriber(&e, eventSubscribers[i].ctx);
+			}
+		}
+	}
 }
 
 void lmic_stop_systick() {
@@ -316,35 +882,57 @@ void lmic_start_systick() {
 	TIM9->CR1 = TIM_CR1_CEN;
 }
 
+static void updateTransitionStats(TickType_t start, TickType_t* last, TickType_t* max) {
+	TickType_t duration = xTaskGetTickCount() - start;
+	*last = duration;
+	if (duration > *max) {
+		*max = duration;
+	}
+}
+
+// Blocks until the LMIC task stopped the systick and entered LMIC_POWER_SLEEPING
 void drv_lmic_sleep() {
-	if (uxSemaphoreGetCount(LmicRunningSemaphore) > 0) {
-		//xTaskNotify(Handle, NOTIFY_SLEEP, eSetValueWithOverwrite);
-		Log("- lmic already sleeping\n");
+	if (powerState != LMIC_POWER_RUNNING) {
+		TRACE_DEBUG(TRACE_ALREADY_SLEEPING, 0, 0, 0);
 		return;
 	}
 
-	xTaskNotify(Handle, NOTIFY_SLEEP, eSetValueWithOverwrite);
-	configASSERT(xSemaphoreTake(LmicRunningSemaphore, 10000 / portTICK_PERIOD_MS));
-	xSemaphoreGive(LmicRunningSemaphore);
-	vTaskSuspend(Handle);
+	TickType_t start = xTaskGetTickCount();
+	powerState = LMIC_POWER_DRAINING;
+	xEventGroupClearBits(LmicPowerEvents, POWER_EV_RUNNING);
+	xTaskNotify(Handle, NOTIFY_SLEEP, eSetBits);
+	EventBits_t bits = xEventGroupWaitBits(LmicPowerEvents, POWER_EV_SLEEPING, pdFALSE, pdTRUE, POWER_TRANSITION_TIMEOUT_MS / portTICK_PERIOD_MS);
+	configASSERT(bits & POWER_EV_SLEEPING);
+
+	powerStats.sleeps++;
+	updateTransitionStats(start, &powerStats.lastSleepTicks, &powerStats.maxSleepTicks);
 }
 
+// Blocks until the LMIC task restarted the systick and entered LMIC_POWER_RUNNING
 void drv_lmic_wakeup() {
-	if (uxSemaphoreGetCount(LmicRunningSemaphore) == 0) {
-		//xTaskNotify(Handle, NOTIFY_WAKE, eSetValueWithOverwrite);
-		Log("+ lmic already running\n");
+	if (powerState != LMIC_POWER_SLEEPING) {
+		TRACE_DEBUG(TRACE_ALREADY_RUNNING, 0, 0, 0);
 		return;
 	}
 
-	xTaskNotify(Handle, NOTIFY_WAKE, eSetValueWithOverwrite);
-	vTaskResume(Handle);
+	TickType_t start = xTaskGetTickCount();
+	xEventGroupClearBits(LmicPowerEvents, POWER_EV_SLEEPING);
+	xTaskNotify(Handle, NOTIFY_WAKE, eSetBits);
+	EventBits_t bits = xEventGroupWaitBits(LmicPowerEvents, POWER_EV_RUNNING, pdFALSE, pdTRUE, POWER_TRANSITION_TIMEOUT_MS / portTICK_PERIOD_MS);
+	configASSERT(bits & POWER_EV_RUNNING);
 
-	int i = 0;
-	while (uxSemaphoreGetCount(LmicRunningSemaphore) > 1) {
-		vTaskDelay(10 / portTICK_PERIOD_MS);
-		i++;
-		configASSERT(i < 500);
-	}
+	powerStats.wakeups++;
+	updateTransitionStats(start, &powerStats.lastWakeTicks, &powerStats.maxWakeTicks);
+}
+
+lmicPowerState_t drv_lmic_powerState() {
+	return powerState;
+}
+
+void drv_lmic_getPowerStats(lmicPowerStats_t* stats) {
+	taskENTER_CRITICAL();
+	*stats = powerStats;
+	taskEXIT_CRITICAL();
 }
 
 // Check if LMIC has work to do. e.g. for deciding to enter sleep mode
@@ -364,14 +952,34 @@ bool drv_lmic_IsSending() {
 	}
 }
 
+bool lmic_txIdle() {
+	return uxSemaphoreGetCount(LmicSendingSemaphore) != 0 && uxQueueMessagesWaiting(SendQueue) == 0;
+}
+
 static Time_t rtc_now() {
 	DateTime_t nowDate;
 	hal_rtc_GetDateTime(&nowDate);
 	return TimeFromDateTime(&nowDate);
 }
 
+lmicPlanError_t drv_lmic_setChannelPlan(const lmicChannelPlan_t* plan) {
+	lmicPlanError_t err = drv_lmic_validateChannelPlan(plan);
+	if (err != LMIC_PLAN_OK) {
+		return err;
+	}
+
+	taskENTER_CRITICAL();
+	channelPlan = *plan;
+	channelPlanPending = started;
+	taskEXIT_CRITICAL();
+
+	if (started) {
+		xTaskNotify(Handle, NOTIFY_CHANNEL_PLAN, eSetBits);
+	}
+	return LMIC_PLAN_OK;
+}
+
 void drv_lmic_start() {
-	static bool started = false;
 	lobaroASSERT(!started);
 	started = true;
 
@@ -380,177 +988,345 @@ void drv_lmic_start() {
 }
 
 int drv_lmic_TimeToNextJobMs() {
-	osjob_t* nextJob = os_nextJob();
-
-	if (nextJob != NULL) {
-		return osticks2ms(nextJob->deadline - os_getTime());
+	ostime_t delay;
+	if (os_nextJobDelay(&delay)) {
+		return osticks2ms(delay);
 	}
 
 	return -1;
 }
 
+void drv_lmic_getTaskStats(lmicTaskStats_t* stats) {
+	taskENTER_CRITICAL();
+	*stats = taskStats;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_resetTaskStats() {
+	taskENTER_CRITICAL();
+	memset(&taskStats, 0, sizeof(taskStats));
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getLbtStats(lmicLbtStats_t* stats) {
+	taskENTER_CRITICAL();
+	stats->checks = LMIC.lbtChecks;
+	stats->deferred = LMIC.lbtDeferred;
+	stats->forced = LMIC.lbtForced;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getTxTiming(lmicTxTiming_t* timing) {
+	taskENTER_CRITICAL();
+	timing->prepUs = osticks2us(LMIC.txPrepTime);
+	timing->latencyUs = osticks2us(LMIC.txLatency);
+	timing->latencyMaxUs = osticks2us(LMIC.txLatencyMax);
+	timing->preloaded = LMIC.txPreloaded;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getRadioStats(lmicRadioStats_t* stats) {
+	taskENTER_CRITICAL();
+	stats->sleeps = LMIC.radioSleeps;
+	stats->standbys = LMIC.radioStandbys;
+	stats->regWrites = LMIC.radioRegWrites;
+	stats->regSkips = LMIC.radioRegSkips;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getIrqLatency(lmicIrqLatency_t* latency) {
+	taskENTER_CRITICAL();
+	latency->captures = LMIC.irqCaptures;
+	latency->lastUs = osticks2us(LMIC.irqLatency);
+	latency->maxUs = osticks2us(LMIC.irqLatencyMax);
+	latency->avgUs = LMIC.irqCaptures ? osticks2us(LMIC.irqLatencySum / LMIC.irqCaptures) : 0;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getRxWindowStats(lmicRxWindowStats_t* stats) {
+	taskENTER_CRITICAL();
+	uint32_t n = LMIC.rxWinUplinks;
+	stats->uplinks = n;
+	stats->onUs = n ? osticks2us(LMIC.rxOnTotal / n) : 0;
+	stats->modelUs = n ? osticks2us(LMIC.rxModelTotal / n) : 0;
+	stats->legacyUs = n ? osticks2us(LMIC.rxLegacyTotal / n) : 0;
+	stats->biasUs = osticks2us(LMIC.rxBias);
+	stats->devUs = osticks2us(LMIC.rxDev);
+	stats->calibrations = LMIC.rxCalCnt;
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getClassCStats(lmicClassCStats_t* stats) {
+	taskENTER_CRITICAL();
+	stats->frames = LMIC.rxcFrames;
+	stats->offMs = osticks2ms(LMIC.rxcOffTotal);
+	stats->offMaxMs = osticks2ms(LMIC.rxcOffMax);
+	taskEXIT_CRITICAL();
+}
+
+void drv_lmic_getDeviceAdrStats(lmicDeviceAdrStats_t* stats) {
+	taskENTER_CRITICAL();
+	int16_t sum = 0;
+	for (int i = 0; i < LMIC.devAdrCnt; i++) {
+		sum += LMIC.devAdrHist[i];
+	}
+	stats->samples = LMIC.devAdrCnt;
+	stats->snrAt0dBm = LMIC.devAdrCnt ? sum / LMIC.devAdrCnt : 0;
+	stats->ups = LMIC.devAdrUps;
+	stats->downs = LMIC.devAdrDowns;
+	taskEXIT_CRITICAL();
+}
+
 void LmicLoraWANTask(void* pvParameters) {
 	static uint32_t notification;
 	static SendEvent_t sendEvent;
 	static Time_t sleepTime = 0;
 
-	Log("LMIC LoRaWAN Task created. Not started yet!\n");
+	TRACE_INFO(TRACE_TASK_CREATED, 0, 0, 0);
 	vTaskSuspend(NULL);
 // No need to sleep
 //xTaskNotify(Handle, NOTIFY_SLEEP, eSetValueWithOverwrite);
-	Log("LMIC LoRaWAN Task started.\n");
+	TRACE_INFO(TRACE_TASK_STARTED, 0, 0, 0);
 
+	TickType_t sleepTicks = 0;
 	for (;;) {
-
-		osjob_t* nextJob = os_nextJob();
-		TickType_t sleepTicks = portMAX_DELAY; // We get woken up by ostick timer IRQ anyway!
-
-		if (nextJob != NULL) {
-			ostime_t osTime = os_getTime();
-			ostime_t nextJobTme = nextJob->deadline - osTime;
-			sleepTicks = nextJobTme < 0 ? 0 : ((osticks2ms(nextJobTme) - 10) / portTICK_PERIOD_MS);
-		}
-
+		lmic_energyMcu(false);
 		xTaskNotifyWait(0, ULONG_MAX, &notification, sleepTicks);
+		taskStats.wakeups++;
 
-		if (notification & NOTIFY_SLEEP) {
+		if ((notification & NOTIFY_SLEEP) && powerState == LMIC_POWER_DRAINING) {
 			lmic_stop_systick();
 			sleepTime = rtc_now();
-			Log("- lmic sleeping\n");
-			xSemaphoreGive(LmicRunningSemaphore);
+			powerState = LMIC_POWER_SLEEPING;
+			xEventGroupSetBits(LmicPowerEvents, POWER_EV_SLEEPING);
+			TRACE_INFO(TRACE_SLEEPING, 0, 0, 0);
 		}
-		if (notification & NOTIFY_WAKE) {
+		if ((notification & NOTIFY_WAKE) && powerState == LMIC_POWER_SLEEPING) {
 			lmic_start_systick();
 
 			Time_t now = rtc_now();
-			Time_t skipSeconds = now - sleepTime;
+			Time_t slept = now - sleepTime;
+			Time_t skipSeconds = slept;
 			if (skipSeconds > 1 * HOUR) {
 				skipSeconds = 1 * HOUR;
 			}
 			// For testing only:
 			//skipSeconds = 5 * MINUTE;
 
-			Log("LMIC: Skipping %d seconds that we were sleeping\n", skipSeconds);
+			TRACE_INFO(TRACE_SKIP_SECONDS, skipSeconds, 0, 0);
+			ostime_t stopped = os_getTime();
 			lmic_hal_increase_systicks(sec2osticks(skipSeconds));
+			lmic_timeSleep(stopped, slept);
 
 			// Throw away duty cycle for all bands
 			/*for (u1_t bi = 0; bi < 4; bi++) {
 			 LMIC.bands[bi].avail = os_getTime();
 			 }*/
 
-			Log("+ lmic running\n");
-			xSemaphoreTake(LmicRunningSemaphore, 0);
+			powerState = LMIC_POWER_RUNNING;
+			xEventGroupSetBits(LmicPowerEvents, POWER_EV_RUNNING);
+			TRACE_INFO(TRACE_RUNNING, 0, 0, 0);
 		}
 
-		// Task is sleeping -> ignore all further notifications
-		if (uxSemaphoreGetCount(LmicRunningSemaphore) > 0) {
+		// Task is sleeping -> ignore all further notifications until woken up
+		if (powerState == LMIC_POWER_SLEEPING) {
+			sleepTicks = portMAX_DELAY;
 			continue;
 		}
+		// Not before, the skipped sleep time is booked to the baseline
+		lmic_energyMcu(true);
 
 		if (xQueueReceive(SendQueue, &sendEvent, 0)) {
-			Log("lmic: Sending queued packet @ %u\n", os_getTime());
+			TRACE_INFO(TRACE_SEND_QUEUED, sendEvent.port, sendEvent.len, 0);
+			// A still running uplink is overridden by the new one
+			completeTx(LMIC_TX_DROPPED);
+			txInflight.active = true;
+			txInflight.handle = sendEvent.handle;
+			txInflight.callback = sendEvent.callback;
+			txInflight.ctx = sendEvent.ctx;
+			txInflight.notifyTask = sendEvent.notifyTask;
+			txInflight.notifyBits = sendEvent.notifyBits;
+			applyTxRate(&sendEvent);
+			applyRetryPolicy(&sendEvent.retry);
 			memcpy(LMIC.frame, sendEvent.data, sendEvent.len);
+			// LMIC_setTxData2() schedules the uplink right away, on the current slot epoch
+			updateTxSlots();
 			LMIC_setTxData2(sendEvent.port, LMIC.frame, sendEvent.len, sendEvent.confirmed);
 		}
 
+		// Radio IRQs are handled in IRQ context, their jobs are already queued
 		if (notification & NOTIFY_SX_IRQ_0) {
-			Log("SX irq 0 @ %u\n", os_getTime());
-			continue;
-			//radio_irq_handler(0); // Handled in IRQ
+			TRACE_DEBUG(TRACE_SX_IRQ, 0, 0, 0);
 		}
 		if (notification & NOTIFY_SX_IRQ_1) {
-			Log("SX irq 1 @ %u\n", os_getTime());
-			continue;
-			//radio_irq_handler(1); // Handled in IRQ
+			TRACE_DEBUG(TRACE_SX_IRQ, 1, 0, 0);
 		}
 		if (notification & NOTIFY_SX_IRQ_2) {
-			Log("SX irq 2 @ %u\n", os_getTime());
-			continue;
-			//radio_irq_handler(2); // Handled in IRQ
+			TRACE_DEBUG(TRACE_SX_IRQ, 2, 0, 0);
+		}
+
+		if (channelPlanPending) {
+			applyChannelPlan();
+		}
+
+		if (mcastPending) {
+			taskENTER_CRITICAL();
+			uint32_t pending = mcastPending;
+			mcastPending = 0;
+			taskEXIT_CRITICAL();
+			applyMcastGroups(pending);
+		}
+
+		if (classCPending) {
+			classCPending = false;
+			LMIC_setClassC(cfg.classC);
+		}
+
+		if (timeReqPending) {
+			timeReqPending = false;
+			LMIC_requestNetworkTime();
+		}
+
+		if (slotsPending) {
+			slotsPending = false;
+			applyTxSlots();
 		}
 
-		if (notification & NOTIFY_SYSTICK_IRQ) {
-			//Log("Systick @ %u\n", os_getTime());
+		if (lmic_hal_asserCalled()) {
+			TRACE_ERR(TRACE_ASSERT_CALLED, 0, 0, 0);
 		}
 
-		nextJob = os_nextJob(); // Update next Job in case it changed by any irq
-		if (nextJob != NULL) {
+		// Run everything that is due. LMIC masks its own IRQs where needed, see lmic_hal_disableIRQs()
+		u1_t jobs = os_runloopBatch(LMIC_BATCH_MAX_JOBS, ms2osticks(LMIC_BATCH_MAX_MS));
+		taskStats.jobs += jobs;
+		dispatchEvents();
+		lmic_fragFlush();
+		lmic_timeUpdate();
+		updateTxSlots();
+
+		ostime_t delay;
+		bool pending = os_nextJobDelay(&delay);
+		if (pending) {
 			xSemaphoreTake(LmicBusySemaphore, 0);
-			Log("lmic NextJob %04x @ %u (in %d ms)\n", nextJob->func, nextJob->deadline, nextJob->deadline ? osticks2ms(nextJob->deadline - os_getTime()) : 0);
 		} else {
 			xSemaphoreGive(LmicBusySemaphore);
 		}
 
-		if (lmic_hal_asserCalled()) {
-			Log("lmic ASSERT called!\n");
+		if (pending && delay == 0) {
+			// Budget exhausted with jobs still due, yield once and continue
+			sleepTicks = 0;
+		} else if (pending) {
+			// The next deadline is armed on TIM9 by os_runloopBatch(), its compare IRQ wakes us exactly in time.
+			// Radio IRQs and API calls notify the task as well. If the budget ran out before takeDueJob()
+			// armed the compare the timeout is the backstop, rounded up so it never fires before the compare.
+			// Capped to keep pdMS_TO_TICKS() in range, waking up early just re-evaluates the queue.
+			uint32_t backstopMs = osticks2ms(delay) + 1;
+			if (backstopMs > LMIC_BACKSTOP_MAX_MS) {
+				backstopMs = LMIC_BACKSTOP_MAX_MS;
+			}
+			sleepTicks = pdMS_TO_TICKS(backstopMs);
+		} else if (idleMaxSec() != 0) {
+			// Nothing queued, but the network time reference or the slot epoch has to be moved forward in time
+			sleepTicks = idleMaxSec() * configTICK_RATE_HZ;
+		} else {
+			sleepTicks = portMAX_DELAY;
 		}
 
-		taskENTER_CRITICAL();
-		os_runloop(false);
-		taskEXIT_CRITICAL();
-
 		//LMIC_sendAlive();
 	}
 }
 
+// Called by LMIC from job context. Only what depends on the current MAC state is handled here,
+// everything else is delivered to event subscribers after the job batch.
 void onLmicEvent(ev_t ev) {
+	recordEvent(ev);
+
 	switch (ev) {
 // network joined, session established
 	case EV_JOINED:
-		Log("Join Done.\n");
+		TRACE_INFO(TRACE_EV_JOINED, 0, 0, 0);
 		LogNetworkInfo();
+		applyChannelPlan(); // the join accept reset the channels to the defaults
+		applyTxSlots(); // slot derived from the new DevAddr
 		xSemaphoreGive(LmicSendingSemaphore);
 		break;
+	case EV_JOIN_FAILED:
+		TRACE_ERR(TRACE_EV_JOIN_FAILED, 0, 0, 0);
+		if (txInflight.active) {
+			// Do not send the stale payload once a later join succeeds
+			LMIC_clrTxData();
+			completeTx(LMIC_TX_JOIN_FAILED);
+			xSemaphoreGive(LmicSendingSemaphore);
+		}
+		break;
 	case EV_JOINING:
-		Log("OTAA join started\n");
+		TRACE_INFO(TRACE_EV_JOINING, 0, 0, 0);
 		break;
 	case EV_RESET:
-		Log("stack reset!\n");
+		TRACE_INFO(TRACE_EV_RESET, 0, 0, 0);
 		break;
 	case EV_TXCOMPLETE:
-		Log("tx done (fc: %d)!\n", LMIC.seqnoUp - 1);
+		TRACE_INFO(TRACE_EV_TXCOMPLETE, LMIC.seqnoUp - 1, 0, 0);
+		taskStats.uplinks++;
+		lmic_energyUplink();
+		if (LMIC.txrxFlags & TXRX_ACK) {
+			completeTx(LMIC_TX_ACKED);
+		} else if (LMIC.txrxFlags & TXRX_NACK) {
+			completeTx(LMIC_TX_NACKED);
+		} else {
+			completeTx(LMIC_TX_SENT);
+		}
 		xSemaphoreGive(LmicSendingSemaphore);
 		if (LMIC.dataLen) { // data received in rx slot after tx
-			//  debug_buf(LMIC.frame+LMIC.dataBeg, LMIC.dataLen);
-			Log("Rxed Data (unprocessed)!\n");
-			for (int i = 0; i < LMIC.dataLen; i++) {
-				Log("%x", (LMIC.frame + LMIC.dataBeg)[i]);
+			uint8_t* data = LMIC.frame + LMIC.dataBeg;
+			uint32_t head = 0;
+			for (int i = 0; i < LMIC.dataLen && i < 4; i++) {
+				head = (head << 8) | data[i];
 			}
-			Log("\n");
+			TRACE_INFO(TRACE_EV_RXDATA, (LMIC.txrxFlags & TXRX_PORT) ? data[-1] : 0, LMIC.dataLen, head);
 		}
+		dispatchDownlink();
 		break;
 	case EV_RXCOMPLETE:
-		Log("rx done!\n");
+		TRACE_INFO(TRACE_EV_RXCOMPLETE, 0, 0, 0);
+		dispatchDownlink();
 		break;
 	default:
-		Log("unhandeld net event: %d [%x]\n", ev, ev);
+		TRACE_INFO(TRACE_EV_UNHANDLED, ev, ev, 0);
 	}
 }
 
 static uint32_t lastTicks = 0;
 void BenchmarkTimer_cb(TimerHandle_t xTimer) {
 	uint32_t ticks = os_getTime();
-	Log("Ticks per sec: ~%d\n", ticks - lastTicks);
+	TRACE_INFO(TRACE_TICKS_PER_SEC, ticks - lastTicks, 0, 0);
 
 	lastTicks = ticks;
 }
 
 void drv_lmic_init(lmicApi_t lmicApi, lmicCfg_t lmicCfg) {
 	cfg = lmicCfg;
+	const lmicChannelPlan_t* plan = cfg.channelPlan != NULL ? cfg.channelPlan : &LMIC_PLAN_EU868_3CH;
+	configASSERT(drv_lmic_validateChannelPlan(plan) == LMIC_PLAN_OK);
+	channelPlan = *plan;
+	configASSERT(cfg.lbt.mode <= LBT_CAD);
 
 	LMIC.useLowPowerAntennaOutput = cfg.useLowPowerAntennaOutput;
 
+	lmic_traceInit();
+	lmic_energyInit(cfg.energyProfile != NULL ? cfg.energyProfile : &LMIC_ENERGY_PROFILE_SX1272);
 	os_init(lmicApi);
 	srand(radio_rand1() | ((u2_t) radio_rand1()) << 8 | ((u2_t) radio_rand1()) << 16 | ((u2_t) radio_rand1()) << 24);
 
 	SendQueue = xQueueCreate(1, sizeof(SendEvent_t));
 	configASSERT(SendQueue);
 
-	LmicRunningSemaphore = xSemaphoreCreateBinary();
-	configASSERT(LmicRunningSemaphore);
+	LmicPowerEvents = xEventGroupCreate();
+	configASSERT(LmicPowerEvents);
+	xEventGroupSetBits(LmicPowerEvents, POWER_EV_RUNNING);
 
 	LmicSendingSemaphore = xSemaphoreCreateBinary();
-	configASSERT(LmicRunningSemaphore);
+	configASSERT(LmicSendingSemaphore);
 	xSemaphoreGive(LmicSendingSemaphore);
 
 	LmicBusySemaphore = xSemaphoreCreateBinary();
@@ -0,0 +1,235 @@
+// Host test of the device side ADR of lmic.c.
+//
+//   gcc -std=gnu99 -O1 -fwrapv -Itest/stubs -I. -Ilmic test/adr_test.c plan_lmic.c test/lmic_host.c lmic/oslmic.c lmic/aes.c -o adr_test -lm && ./adr_test
+//
+// A link is the uplink SNR it gives at 0 dBm, with Gaussian fading per frame. Uplinks take DR and
+// power from the LMIC state as updateTx() sets them, downlinks and LinkCheckAns are fed to the
+// devAdr functions the way processDnData() does. Besides the checks it compares airtime and
+// delivery of device ADR against fixed data rates.
+
+#include "../lmic/lmic.c"
+#include "drv_lmic.h"
+#include "lmic_host.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAYLOAD 20
+#define MARGIN_DB 10
+#define HYST_DB 3
+#define RX2_FREQ 869525000
+#define FADING_DB 3 // sigma
+
+static int failed;
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+static double gauss(double sigma) {
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static void setup(dr_t dr, u1_t margin, u1_t hyst) {
+	lmic_hostTime = 0;
+	LMIC_reset();
+	lmic_applyChannelPlan(&LMIC_PLAN_EU868_3CH, false);
+	LMIC_setDrTxpow(dr, 14);
+	LMIC_setDeviceAdr(margin, hyst);
+}
+
+// Picks channel and power as engineUpdate() does for the next uplink, far enough apart for the duty cycle
+static void uplink() {
+	lmic_hostTime += sec2osticks(3600);
+	LMIC.rps = updr2rps(LMIC.datarate);
+	LMIC.dataLen = PAYLOAD + 13;
+	LMIC.txDr = LMIC.datarate;
+	nextTx(lmic_hostTime);
+	updateTx(lmic_hostTime);
+}
+
+// Downlink of the gateway at its usual power, in RX1 on the uplink channel or in RX2
+static void downlink(double link, bool rx2, double fading) {
+	u4_t freq = rx2 ? RX2_FREQ : LMIC.freq;
+	int gwPow = rx2 ? DEVADR_GW_TXPOW_HI : DEVADR_GW_TXPOW;
+	LMIC.freq = freq;
+	LMIC.snr = (s1_t) lround(4 * (link + gwPow + fading));
+	devAdrSample(LMIC.snr / 4 - devAdrGwPow(LMIC.freq));
+	devAdrUpdate();
+}
+
+// LinkCheckAns of an uplink received with snr
+static void linkCheckAns(double snr) {
+	int gwmargin = (int) lround(snr) - devAdrReqSnr((dr_t) LMIC.txDr);
+	if (gwmargin < 0) {
+		gwmargin = 0;
+	}
+	devAdrSample(gwmargin + devAdrReqSnr((dr_t) LMIC.txDr) - LMIC.txpow);
+	devAdrUpdate();
+}
+
+// Strong link: up to SF7 and down in power, weak link: back to a slower DR
+static void testSteps() {
+	setup(DR_SF12, MARGIN_DB, HYST_DB);
+	for (int i = 0; i < 10; i++) {
+		uplink();
+		linkCheckAns(-5 + LMIC.txpow);
+	}
+	printf("link -5 dB: DR %d at %d dBm, %u up\n", LMIC.datarate, LMIC.adrTxPow, LMIC.devAdrUps);
+	check(LMIC.datarate == DR_SF7 && LMIC.adrTxPow < 14, "strong link steps to SF7 and lowers the power");
+	check(-5 + LMIC.adrTxPow - devAdrReqSnr(DR_SF7) >= MARGIN_DB, "margin kept at the lower power");
+
+	for (int i = 0; i < DEVADR_HIST; i++) {
+		uplink();
+		linkCheckAns(-18 + LMIC.txpow);
+	}
+	printf("link -18 dB: DR %d at %d dBm, %u down\n", LMIC.datarate, LMIC.adrTxPow, LMIC.devAdrDowns);
+	check(LMIC.datarate < DR_SF7 && LMIC.adrTxPow == 14 && -18 + 14 - devAdrReqSnr(LMIC.datarate) >= MARGIN_DB,
+			"weak link steps to a slower DR keeping the margin");
+}
+
+// Changes of a link at the SF8 / SF7 boundary, with fading
+static int changesAtBoundary(u1_t hyst) {
+	setup(DR_SF12, MARGIN_DB, hyst);
+	// SF7 needs -7 dB, with the margin at 14 dBm the boundary is at -11 dB
+	double link = devAdrReqSnr(DR_SF7) + MARGIN_DB - 14 + 0.5;
+	for (int i = 0; i < 500; i++) {
+		uplink();
+		linkCheckAns(link + LMIC.txpow + gauss(FADING_DB));
+	}
+	return LMIC.devAdrUps + LMIC.devAdrDowns;
+}
+
+static void testHysteresis() {
+	srand(2);
+	int without = changesAtBoundary(0);
+	srand(2);
+	int with = changesAtBoundary(HYST_DB);
+	printf("500 uplinks at a DR boundary, %d dB fading: %d changes without hysteresis, %d with %d dB\n", FADING_DB,
+			without, with, HYST_DB);
+	check(with * 2 < without, "hysteresis suppresses flapping at a DR boundary");
+}
+
+// The gateway sends RX2 on 869.525 MHz with 27 dBm, the budget must not look 13 dB better for it
+static void testRx2Power() {
+	check(devAdrGwPow(869525000) == 27 && devAdrGwPow(868100000) == 14, "gateway power per sub band");
+
+	setup(DR_SF12, 0, 0);
+	s1_t rx1;
+	s1_t rx2;
+	for (int i = 0; i < DEVADR_HIST; i++) {
+		uplink();
+		downlink(-20, false, 0);
+	}
+	LMIC_linkBudget(&rx1);
+	setup(DR_SF12, 0, 0);
+	for (int i = 0; i < DEVADR_HIST; i++) {
+		uplink();
+		downlink(-20, true, 0);
+	}
+	LMIC_linkBudget(&rx2);
+	printf("link -20 dB: budget %d dB from RX1 downlinks, %d dB from RX2 downlinks\n", rx1, rx2);
+	check(rx1 == -20 && rx2 == -20, "RX1 and RX2 downlinks give the same budget");
+}
+
+// Unconfirmed uplinks whose downlinks stopped: full power first, then one DR slower per silent run
+static void testSilentBackOff() {
+	setup(DR_SF12, MARGIN_DB, HYST_DB);
+	for (int i = 0; i < 10; i++) {
+		uplink();
+		linkCheckAns(-5 + LMIC.txpow);
+	}
+	dr_t dr = LMIC.datarate;
+	s1_t pow = LMIC.adrTxPow;
+	for (int i = 0; i < DEVADR_SILENT_UPS - 1; i++) {
+		uplink();
+		devAdrNoRx(); // norx path of processDnData()
+	}
+	check(LMIC.datarate == dr && LMIC.adrTxPow == pow, "no change before DEVADR_SILENT_UPS silent uplinks");
+	uplink();
+	devAdrNoRx();
+	check(LMIC.datarate == dr && LMIC.adrTxPow == 14 && LMIC.devAdrCnt == 0, "full power, samples dropped");
+	for (int i = 0; i < DEVADR_SILENT_UPS; i++) {
+		uplink();
+		devAdrNoRx();
+	}
+	check(LMIC.datarate == dr - 1, "then one DR slower");
+	for (int i = 0; i < 10 * DEVADR_SILENT_UPS; i++) {
+		uplink();
+		devAdrNoRx();
+	}
+	check(LMIC.datarate == DR_SF12 && LMIC.adrTxPow == 14, "ends at SF12 full power");
+}
+
+typedef struct {
+	int delivered;
+	double airtimeMs;
+	double txPowMw;
+} runStats_t;
+
+// Uplinks over a link with fading. The network answers 1 in 4 received uplinks with a LinkCheckAns.
+// dr = DR_NONE runs device ADR from SF12.
+static runStats_t run(double link, dr_t dr, int uplinks) {
+	runStats_t st = { 0 };
+	setup(dr == DR_NONE ? DR_SF12 : dr, dr == DR_NONE ? MARGIN_DB : 0, HYST_DB);
+	for (int i = 0; i < uplinks; i++) {
+		uplink();
+		double snr = link + LMIC.txpow + gauss(FADING_DB);
+		st.airtimeMs += osticks2ms(calcAirTime(LMIC.rps, LMIC.dataLen));
+		st.txPowMw += pow(10, LMIC.txpow / 10.0);
+		bool received = snr >= devAdrReqSnr((dr_t) LMIC.txDr);
+		if (received) {
+			st.delivered++;
+		}
+		if (received && rand() % 4 == 0) {
+			linkCheckAns(snr);
+		} else {
+			devAdrNoRx();
+		}
+	}
+	st.airtimeMs /= uplinks;
+	st.txPowMw /= uplinks;
+	return st;
+}
+
+static void benchmark() {
+	printf("%d byte uplinks, %d dB fading, 1 in 4 answered, delivery / airtime ms / TX mW per uplink\n", PAYLOAD,
+			FADING_DB);
+	printf("link dB   device ADR         fixed SF12         fixed SF9          fixed SF7\n");
+	static const dr_t fixed[] = { DR_SF12, DR_SF9, DR_SF7 };
+	bool fewerAirtime = true;
+	bool delivers = true;
+	for (int link = -5; link >= -30; link -= 5) {
+		srand(3);
+		runStats_t adr = run(link, DR_NONE, 1000);
+		printf("%6d  %4.0f%% %5.0f %4.1f", link, adr.delivered / 10.0, adr.airtimeMs, adr.txPowMw);
+		for (int f = 0; f < 3; f++) {
+			srand(3);
+			runStats_t st = run(link, fixed[f], 1000);
+			printf("  %4.0f%% %5.0f %4.1f", st.delivered / 10.0, st.airtimeMs, st.txPowMw);
+			if (fixed[f] == DR_SF12 && adr.airtimeMs > st.airtimeMs) {
+				fewerAirtime = false;
+			}
+			if (fixed[f] == DR_SF12 && adr.delivered + 20 < st.delivered) {
+				delivers = false;
+			}
+		}
+		printf("\n");
+	}
+	check(delivers, "device ADR delivers within 2 % of SF12 on every link");
+	check(fewerAirtime, "device ADR never needs more airtime than SF12");
+}
+
+int main() {
+	testSteps();
+	testHysteresis();
+	testRx2Power();
+	testSilentBackOff();
+	benchmark();
+	return failed != 0;
+}
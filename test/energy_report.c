@@ -0,0 +1,216 @@
+// Battery life report from the energy ledger of energy_lmic.c, run on the host.
+//
+//   gcc -std=gnu99 -O1 -fwrapv -Itest/stubs -I. -Ilmic test/energy_report.c energy_lmic.c test/lmic_host.c lmic/oslmic.c lmic/aes.c -o energy_report
+//   ./energy_report [-p profile.txt] <capacity mAh> <interval s>:<payload bytes>:<SF7..SF12>[:<dBm>] ...
+//
+// Each schedule entry is a class A uplink without downlink, replayed through the ledger with the
+// radio states and MCU wakeups the LMIC task and radio HAL report, RX windows sized by rxWindow().
+// The projection adds the baseline of the profile for the whole day, battery self-discharge is left out. The profile file holds one
+// state per line, "base", "mcu", "standby" and "rx" with uA, "tx" with 16 values for 2 - 17 dBm,
+// # starts a comment. Without arguments it reports a few schedules of LMIC_ENERGY_PROFILE_SX1272
+// and checks the ledger's TX time against calcAirTime().
+
+#include "../lmic/lmic.c"
+#include "drv_lmic.h"
+#include "lmic_host.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// MCU awake before the uplink, frame build and AES
+#define MCU_TX_MS 5
+// Radio in standby before TX, mode change and synthesizer
+#define STANDBY_TX_MS 1
+// MCU awake around each RX window and for EV_TXCOMPLETE
+#define MCU_EVENT_MS 1
+
+#define UPLINKS 100
+#define MAX_ENTRIES 8
+
+typedef struct {
+	uint32_t intervalSec;
+	uint8_t payload;
+	dr_t dr;
+	int8_t txpow;
+} schedule_t;
+
+typedef struct {
+	uint32_t nAh; // above the baseline
+	uint32_t txMs;
+	uint32_t rxMs;
+} uplinkCost_t;
+
+static void advance(uint32_t ticks) {
+	lmic_hostTime += ticks;
+}
+
+// Opens the window rxWindow() sizes delay after the end of the uplink
+static void rx(ostime_t delay, dr_t dr) {
+	rxWindow(delay, dr);
+	advance(LMIC.rxtime - RX_RAMPUP - lmic_hostTime);
+	lmic_energyMcu(true);
+	lmic_energyRadioState(HAL_RADIO_STANDBY, 0);
+	advance(RX_RAMPUP);
+	lmic_energyRadioState(HAL_RADIO_RX, 0);
+	advance(LMIC.rxsyms * 2 * dr2hsym(dr));
+	lmic_energyRadioState(HAL_RADIO_SLEEP, 0);
+	advance(ms2osticks(MCU_EVENT_MS));
+	lmic_energyMcu(false);
+}
+
+static void uplink(const schedule_t* s) {
+	lmic_energyMcu(true);
+	advance(ms2osticks(MCU_TX_MS));
+	lmic_energyRadioState(HAL_RADIO_STANDBY, 0);
+	advance(ms2osticks(STANDBY_TX_MS));
+	lmic_energyRadioState(HAL_RADIO_TX, s->txpow);
+	advance(calcAirTime(updr2rps(s->dr), s->payload + 13));
+	lmic_energyRadioState(HAL_RADIO_SLEEP, 0);
+	lmic_energyMcu(false);
+	LMIC.txend = lmic_hostTime;
+	rx(DELAY_DNW1_osticks, s->dr);
+	rx(DELAY_DNW2_osticks, DR_DNW2);
+	lmic_energyMcu(true);
+	advance(ms2osticks(MCU_EVENT_MS));
+	lmic_energyUplink();
+	lmic_energyMcu(false);
+	advance(sec2osticks(10));
+}
+
+static uplinkCost_t uplinkCost(const lmicEnergyProfile_t* profile, const schedule_t* s) {
+	lmic_hostTime = 0;
+	LMIC_reset();
+	lmic_energyInit(profile);
+	for (int i = 0; i < UPLINKS; i++) {
+		uplink(s);
+	}
+	lmicEnergyStats_t stats;
+	drv_lmic_getEnergyStats(&stats);
+	uplinkCost_t c = { stats.avgUplinkNAh, stats.txMs / UPLINKS, stats.rxMs / UPLINKS };
+	return c;
+}
+
+// Battery life in days, the baseline runs all day
+static double report(const lmicEnergyProfile_t* profile, uint32_t capacityMah, const schedule_t* entries, int n) {
+	double perDayUAh = profile->baseUa * 24.0;
+	printf("interval s  payload  DR  dBm   TX ms   RX ms   nAh/uplink   uAh/day\n");
+	for (int i = 0; i < n; i++) {
+		const schedule_t* s = &entries[i];
+		uplinkCost_t c = uplinkCost(profile, s);
+		double uAh = c.nAh / 1000.0 * 86400 / s->intervalSec;
+		perDayUAh += uAh;
+		printf("%10u  %7u  SF%d  %3d  %6u  %6u  %11u  %8.1f\n", (unsigned) s->intervalSec, s->payload,
+				12 - s->dr, s->txpow, (unsigned) c.txMs, (unsigned) c.rxMs, (unsigned) c.nAh, uAh);
+	}
+	double days = capacityMah * 1000.0 / perDayUAh;
+	printf("baseline %.1f uAh/day, total %.1f uAh/day: %.0f days (%.1f years) on %u mAh\n", profile->baseUa * 24.0,
+			perDayUAh, days, days / 365, (unsigned) capacityMah);
+	return days;
+}
+
+static bool parseEntry(const char* arg, schedule_t* s) {
+	unsigned interval;
+	unsigned payload;
+	unsigned sf;
+	int txpow = 14;
+	if (sscanf(arg, "%u:%u:SF%u:%d", &interval, &payload, &sf, &txpow) < 3) {
+		return false;
+	}
+	if (interval == 0 || payload + 13 > MAX_LEN_FRAME || sf < 7 || sf > 12) {
+		return false;
+	}
+	s->intervalSec = interval;
+	s->payload = payload;
+	s->dr = (dr_t) (12 - sf);
+	s->txpow = txpow;
+	return true;
+}
+
+static bool loadProfile(const char* path, lmicEnergyProfile_t* p) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+	char line[256];
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), f) != NULL) {
+		char key[16];
+		int used;
+		if (line[0] == '#' || sscanf(line, "%15s%n", key, &used) != 1) {
+			continue;
+		}
+		const char* v = line + used;
+		if (strcmp(key, "base") == 0) {
+			ok = sscanf(v, "%u", &p->baseUa) == 1;
+		} else if (strcmp(key, "mcu") == 0) {
+			ok = sscanf(v, "%u", &p->mcuUa) == 1;
+		} else if (strcmp(key, "standby") == 0) {
+			ok = sscanf(v, "%u", &p->standbyUa) == 1;
+		} else if (strcmp(key, "rx") == 0) {
+			ok = sscanf(v, "%u", &p->rxUa) == 1;
+		} else if (strcmp(key, "tx") == 0) {
+			for (int l = 0; l < LMIC_ENERGY_TX_LEVELS && ok; l++) {
+				ok = sscanf(v, "%u%n", &p->txUa[l], &used) == 1;
+				v += used;
+			}
+		} else {
+			ok = false;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+// A few common schedules on 2400 mAh, the exit code reports whether the ledger booked the airtime
+static int defaultReport() {
+	static const uint32_t intervals[] = { 900, 3600, 86400 };
+	static const dr_t drs[] = { DR_SF7, DR_SF9, DR_SF12 };
+	const lmicEnergyProfile_t* profile = &LMIC_ENERGY_PROFILE_SX1272;
+	printf("20 byte uplinks at 14 dBm, baseline %u uA, years on 2400 mAh\n", (unsigned) profile->baseUa);
+	printf("interval s     SF7     SF9    SF12\n");
+	for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+		printf("%10u", (unsigned) intervals[i]);
+		for (size_t d = 0; d < sizeof(drs) / sizeof(drs[0]); d++) {
+			schedule_t s = { intervals[i], 20, drs[d], 14 };
+			uplinkCost_t c = uplinkCost(profile, &s);
+			double perDayUAh = profile->baseUa * 24.0 + c.nAh / 1000.0 * 86400 / intervals[i];
+			printf("  %6.1f", 2400 * 1000.0 / perDayUAh / 365);
+		}
+		printf("\n");
+	}
+	schedule_t s = { 900, 20, DR_SF9, 14 };
+	uplinkCost_t c = uplinkCost(profile, &s);
+	bool ok = c.txMs == osticks2ms(calcAirTime(updr2rps(DR_SF9), 33));
+	printf("%s: ledger TX time matches calcAirTime()\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+	if (argc == 1) {
+		return defaultReport();
+	}
+	lmicEnergyProfile_t profile = LMIC_ENERGY_PROFILE_SX1272;
+	int arg = 1;
+	if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+		if (!loadProfile(argv[2], &profile)) {
+			fprintf(stderr, "bad profile %s\n", argv[2]);
+			return 2;
+		}
+		arg = 3;
+	}
+	if (argc - arg < 2 || argc - arg - 1 > MAX_ENTRIES) {
+		fprintf(stderr, "usage: %s [-p profile.txt] <capacity mAh> <interval s>:<payload>:<SF7..SF12>[:<dBm>] ...\n",
+				argv[0]);
+		return 2;
+	}
+	uint32_t capacityMah = strtoul(argv[arg++], NULL, 10);
+	schedule_t entries[MAX_ENTRIES];
+	int n = 0;
+	for (; arg < argc; arg++) {
+		if (!parseEntry(argv[arg], &entries[n++])) {
+			fprintf(stderr, "bad schedule entry %s\n", argv[arg]);
+			return 2;
+		}
+	}
+	report(&profile, capacityMah, entries, n);
+	return 0;
+}
@@ -0,0 +1,152 @@
+// Host test of the fragmentation FEC decoder in frag_lmic.c against random fragment loss.
+//
+//   gcc -std=gnu99 -O1 -Itest/stubs -I. -Ilmic test/frag_test.c -o frag_test && ./frag_test
+//
+// The encoder follows the TS004 reference (PRBS23 parity lines), independent of the decoder.
+// Without arguments every loss rate below is run with a few seeds and the exit code reports failures,
+// "frag_test <loss> <seed>" runs a single transfer.
+
+#include "../frag_lmic.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NB_FRAG 600
+#define FRAG_SIZE 50
+#define MAX_MISSING 200
+#define MAX_SENT (4 * NB_FRAG)
+
+static uint8_t image[NB_FRAG * FRAG_SIZE];
+static uint8_t store[NB_FRAG * FRAG_SIZE];
+static uint16_t workMem[LMIC_FRAG_WORKMEM_SIZE(NB_FRAG, MAX_MISSING) / 2 + 1];
+static bool completed;
+static uint8_t lastAns[16];
+static size_t lastAnsLen;
+
+// The decoder answers through the LMIC task
+BaseType_t drv_lmic_send(uint8_t port, uint8_t* data, size_t len, TickType_t ticksToWait) {
+	configASSERT(port == LMIC_FRAG_PORT && len <= sizeof(lastAns));
+	memcpy(lastAns, data, len);
+	lastAnsLen = len;
+	return pdTRUE;
+}
+
+bool lmic_txIdle() {
+	return true;
+}
+
+static bool storeWrite(uint32_t offset, const uint8_t* data, uint8_t len, void* ctx) {
+	memcpy(store + offset, data, len);
+	return true;
+}
+
+static bool storeRead(uint32_t offset, uint8_t* data, uint8_t len, void* ctx) {
+	memcpy(data, store + offset, len);
+	return true;
+}
+
+static void onComplete(uint32_t size, uint32_t descriptor, void* ctx) {
+	completed = true;
+}
+
+static uint32_t encPrbs23(uint32_t x) {
+	uint32_t b0 = x & 1;
+	uint32_t b1 = (x & 32) >> 5;
+	return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+// Coded fragment n (1 = first coded one), XOR of the image fragments on its parity line
+static void encode(uint16_t n, uint8_t* out) {
+	uint32_t m = NB_FRAG;
+	uint32_t mod = m + ((m & (m - 1)) == 0 ? 1 : 0);
+	uint32_t x = 1 + 1001 * (uint32_t) n;
+	uint8_t line[(NB_FRAG + 7) / 8] = { 0 };
+	for (uint32_t c = 0; c < m / 2; c++) {
+		uint32_t r;
+		do {
+			x = encPrbs23(x);
+			r = x % mod;
+		} while (r >= m);
+		line[r >> 3] |= 1 << (r & 7);
+	}
+	memset(out, 0, FRAG_SIZE);
+	for (uint32_t i = 0; i < m; i++) {
+		if (line[i >> 3] & (1 << (i & 7))) {
+			for (int b = 0; b < FRAG_SIZE; b++) {
+				out[b] ^= image[i * FRAG_SIZE + b];
+			}
+		}
+	}
+}
+
+// Sends fragments until the image is complete, false if it is not or differs
+static bool transfer(double loss, unsigned seed) {
+	srand(seed);
+	for (size_t i = 0; i < sizeof(image); i++) {
+		image[i] = rand();
+	}
+	memset(store, 0, sizeof(store));
+	completed = false;
+
+	lmicFragCfg_t cfg = {
+		.write = storeWrite,
+		.read = storeRead,
+		.complete = onComplete,
+		.workMem = workMem,
+		.maxFrags = NB_FRAG,
+		.maxMissing = MAX_MISSING,
+		.maxSize = sizeof(store),
+	};
+	drv_lmic_fragInit(&cfg);
+
+	// FragSessionSetupReq: index 0, no groups, NB_FRAG x FRAG_SIZE, no padding
+	uint8_t frame[3 + FRAG_SIZE] = { FRAG_SESSION_SETUP, 0x00, NB_FRAG & 0xFF, NB_FRAG >> 8, FRAG_SIZE, 0, 0, 0, 0, 0, 0 };
+	lastAnsLen = 0;
+	drv_lmic_fragProcess(frame, 11, MCAST_NONE);
+	if (lastAnsLen != 2 || lastAns[0] != FRAG_SESSION_SETUP || lastAns[1] != 0) {
+		printf("loss %.2f seed %u: setup rejected\n", loss, seed);
+		return false;
+	}
+
+	int sent = 0;
+	int received = 0;
+	for (uint16_t n = 1; n <= MAX_SENT && !completed; n++) {
+		sent++;
+		if ((double) rand() / RAND_MAX < loss) {
+			continue;
+		}
+		received++;
+		frame[0] = FRAG_DATA_FRAGMENT;
+		frame[1] = n & 0xFF;
+		frame[2] = n >> 8;
+		if (n <= NB_FRAG) {
+			memcpy(frame + 3, image + (n - 1) * FRAG_SIZE, FRAG_SIZE);
+		} else {
+			encode(n - NB_FRAG, frame + 3);
+		}
+		drv_lmic_fragProcess(frame, sizeof(frame), MCAST_NONE);
+	}
+
+	lmicFragStats_t stats;
+	drv_lmic_fragGetStats(&stats);
+	bool ok = completed && memcmp(store, image, sizeof(image)) == 0;
+	printf("loss %.2f seed %u: %s, sent %d received %d used %u overhead %.3f%s\n", loss, seed, ok ? "ok" : "FAILED",
+			sent, received, stats.used, (double) received / NB_FRAG, stats.memoryShort ? " memory short" : "");
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	if (argc == 3) {
+		return transfer(atof(argv[1]), atoi(argv[2])) ? 0 : 1;
+	}
+	// Up to about 20 % loss stays within MAX_MISSING of NB_FRAG
+	static const double losses[] = { 0.0, 0.05, 0.1, 0.2 };
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+		for (unsigned seed = 1; seed <= 3; seed++) {
+			if (!transfer(losses[i], seed)) {
+				failed++;
+			}
+		}
+	}
+	return failed != 0;
+}
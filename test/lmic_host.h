@@ -0,0 +1,14 @@
+// Host stand-in for the HAL and radio of the LMIC core, see lmic_host.c
+#ifndef TEST_LMIC_HOST_H_
+#define TEST_LMIC_HOST_H_
+
+#include "lmic/lmic.h"
+
+// Current ostick time, advanced by the test
+extern ostime_t lmic_hostTime;
+// Last mode passed to os_radio()
+extern u1_t lmic_hostRadioMode;
+// Receives the events of the LMIC core, NULL = ignore them
+extern void (*lmic_hostEvent)(ev_t ev);
+
+#endif
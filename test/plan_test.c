@@ -0,0 +1,99 @@
+// Host test of the channel plan presets of plan_lmic.c, applied to the LMIC core.
+//
+//   gcc -std=gnu99 -O1 -fwrapv -Itest/stubs -I. -Ilmic test/plan_test.c plan_lmic.c test/lmic_host.c lmic/oslmic.c lmic/aes.c -o plan_test && ./plan_test
+//
+// A device sends as often as the duty cycle allows for an hour, channel and time by nextTx() and
+// updateTx() as engineUpdate() uses them. Reports the uplink rate per preset and data rate and
+// checks the airtime per ETSI sub band against its duty cycle.
+
+#include "../lmic/lmic.c"
+#include "drv_lmic.h"
+#include "lmic_host.h"
+#include <stdio.h>
+
+#define PAYLOAD 20
+#define RUN_SEC 3600
+// End of the RX windows after the uplink, the next one is scheduled from there
+#define RX_END_MS 3000
+
+static int failed;
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+// Uplinks within RUN_SEC, *airtimeMs gets the airtime per band
+static int uplinksPerHour(const lmicChannelPlan_t* plan, dr_t dr, uint32_t airtimeMs[MAX_BANDS]) {
+	lmic_hostTime = 0x7FF00000; // runs across the ostime_t wrap
+	LMIC_reset();
+	lmic_applyChannelPlan(plan, false);
+	LMIC.datarate = dr;
+	LMIC.rps = updr2rps(dr);
+	LMIC.dataLen = PAYLOAD + 13;
+	memset(airtimeMs, 0, MAX_BANDS * sizeof(airtimeMs[0]));
+
+	const ostime_t airtime = calcAirTime(LMIC.rps, LMIC.dataLen);
+	const ostime_t end = lmic_hostTime + sec2osticks(RUN_SEC);
+	int uplinks = 0;
+	while (1) {
+		ostime_t txbeg = nextTx(lmic_hostTime);
+		if (txbeg - lmic_hostTime > 0) {
+			lmic_hostTime = txbeg;
+		}
+		if (lmic_hostTime + airtime - end > 0) {
+			return uplinks;
+		}
+		updateTx(lmic_hostTime);
+		airtimeMs[LMIC.channelFreq[LMIC.txChnl] & 0x3] += osticks2ms(airtime);
+		uplinks++;
+		lmic_hostTime += airtime + ms2osticks(RX_END_MS);
+	}
+}
+
+int main() {
+	static const struct {
+		const char* name;
+		const lmicChannelPlan_t* plan;
+	} plans[] = {
+		{ "3CH", &LMIC_PLAN_EU868_3CH },
+		{ "8CH", &LMIC_PLAN_EU868_8CH },
+		{ "16CH", &LMIC_PLAN_EU868_16CH },
+	};
+	static const dr_t drs[] = { DR_SF12, DR_SF9, DR_SF7 };
+	int rate[3][3];
+	bool dutyOk = true;
+
+	printf("%d byte uplinks per hour, as fast as the duty cycle allows\n", PAYLOAD);
+	printf("plan   SF12   SF9   SF7\n");
+	for (int p = 0; p < 3; p++) {
+		check(drv_lmic_validateChannelPlan(plans[p].plan) == LMIC_PLAN_OK, plans[p].name);
+		printf("%-4s", plans[p].name);
+		for (int d = 0; d < 3; d++) {
+			uint32_t airtimeMs[MAX_BANDS];
+			rate[p][d] = uplinksPerHour(plans[p].plan, drs[d], airtimeMs);
+			printf("  %5d", rate[p][d]);
+			// One uplink may end the hour after its band opened again
+			uint32_t oneMs = osticks2ms(calcAirTime(updr2rps(drs[d]), PAYLOAD + 13));
+			for (int b = 0; b < MAX_BANDS; b++) {
+				uint16_t cap = plans[p].plan->bands[b].txCap;
+				if (cap != 0 && airtimeMs[b] > RUN_SEC * 1000 / cap + oneMs) {
+					dutyOk = false;
+				}
+			}
+		}
+		printf("\n");
+	}
+	check(dutyOk, "airtime per sub band within its duty cycle");
+	bool scales = true;
+	for (int d = 0; d < 3; d++) {
+		// The 8 channel plan adds the 1% of 865 - 868 MHz, the 16 channel plan the 0.1% of 868.7 - 869.2 MHz
+		if (rate[1][d] < 2 * rate[0][d] * 9 / 10 || rate[2][d] <= rate[1][d]) {
+			scales = false;
+		}
+	}
+	check(scales, "uplink rate scales with the sub bands of the plan");
+	return failed != 0;
+}
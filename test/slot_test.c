@@ -0,0 +1,212 @@
+// Host test of the time slotted uplinks: the slot hash of time_lmic.c and nextSlot() of lmic.c.
+//
+//   gcc -std=gnu99 -O1 -fwrapv -Itest/stubs -I. -Ilmic test/slot_test.c test/lmic_host.c lmic/oslmic.c lmic/aes.c -o slot_test && ./slot_test
+//
+// Besides the checks it reports the collision rate of N devices sending once per period on timers of
+// random phase, right away (ALOHA) and in their slot, with the slot grids of the devices off by up to
+// the given error. Two uplinks collide when they overlap on the same channel, capture is ignored.
+
+#include "../lmic/lmic.c"
+#include "../time_lmic.c"
+#include "lmic_host.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PERIOD_SEC 900
+#define PAYLOAD 20
+#define CHANNELS 3 // EU868 default channels
+#define ROUNDS 20
+#define TIMER_JITTER_MS 1000
+#define NETWORKS 5
+#define MAX_DEVICES 1500
+#define MAX_UPLINKS (MAX_DEVICES * ROUNDS)
+
+static int failed;
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+static uint32_t rand32() {
+	return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+// Window start and in window are checked across the ostime_t wrap
+static void testNextSlot() {
+	const ostime_t period = sec2osticks(PERIOD_SEC);
+	const ostime_t offset = ms2osticks(123456);
+	const ostime_t width = ms2osticks(200);
+	const ostime_t epoch = 0x7FFF0000;
+	LMIC_setTxSlots(epoch, period, offset, width);
+
+	bool ok = true;
+	for (int i = 0; i < 100000; i++) {
+		ostime_t t = epoch + (ostime_t) (rand32() % (uint32_t) (20 * period)) - 10 * period;
+		ostime_t r = LMIC_nextTxSlot(t);
+		ostime_t d = (r - epoch - offset) % period;
+		if (d < 0) {
+			d += period;
+		}
+		ostime_t tIn = (t - epoch - offset) % period;
+		if (tIn < 0) {
+			tIn += period;
+		}
+		if (r - t < 0 || r - t >= period || d >= width || (tIn < width && r != t) || (tIn >= width && d != 0)) {
+			ok = false;
+		}
+	}
+	check(ok, "nextSlot() returns the time itself in the window, else the next window start");
+
+	LMIC_setTxSlots(0, 0, 0, 0);
+	check(LMIC_nextTxSlot(12345) == 12345, "no slots, no delay");
+}
+
+// Devices sharing a slot, out of n
+static int sharedSlots(int n, uint32_t slots, bool consecutive) {
+	static uint8_t used[UINT16_MAX];
+	memset(used, 0, sizeof(used));
+	uint32_t base = rand32();
+	int shared = 0;
+	for (int i = 0; i < n; i++) {
+		uint32_t slot = lmic_slotIndex(consecutive ? base + i : rand32(), slots);
+		if (used[slot]++) {
+			shared++;
+		}
+	}
+	return shared;
+}
+
+static void testSlotIndex() {
+	bool inRange = true;
+	for (int i = 0; i < 100000; i++) {
+		uint32_t slots = 1 + rand32() % UINT16_MAX;
+		if (lmic_slotIndex(rand32(), slots) >= slots) {
+			inRange = false;
+		}
+	}
+	check(inRange, "slot index below the slot count");
+
+	int consecutive = sharedSlots(1000, 2250, true);
+	int random = sharedSlots(1000, 2250, false);
+	printf("1000 devices in 2250 slots: %d share a slot with consecutive DevAddrs, %d with random ones\n",
+			consecutive, random);
+	check(consecutive == 0, "consecutive DevAddrs spread over the whole period");
+}
+
+typedef struct {
+	int64_t start;
+	int64_t end;
+	uint8_t ch;
+} uplink_t;
+
+static uplink_t uplinks[MAX_UPLINKS];
+
+static int byStart(const void* a, const void* b) {
+	int64_t d = ((const uplink_t*) a)->start - ((const uplink_t*) b)->start;
+	return d < 0 ? -1 : d > 0;
+}
+
+// Share of uplinks overlapping another one on the same channel. Each device sends once per period
+// by its timer, slots = 0 right away, otherwise in the first window after it. DevAddrs are random or
+// consecutive, as a network server hands them out. gridErrorMs < 0 leaves the device grids unaligned,
+// i.e. on the local clock only.
+static double collisionRate(int devices, uint32_t slots, bool consecutive, int gridErrorMs, ostime_t airtime) {
+	const ostime_t period = sec2osticks(PERIOD_SEC);
+	uint32_t base = rand32();
+	int n = 0;
+	for (int dev = 0; dev < devices; dev++) {
+		if (slots != 0) {
+			uint32_t slot = lmic_slotIndex(consecutive ? base + dev : rand32(), slots);
+			ostime_t gridError = 0;
+			if (gridErrorMs < 0) {
+				gridError = (ostime_t) (rand32() % (uint32_t) period);
+			} else if (gridErrorMs > 0) {
+				gridError = ms2osticks((int32_t) (rand32() % (2 * gridErrorMs + 1)) - gridErrorMs);
+			}
+			uint32_t slotMs = PERIOD_SEC * 1000 / slots;
+			LMIC_setTxSlots(0x7FFF0000 + gridError, period, ms2osticks(slot * slotMs), ms2osticks(slotMs / 2));
+		}
+		// Report timer of the device, random phase and some jitter
+		int64_t phase = rand32() % (uint32_t) period;
+		for (int round = 0; round < ROUNDS; round++) {
+			int64_t start = (int64_t) round * period + phase + ms2osticks(rand() % (2 * TIMER_JITTER_MS + 1));
+			if (slots != 0) {
+				ostime_t t = (ostime_t) (0x7FFF0000 + start);
+				start += LMIC_nextTxSlot(t) - t;
+			}
+			uplinks[n].start = start;
+			uplinks[n].end = start + airtime;
+			uplinks[n].ch = rand() % CHANNELS;
+			n++;
+		}
+	}
+	qsort(uplinks, n, sizeof(uplinks[0]), byStart);
+
+	int collided = 0;
+	for (int i = 0; i < n; i++) {
+		bool hit = false;
+		for (int j = i - 1; j >= 0 && uplinks[j].start > uplinks[i].start - airtime && !hit; j--) {
+			hit = uplinks[j].ch == uplinks[i].ch;
+		}
+		for (int j = i + 1; j < n && uplinks[j].start < uplinks[i].end && !hit; j++) {
+			hit = uplinks[j].ch == uplinks[i].ch;
+		}
+		if (hit) {
+			collided++;
+		}
+	}
+	return (double) collided / n;
+}
+
+// Mean over a few networks, a single one depends much on its draw of phases and addresses
+static double meanCollisionRate(int devices, uint32_t slots, bool consecutive, int gridErrorMs, ostime_t airtime) {
+	double sum = 0;
+	for (int i = 0; i < NETWORKS; i++) {
+		sum += collisionRate(devices, slots, consecutive, gridErrorMs, airtime);
+	}
+	return sum / NETWORKS;
+}
+
+static void testCollisions() {
+	ostime_t airtime = calcAirTime(updr2rps(DR_SF9), PAYLOAD + 13);
+	// Twice the airtime, the uplink starts in the first half of the slot
+	uint32_t slotMs = (osticks2ms(2 * airtime) + 99) / 100 * 100;
+	uint32_t slots = PERIOD_SEC * 1000 / slotMs;
+	printf("%d byte uplinks at SF9 (%d ms) every %d s on %d channels, %u slots of %u ms, collided uplinks:\n",
+			PAYLOAD, (int) osticks2ms(airtime), PERIOD_SEC, CHANNELS, (unsigned) slots, (unsigned) slotMs);
+	printf("                   random DevAddr  consecutive DevAddr\n");
+	printf("devices   ALOHA    synced          synced  +-100 ms  +-1 s  local grid\n");
+	static const int devices[] = { 100, 500, 1000, 1500 };
+	bool fewer = true;
+	bool rare = true;
+	for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+		int n = devices[i];
+		double aloha = meanCollisionRate(n, 0, false, 0, airtime);
+		double random = meanCollisionRate(n, slots, false, 0, airtime);
+		double synced = meanCollisionRate(n, slots, true, 0, airtime);
+		double err100 = meanCollisionRate(n, slots, true, 100, airtime);
+		double err1000 = meanCollisionRate(n, slots, true, 1000, airtime);
+		double local = meanCollisionRate(n, slots, true, -1, airtime);
+		printf("%7d  %5.1f%%  %7.1f%%  %14.1f%%  %7.1f%%  %4.1f%%  %9.1f%%\n", n, 100 * aloha, 100 * random,
+				100 * synced, 100 * err100, 100 * err1000, 100 * local);
+		if (err100 > aloha / 4) {
+			fewer = false;
+		}
+		if (n <= 1000 && synced > 0.01) {
+			rare = false;
+		}
+	}
+	check(rare, "below 1 % collisions up to 1000 devices with consecutive DevAddrs on a synced grid");
+	check(fewer, "a 100 ms grid error keeps collisions below a quarter of ALOHA");
+}
+
+int main() {
+	srand(1);
+	testNextSlot();
+	testSlotIndex();
+	testCollisions();
+	return failed != 0;
+}
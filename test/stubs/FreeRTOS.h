@@ -0,0 +1,26 @@
+// Host stand-in for the FreeRTOS types used by drv_lmic.h, enough for the tests in test/
+#ifndef TEST_STUBS_FREERTOS_H_
+#define TEST_STUBS_FREERTOS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TimerHandle_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffffUL
+
+#define configASSERT(x) assert(x)
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+
+#endif
@@ -0,0 +1 @@
+// Nothing of the board HAL is needed on the host
@@ -0,0 +1,219 @@
+// Host test of the network time in time_lmic.c.
+//
+//   gcc -std=gnu99 -O1 -Itest/stubs -I. -Ilmic test/time_test.c -o time_test && ./time_test
+//
+// The ostick clock is simulated, lmic_timeUpdate() runs whenever the LMIC task would wake up.
+// Sleep phases follow the NOTIFY_SLEEP / NOTIFY_WAKE handling of the LMIC task.
+
+#include "../time_lmic.c"
+#include <stdio.h>
+
+struct lmic_t LMIC;
+
+static ostime_t now;
+static int timeRequests;
+static int requestsTotal;
+static int failed;
+
+ostime_t os_getTime() {
+	return now;
+}
+
+void LMIC_requestNetworkTime() {
+	timeRequests++;
+}
+
+static void check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok) {
+		failed++;
+	}
+}
+
+// DeviceTimeAns of net osticks since the GPS epoch, referring to local time ref
+static void sync(uint64_t net, ostime_t ref) {
+	LMIC.netTimeSec = (u4_t) (net / OSTICKS_PER_SEC);
+	LMIC.netTimeFrac = (u1_t) (net % OSTICKS_PER_SEC / FRAC_TICKS);
+	LMIC.netTimeRef = ref;
+	LMIC.netTimeNew = 1;
+	lmic_timeUpdate();
+}
+
+static uint64_t networkTicks() {
+	lmicNetworkTime_t t;
+	if (!drv_lmic_networkTime(&t)) {
+		return 0;
+	}
+	return (uint64_t) t.seconds * OSTICKS_PER_SEC + ms2osticks(t.ms);
+}
+
+// Idle device without jobs: the task only wakes up for lmic_timeIdleMaxSec(), far apart
+// compared to the ~18.2 h until an ostime_t difference wraps.
+static void testIdleGap() {
+	memset(&clk, 0, sizeof(clk));
+	now = 0x70000000; // crosses the signed and the unsigned wrap of ostime_t
+	uint64_t net0 = (uint64_t) 1300000000 * OSTICKS_PER_SEC;
+	sync(net0, now);
+	check(lmic_timeIdleMaxSec() != 0 && lmic_timeIdleMaxSec() < 18 * 3600, "idle limit while the time is valid");
+
+	uint64_t elapsed = 0;
+	bool exact = true;
+	bool epochOk = true;
+	const ostime_t period = sec2osticks(900);
+	while (elapsed < (uint64_t) 48 * 3600 * OSTICKS_PER_SEC) {
+		ostime_t step = sec2osticks(lmic_timeIdleMaxSec());
+		now += step;
+		elapsed += (uint32_t) step;
+		lmic_timeUpdate();
+		int64_t err = (int64_t) networkTicks() - (int64_t) (net0 + elapsed);
+		if (err < -ms2osticks(1) || err > ms2osticks(1)) {
+			exact = false;
+		}
+		ostime_t epoch;
+		if (!lmic_timeEpoch(period, &epoch) || (net0 + elapsed - (uint64_t) (now - epoch)) % period != 0) {
+			epochOk = false;
+		}
+	}
+	check(exact, "network time over a 48 h idle gap");
+	check(epochOk, "time epoch over a 48 h idle gap");
+
+	memset(&clk, 0, sizeof(clk));
+	check(lmic_timeIdleMaxSec() == 0, "no idle limit without network time");
+}
+
+// Device with a clock running fast by ppm. The ostick clock stands still while asleep, the
+// 1 s RTC runs from the same crystal and is read as whole seconds.
+static struct {
+	double ppm;
+	double real; // s
+	double rtc; // s, fraction unknown to the device
+	uint64_t net0;
+	double tickFrac;
+} dev;
+
+static void devInit(double ppm) {
+	memset(&clk, 0, sizeof(clk));
+	memset(&dev, 0, sizeof(dev));
+	dev.ppm = ppm;
+	dev.rtc = 0.37;
+	dev.net0 = (uint64_t) 1300000000 * OSTICKS_PER_SEC;
+	now = 0x12345678;
+	timeRequests = 0;
+}
+
+static uint64_t devNet() {
+	return dev.net0 + (uint64_t) (dev.real * OSTICKS_PER_SEC + 0.5);
+}
+
+static void devAwake(double sec) {
+	double ticks = sec * OSTICKS_PER_SEC * (1 + dev.ppm / 1e6) + dev.tickFrac;
+	now += (ostime_t) ticks;
+	dev.tickFrac = ticks - (ostime_t) ticks;
+	dev.real += sec;
+	dev.rtc += sec * (1 + dev.ppm / 1e6);
+	lmic_timeUpdate();
+}
+
+// As the LMIC task does it on NOTIFY_SLEEP / NOTIFY_WAKE
+static void devSleep(double sec) {
+	uint32_t rtcStart = (uint32_t) dev.rtc;
+	dev.real += sec;
+	dev.rtc += sec * (1 + dev.ppm / 1e6);
+	uint32_t slept = (uint32_t) dev.rtc - rtcStart;
+	uint32_t skip = slept > 3600 ? 3600 : slept;
+	ostime_t stopped = now;
+	now += (ostime_t) (((uint32_t) sec2osticks(skip) >> 16) << 16); // lmic_hal_increase_systicks()
+	lmic_timeSleep(stopped, slept);
+	lmic_timeUpdate();
+}
+
+static void devSync() {
+	sync(devNet(), now);
+}
+
+static int64_t devErrorMs() {
+	return ((int64_t) networkTicks() - (int64_t) devNet()) * 1000 / OSTICKS_PER_SEC;
+}
+
+// A class A device reporting every 15 min sleeps in between, the time continues over the
+// sleep phases and is only requested again once their RTC error exceeds the limit
+static void testSleep() {
+	devInit(0);
+	devSync();
+	int firstRequest = 0;
+	bool withinError = true;
+	bool valid = true;
+	for (int cycle = 1; cycle <= 96; cycle++) { // 24 h
+		devAwake(5);
+		devSleep(895 + (cycle % 7) * 0.13);
+		lmicTimeStats_t stats;
+		drv_lmic_getTimeStats(&stats);
+		int64_t err = devErrorMs();
+		if (err < -(int64_t) stats.errorMs - 1 || err > (int64_t) stats.errorMs + 1) {
+			withinError = false;
+		}
+		if (networkTicks() == 0) {
+			valid = false;
+		}
+		if (timeRequests != 0) {
+			// The network answers with the next uplink
+			if (firstRequest == 0) {
+				firstRequest = cycle;
+			}
+			timeRequests = 0;
+			devAwake(1);
+			devSync();
+			requestsTotal++;
+		}
+	}
+	printf("15 min reports over 24 h: %d DeviceTimeReq, the first after %d sleep phases\n", requestsTotal, firstRequest);
+	check(valid, "network time valid over sleep phases");
+	check(withinError, "error within the reported sleep error");
+	check(firstRequest > 10 && requestsTotal <= 96 / 10, "DeviceTimeReq only once the sleep error adds up");
+}
+
+// The trim is measured over awake time only, sleep phases neither enter nor disturb it
+static void testTrim() {
+	lmicTimeStats_t stats;
+
+	devInit(40);
+	devSync();
+	for (int h = 0; h < 5; h++) {
+		devAwake(3600);
+	}
+	devSync();
+	drv_lmic_getTimeStats(&stats);
+	printf("awake 5 h at +40 ppm: trims %u, ppm %d\n", stats.trims, stats.ppm);
+	check(stats.trims == 1 && stats.ppm >= 39 && stats.ppm <= 41, "trim of an awake device");
+
+	devInit(40);
+	devSync();
+	for (int h = 0; h < 30; h++) {
+		devAwake(3600);
+		if (h == 10) {
+			devSleep(600.5);
+		}
+	}
+	devSync();
+	drv_lmic_getTimeStats(&stats);
+	printf("awake 30 h with one sleep phase at +40 ppm: trims %u, ppm %d\n", stats.trims, stats.ppm);
+	check(stats.trims == 1 && stats.ppm >= 28 && stats.ppm <= 52, "sleep phase left out of the trim");
+
+	devInit(40);
+	devSync();
+	for (int cycle = 0; cycle < 16; cycle++) {
+		devAwake(5);
+		devSleep(895.3);
+	}
+	devSync();
+	drv_lmic_getTimeStats(&stats);
+	printf("15 min reports over 4 h at +40 ppm: trims %u, ppm %d\n", stats.trims, stats.ppm);
+	check(stats.trims == 0 && stats.ppm == 0, "no trim below the RTC resolution");
+}
+
+int main() {
+	testIdleGap();
+	testSleep();
+	testTrim();
+	return failed != 0;
+}
@@ -0,0 +1,193 @@
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+
+// Network time from DeviceTimeAns, extrapolated with the ostick clock
+
+// Sync points closer than this are not used to trim the rate, the answer only has 1/256 s resolution
+#define TIME_TRIM_MIN_SEC (4 * 3600)
+// A larger rate error points to a bad answer, not to the LSE
+#define TIME_TRIM_MAX_PPM 500
+// Differences to the reference are int32_t osticks, valid for 2^31 ticks (~18.2 h at 32768 Hz).
+// The reference is moved forward after a job batch once it is this old, the LMIC task wakes up
+// at least this often while the time is valid, see lmic_timeIdleMaxSec().
+#define TIME_REBASE_SEC 3600
+
+// A new DeviceTimeReq is attached once the error added by sleep phases exceeds this
+#ifndef LMIC_TIME_MAX_ERROR_MS
+#define LMIC_TIME_MAX_ERROR_MS 5000
+#endif
+// Rate trims whose error from sleep phases exceeds this are skipped, no better than the crystal spec
+#define TIME_TRIM_RES_PPM 20
+
+#define FRAC_TICKS (OSTICKS_PER_SEC / 256)
+
+static struct {
+	bool valid;
+	uint64_t net; // GPS time at ref, osticks since the GPS epoch
+	ostime_t ref;
+	uint64_t syncNet; // GPS time of the last sync
+	uint64_t trimNet; // GPS time of the trim anchor
+	int64_t trimTicks; // local osticks from the trim anchor to ref, without sleep phases
+	uint64_t trimSleep; // GPS time asleep since the trim anchor
+	uint32_t trimSleeps; // sleep phases since the trim anchor
+	uint32_t sleeps; // sleep phases since the last sync
+	int32_t ppm; // local clock runs fast by ppm
+	uint32_t syncs;
+	uint32_t trims;
+	int32_t lastErrorMs;
+} clk;
+
+// Network time at local time t, call in a critical section
+static uint64_t netAt(ostime_t t) {
+	int32_t dt = t - clk.ref;
+	return (uint64_t) ((int64_t) clk.net + dt - (int64_t) dt * clk.ppm / 1000000);
+}
+
+// An RTC delta is off by less than 1 s, triangular with sigma^2 = 1/6 s^2. 3 sigma of n phases in ms.
+static uint32_t sleepErrorMs(uint32_t n) {
+	uint64_t v = (uint64_t) n * 1500000; // (3 sigma)^2 in ms^2
+	uint64_t r = 0;
+	for (uint64_t b = (uint64_t) 1 << 62; b != 0; b >>= 2) {
+		if (v >= r + b) {
+			v -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+	}
+	return (uint32_t) r;
+}
+
+static void moveRef(ostime_t t) {
+	clk.trimTicks += (int32_t) (t - clk.ref);
+	clk.net = netAt(t);
+	clk.ref = t;
+}
+
+static void resetTrim(uint64_t net) {
+	clk.trimNet = net;
+	clk.trimTicks = 0;
+	clk.trimSleep = 0;
+	clk.trimSleeps = 0;
+}
+
+// Runs in the LMIC task after each job batch
+void lmic_timeUpdate() {
+	ostime_t now = os_getTime();
+	taskENTER_CRITICAL();
+	if (clk.valid && now - clk.ref > sec2osticks(TIME_REBASE_SEC)) {
+		moveRef(now);
+	}
+	taskEXIT_CRITICAL();
+
+	if (!LMIC.netTimeNew) {
+		return;
+	}
+	LMIC.netTimeNew = 0;
+	uint64_t net = (uint64_t) LMIC.netTimeSec * OSTICKS_PER_SEC + LMIC.netTimeFrac * FRAC_TICKS;
+	ostime_t ref = LMIC.netTimeRef;
+
+	taskENTER_CRITICAL();
+	if (!clk.valid) {
+		resetTrim(net);
+	} else {
+		clk.lastErrorMs = (int32_t) (((int64_t) netAt(ref) - (int64_t) net) * 1000 / OSTICKS_PER_SEC);
+		moveRef(ref);
+		// Awake time only, the RTC error of the sleep phases must stay small against it
+		int64_t dNet = (int64_t) (net - clk.trimNet - clk.trimSleep);
+		int64_t dNetMs = dNet * 1000 / OSTICKS_PER_SEC;
+		if (dNet >= (int64_t) TIME_TRIM_MIN_SEC * OSTICKS_PER_SEC
+				&& (int64_t) sleepErrorMs(clk.trimSleeps) * 1000000 <= TIME_TRIM_RES_PPM * dNetMs) {
+			int32_t ppm = (int32_t) ((clk.trimTicks - dNet) * 1000000 / dNet);
+			if (ppm >= -TIME_TRIM_MAX_PPM && ppm <= TIME_TRIM_MAX_PPM) {
+				clk.ppm = ppm;
+				clk.trims++;
+			}
+			resetTrim(net);
+		}
+	}
+	clk.net = net;
+	clk.ref = ref;
+	clk.syncNet = net;
+	clk.sleeps = 0;
+	clk.valid = true;
+	clk.syncs++;
+	taskEXIT_CRITICAL();
+}
+
+// Longest the LMIC task may block without a job, 0 = no limit
+uint32_t lmic_timeIdleMaxSec() {
+	return clk.valid ? TIME_REBASE_SEC : 0;
+}
+
+// The ostick clock stood still over a sleep phase of sleptSec by the 1 s RTC, it was stopped at
+// before and has been moved forward since (in 2 s steps, capped). The network time continues by
+// the RTC, which runs from the same LSE, the phase is left out of the rate trim. Once the RTC
+// error adds up to LMIC_TIME_MAX_ERROR_MS the next uplink asks the network again.
+void lmic_timeSleep(ostime_t before, uint32_t sleptSec) {
+	ostime_t now = os_getTime();
+	taskENTER_CRITICAL();
+	if (!clk.valid) {
+		taskEXIT_CRITICAL();
+		return;
+	}
+	moveRef(before);
+	int64_t slept = (int64_t) sleptSec * OSTICKS_PER_SEC;
+	slept -= slept * clk.ppm / 1000000;
+	clk.net += slept;
+	clk.ref = now;
+	clk.trimSleep += slept;
+	clk.trimSleeps++;
+	clk.sleeps++;
+	bool resync = sleepErrorMs(clk.sleeps) > LMIC_TIME_MAX_ERROR_MS;
+	taskEXIT_CRITICAL();
+	if (resync) {
+		LMIC_requestNetworkTime();
+	}
+}
+
+// Local time at which the network time was the last multiple of period, false without network time
+bool lmic_timeEpoch(ostime_t period, ostime_t* epoch) {
+	ostime_t now = os_getTime();
+	taskENTER_CRITICAL();
+	bool valid = clk.valid;
+	uint64_t net = netAt(now);
+	taskEXIT_CRITICAL();
+	if (!valid) {
+		return false;
+	}
+	*epoch = now - (ostime_t) (net % (uint64_t) period);
+	return true;
+}
+
+// Slot of a device among slots, a Fibonacci hash of the DevAddr: consecutive addresses spread
+// over the whole period, checked by test/slot_test.c
+uint16_t lmic_slotIndex(uint32_t devaddr, uint32_t slots) {
+	return (uint16_t) (((uint64_t) (devaddr * 2654435761u) * slots) >> 32);
+}
+
+bool drv_lmic_networkTime(lmicNetworkTime_t* time) {
+	ostime_t now = os_getTime();
+	taskENTER_CRITICAL();
+	bool valid = clk.valid;
+	uint64_t net = netAt(now);
+	taskEXIT_CRITICAL();
+	if (!valid) {
+		return false;
+	}
+	time->seconds = (uint32_t) (net / OSTICKS_PER_SEC);
+	time->ms = (uint16_t) ((net % OSTICKS_PER_SEC) * 1000 / OSTICKS_PER_SEC);
+	return true;
+}
+
+void drv_lmic_getTimeStats(lmicTimeStats_t* stats) {
+	ostime_t now = os_getTime();
+	taskENTER_CRITICAL();
+	stats->syncs = clk.syncs;
+	stats->trims = clk.trims;
+	stats->ppm = clk.ppm;
+	stats->lastErrorMs = clk.lastErrorMs;
+	stats->ageSec = clk.valid ? (uint32_t) ((netAt(now) - clk.syncNet) / OSTICKS_PER_SEC) : 0;
+	stats->errorMs = clk.valid ? sleepErrorMs(clk.sleeps) : 0;
+	taskEXIT_CRITICAL();
+}
@@ -0,0 +1,137 @@
+#include "trace_lmic.h"
+#include "drv_lmic.h"
+#include "lmic/lmic.h"
+#include "github.com/Lobaro/c-utils/logging.h"
+
+#if (LMIC_TRACE_RING_SIZE & (LMIC_TRACE_RING_SIZE - 1)) != 0
+#error "LMIC_TRACE_RING_SIZE must be a power of two"
+#endif
+
+static const char* const formats[TRACE_ID_COUNT] = {
+	[TRACE_TASK_CREATED] = "LMIC LoRaWAN Task created. Not started yet!\n",
+	[TRACE_TASK_STARTED] = "LMIC LoRaWAN Task started.\n",
+	[TRACE_NETWORK_INFO] = "netid = %d, Dev Addr: %08x\n",
+	[TRACE_INVALID_TXPOWER] = "invalid START_POWER %d (must be 0...14dbm)! using 14dbm...\n",
+	[TRACE_DR_TXPOW] = "Spreading Factor: %d, TxPower: %d dBm\n",
+	[TRACE_ADR] = "LMIC ADR: %d, device ADR margin: %d dB\n",
+	[TRACE_JOIN_STARTED] = "OTAA Network join started!\n",
+	[TRACE_ALREADY_JOINED] = "OTAA Network already joined!\n",
+	[TRACE_ABP_JOINED] = "ABP join done\n",
+	[TRACE_ALREADY_SLEEPING] = "- lmic already sleeping\n",
+	[TRACE_ALREADY_RUNNING] = "+ lmic already running\n",
+	[TRACE_SLEEPING] = "- lmic sleeping\n",
+	[TRACE_SKIP_SECONDS] = "LMIC: Skipping %d seconds that we were sleeping\n",
+	[TRACE_RUNNING] = "+ lmic running\n",
+	[TRACE_SEND_QUEUED] = "lmic: Sending queued packet (port %d, len %d)\n",
+	[TRACE_SX_IRQ] = "SX irq %d\n",
+	[TRACE_ASSERT_CALLED] = "lmic ASSERT called!\n",
+	[TRACE_EV_JOINED] = "Join Done.\n",
+	[TRACE_EV_JOINING] = "OTAA join started\n",
+	[TRACE_EV_RESET] = "stack reset!\n",
+	[TRACE_EV_TXCOMPLETE] = "tx done (fc: %d)!\n",
+	[TRACE_EV_RXDATA] = "Rxed Data port %d, len %d, head %08x\n",
+	[TRACE_EV_RXCOMPLETE] = "rx done!\n",
+	[TRACE_EV_UNHANDLED] = "unhandeld net event: %d [%x]\n",
+	[TRACE_TICKS_PER_SEC] = "Ticks per sec: ~%d\n",
+	// On the 32 bit target the file name pointer fits into an argument
+	[TRACE_HAL_ASSERT] = "LMIC ASSERT: %d:%s\n",
+	[TRACE_EV_JOIN_FAILED] = "Join failed!\n",
+	[TRACE_DOWNLINK_OVERRUN] = "lmic: downlink handler for port %d (id %d) overran its budget (%d ms)\n",
+	[TRACE_DOWNLINK_UNHANDLED] = "lmic: no handler for downlink on port %d (len %d)\n",
+	[TRACE_CHANNEL_PLAN] = "lmic: channel plan applied (%d channels, mask %04x)\n",
+	[TRACE_TX_RATE] = "lmic: uplink DR %d at %d dBm, ~%d ms airtime\n",
+};
+
+static struct {
+	uint32_t head; // next index to reserve
+	uint32_t tail; // next index to consume
+	uint32_t dropped;
+	lmicTraceEntry_t entries[LMIC_TRACE_RING_SIZE];
+} ring;
+
+#if LMIC_TRACE_LEVEL > LMIC_TRACE_LEVEL_NONE
+void lmic_trace(uint8_t id, uint32_t a0, uint32_t a1, uint32_t a2) {
+	uint32_t idx = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+	lmicTraceEntry_t* e = &ring.entries[idx & (LMIC_TRACE_RING_SIZE - 1)];
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->id = id;
+	e->time = os_getTime();
+	e->args[0] = a0;
+	e->args[1] = a1;
+	e->args[2] = a2;
+	__atomic_store_n(&e->seq, idx + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+bool lmic_tracePop(lmicTraceEntry_t* entry) {
+	for (;;) {
+		uint32_t tail = ring.tail;
+		uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			return false;
+		}
+		if (head - tail > LMIC_TRACE_RING_SIZE) {
+			// Producers lapped us, skip what was overwritten
+			ring.dropped += head - tail - LMIC_TRACE_RING_SIZE;
+			ring.tail = head - LMIC_TRACE_RING_SIZE;
+			continue;
+		}
+
+		lmicTraceEntry_t* e = &ring.entries[tail & (LMIC_TRACE_RING_SIZE - 1)];
+		uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (seq != tail + 1) {
+			if ((int32_t) (seq - (tail + 1)) > 0) {
+				continue; // overwritten meanwhile, head moved on as well
+			}
+			return false; // reserved but not yet committed
+		}
+		*entry = *e;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+			continue; // overwritten while copying
+		}
+		ring.tail = tail + 1;
+		return true;
+	}
+}
+
+const char* lmic_traceFormat(uint8_t id) {
+	if (id >= TRACE_ID_COUNT || formats[id] == NULL) {
+		return "unknown trace %d %d %d\n";
+	}
+	return formats[id];
+}
+
+uint32_t lmic_traceDropped() {
+	return ring.dropped;
+}
+
+void lmic_traceFlush() {
+	static uint32_t reportedDropped = 0;
+	lmicTraceEntry_t e;
+
+	while (lmic_tracePop(&e)) {
+		Log("[%u] ", e.time);
+		Log(lmic_traceFormat(e.id), e.args[0], e.args[1], e.args[2]);
+	}
+	if (ring.dropped != reportedDropped) {
+		Log("lmic trace: %u entries dropped\n", ring.dropped - reportedDropped);
+		reportedDropped = ring.dropped;
+	}
+}
+
+static void LmicTraceTask(void* pvParameters) {
+	for (;;) {
+		lmic_traceFlush();
+		vTaskDelay(LMIC_TRACE_FLUSH_MS / portTICK_PERIOD_MS);
+	}
+}
+
+void lmic_traceInit() {
+#if LMIC_TRACE_LEVEL > LMIC_TRACE_LEVEL_NONE
+	BaseType_t ret = xTaskCreate(LmicTraceTask, "lmic trace", 256, (void *) 0, tskIDLE_PRIORITY + 1, NULL);
+	configASSERT(ret == pdPASS);
+#endif
+}
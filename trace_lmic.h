@@ -0,0 +1,113 @@
+#ifndef DRV_LORAWAN_LMIC_TRACE_LMIC_H_
+#define DRV_LORAWAN_LMIC_TRACE_LMIC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Binary trace ring for the LMIC task and IRQ hot paths.
+ *
+ * Trace points only store an event id, the ostick timestamp and up to 3 arguments.
+ * Formatting is deferred to a low priority consumer task (or a host decoder reading
+ * the raw entries), so no printf runs next to RX windows.
+ *
+ * Producers are lock-free and may run in task and IRQ context. When the ring is full
+ * the oldest entries are overwritten and counted as dropped.
+ */
+
+#define LMIC_TRACE_LEVEL_NONE 0
+#define LMIC_TRACE_LEVEL_ERR 1
+#define LMIC_TRACE_LEVEL_INFO 2
+#define LMIC_TRACE_LEVEL_DEBUG 3
+
+#ifndef LMIC_TRACE_LEVEL
+#define LMIC_TRACE_LEVEL LMIC_TRACE_LEVEL_INFO
+#endif
+
+// Number of entries, must be a power of two
+#ifndef LMIC_TRACE_RING_SIZE
+#define LMIC_TRACE_RING_SIZE 64
+#endif
+
+// Poll interval of the consumer task
+#ifndef LMIC_TRACE_FLUSH_MS
+#define LMIC_TRACE_FLUSH_MS 100
+#endif
+
+// Keep in sync with the format table in trace_lmic.c.
+// Host decoders of raw entries rely on the numbers: only append new ids before TRACE_ID_COUNT.
+typedef enum {
+	TRACE_TASK_CREATED,
+	TRACE_TASK_STARTED,
+	TRACE_NETWORK_INFO,
+	TRACE_INVALID_TXPOWER,
+	TRACE_DR_TXPOW,
+	TRACE_ADR,
+	TRACE_JOIN_STARTED,
+	TRACE_ALREADY_JOINED,
+	TRACE_ABP_JOINED,
+	TRACE_ALREADY_SLEEPING,
+	TRACE_ALREADY_RUNNING,
+	TRACE_SLEEPING,
+	TRACE_SKIP_SECONDS,
+	TRACE_RUNNING,
+	TRACE_SEND_QUEUED,
+	TRACE_SX_IRQ,
+	TRACE_ASSERT_CALLED,
+	TRACE_EV_JOINED,
+	TRACE_EV_JOINING,
+	TRACE_EV_RESET,
+	TRACE_EV_TXCOMPLETE,
+	TRACE_EV_RXDATA,
+	TRACE_EV_RXCOMPLETE,
+	TRACE_EV_UNHANDLED,
+	TRACE_TICKS_PER_SEC,
+	TRACE_HAL_ASSERT,
+	TRACE_EV_JOIN_FAILED,
+	TRACE_DOWNLINK_OVERRUN,
+	TRACE_DOWNLINK_UNHANDLED,
+	TRACE_CHANNEL_PLAN,
+	TRACE_TX_RATE,
+	TRACE_ID_COUNT
+} lmicTraceId_t;
+
+typedef struct {
+	uint32_t seq; // reservation index + 1 once committed, 0 while written
+	uint32_t time; // osticks
+	uint32_t args[3];
+	uint8_t id;
+} lmicTraceEntry_t;
+
+#if LMIC_TRACE_LEVEL > LMIC_TRACE_LEVEL_NONE
+void lmic_trace(uint8_t id, uint32_t a0, uint32_t a1, uint32_t a2);
+#endif
+
+#if LMIC_TRACE_LEVEL >= LMIC_TRACE_LEVEL_ERR
+#define TRACE_ERR(id, a0, a1, a2) lmic_trace((id), (uint32_t) (a0), (uint32_t) (a1), (uint32_t) (a2))
+#else
+#define TRACE_ERR(id, a0, a1, a2)
+#endif
+
+#if LMIC_TRACE_LEVEL >= LMIC_TRACE_LEVEL_INFO
+#define TRACE_INFO(id, a0, a1, a2) lmic_trace((id), (uint32_t) (a0), (uint32_t) (a1), (uint32_t) (a2))
+#else
+#define TRACE_INFO(id, a0, a1, a2)
+#endif
+
+#if LMIC_TRACE_LEVEL >= LMIC_TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(id, a0, a1, a2) lmic_trace((id), (uint32_t) (a0), (uint32_t) (a1), (uint32_t) (a2))
+#else
+#define TRACE_DEBUG(id, a0, a1, a2)
+#endif
+
+// Creates the consumer task
+void lmic_traceInit();
+// Take the oldest committed entry, false if there is none
+bool lmic_tracePop(lmicTraceEntry_t* entry);
+// Format all pending entries synchronously, e.g. before a fatal assert
+void lmic_traceFlush();
+// printf format of an event id, for host side decoders
+const char* lmic_traceFormat(uint8_t id);
+uint32_t lmic_traceDropped();
+
+#endif /* DRV_LORAWAN_LMIC_TRACE_LMIC_H_ */